@@ -55,6 +55,8 @@ def main():
     parser.add_argument("--debug", action="store_true") # default is false
     parser.add_argument("--image_dump", action="store_true") # default is false
     parser.add_argument("--minor_differences", default="false") # default is false
+    parser.add_argument("--stats_format", default="csv") # csv, jsonl or csv,jsonl
+    parser.add_argument("--in_process_raster", action="store_true") # pixelbasher renders the PDFs itself, needs a build with make POPPLER=1
     args = parser.parse_args()
 
     DEBUG = args.debug
@@ -1090,124 +1092,134 @@ def main():
     HISTORY_DIR = args.history_dir
 
     resolution = int(args.resolution) // 2
-    # Convert the MSO PDF to bmp's
-    subprocess.run([
-        "magick",
-        "-density", str(resolution),
-        f"{MS_ORIG}",
-        "-colorspace", "Gray",
-        "-define", "bmp:format=bmp4",
-        "-alpha", "remove",
-        "-alpha", "on",
-        CONVERTED_DIR + "/authoritative-page.bmp"
-    ])
-
-    # Convert the LO PDF to bmp's
-    subprocess.run([
-        "magick",
-        "-density", str(resolution),
-        f"{LO_ORIG}",
-        "-colorspace", "Gray",
-        "-define", "bmp:format=bmp4",
-        "-alpha", "remove",
-        "-alpha", "on",
-        CONVERTED_DIR + "/import-page.bmp"
-    ])
-
-    # Convert the MSO Roundtripped PDF's to BMP's
-    subprocess.run([
-        "magick",
-        "-density", str(resolution),
-        f"{MS_CONV}",
-        "-colorspace", "Gray",
-        "-define", "bmp:format=bmp4",
-        "-alpha", "remove",
-        "-alpha", "on",
-        CONVERTED_DIR + "/export-page.bmp"
-    ])
+    raster_options = []
+    if args.in_process_raster:
+        # pixelbasher renders the pages of each PDF itself, no BMP files are written
+        ms_orig_pages = [MS_ORIG]
+        lo_pages = [LO_ORIG]
+        ms_conv_pages = [MS_CONV]
+        lo_previous_pages = [LO_PREV] if IS_FILE_LO_PREV else []
+        ms_conv_previous_pages = [MS_PREV] if IS_FILE_MS_PREV else []
+        raster_options = ["--pdf-dpi=" + str(resolution), "--pdf-max-pages=" + str(MAX_PAGES)]
+    else:
+        # Convert the MSO PDF to bmp's
+        subprocess.run([
+            "magick",
+            "-density", str(resolution),
+            f"{MS_ORIG}",
+            "-colorspace", "Gray",
+            "-define", "bmp:format=bmp4",
+            "-alpha", "remove",
+            "-alpha", "on",
+            CONVERTED_DIR + "/authoritative-page.bmp"
+        ])
 
-    # Convert to the previous LO PDF's to BMP's
-    if IS_FILE_LO_PREV:
+        # Convert the LO PDF to bmp's
         subprocess.run([
             "magick",
             "-density", str(resolution),
-            f"{LO_PREV}",
+            f"{LO_ORIG}",
             "-colorspace", "Gray",
             "-define", "bmp:format=bmp4",
             "-alpha", "remove",
             "-alpha", "on",
-            args.history_dir + "/import-page.bmp"
+            CONVERTED_DIR + "/import-page.bmp"
         ])
 
-    # Convert the previus MSO Roundtripped PDF's to BMP's
-    if IS_FILE_MS_PREV:
+        # Convert the MSO Roundtripped PDF's to BMP's
         subprocess.run([
             "magick",
             "-density", str(resolution),
-            f"{MS_PREV}",
+            f"{MS_CONV}",
             "-colorspace", "Gray",
             "-define", "bmp:format=bmp4",
             "-alpha", "remove",
             "-alpha", "on",
-             args.history_dir + "/export-page.bmp"
+            CONVERTED_DIR + "/export-page.bmp"
         ])
 
+        # Convert to the previous LO PDF's to BMP's
+        if IS_FILE_LO_PREV:
+            subprocess.run([
+                "magick",
+                "-density", str(resolution),
+                f"{LO_PREV}",
+                "-colorspace", "Gray",
+                "-define", "bmp:format=bmp4",
+                "-alpha", "remove",
+                "-alpha", "on",
+                args.history_dir + "/import-page.bmp"
+            ])
 
+        # Convert the previus MSO Roundtripped PDF's to BMP's
+        if IS_FILE_MS_PREV:
+            subprocess.run([
+                "magick",
+                "-density", str(resolution),
+                f"{MS_PREV}",
+                "-colorspace", "Gray",
+                "-define", "bmp:format=bmp4",
+                "-alpha", "remove",
+                "-alpha", "on",
+                 args.history_dir + "/export-page.bmp"
+            ])
 
-    # Sorting pages o ensure that pages are compared in the same order, eg, auth-page 1 with import-page 1, etc...
-    ms_orig_pages = sorted(glob.glob(os.path.join(CONVERTED_DIR, "authoritative-*.bmp")))
-    lo_pages = sorted(glob.glob(os.path.join(CONVERTED_DIR, "import-*.bmp")))
-    ms_conv_pages = sorted(glob.glob(os.path.join(CONVERTED_DIR, "export-*.bmp")))
-    lo_previous_pages = []
-    ms_conv_previous_pages = []
 
-    if IS_FILE_LO_PREV:
-        lo_previous_pages = sorted(glob.glob(os.path.join(HISTORY_DIR, "import-*.bmp")))
-    if IS_FILE_MS_PREV:
-        ms_conv_previous_pages = sorted(glob.glob(os.path.join(HISTORY_DIR, "export-*.bmp")))
 
-    # initially converted all pages to bmp's so we can collect these stats
-    with open('diff-pdf-' + file_ext[1][1:] + '-statistics-anomalies.csv', 'a') as f:
-        if IS_FILE_LO_PREV and len(lo_pages) != len(lo_previous_pages):
-            f.write(args.base_file + f",import,page count different form {args.history_dir} [{len(lo_previous_pages)}] and converted [{len(lo_pages)}]. Should be[{len(ms_orig_pages)}]" + '\n')
-        if IS_FILE_MS_PREV and len(ms_conv_pages) != len(ms_conv_previous_pages):
-            f.write(args.base_file + f",export,page count different form {args.history_dir} [{len(ms_conv_previous_pages)}] and converted [{len(ms_conv_pages)}]. Should be[{len(ms_orig_pages)}]" + '\n')
-        if len(lo_pages) != len(ms_orig_pages):
-            f.write(args.base_file + f",import, absolute page count, {len(lo_pages)}, should be, {len(ms_orig_pages)}" + '\n')
-        if len(ms_conv_pages) != len(ms_orig_pages):
-            f.write(args.base_file + f",export, absolute page count, {len(ms_conv_pages)}, should be, {len(ms_orig_pages)}" + '\n')
+        # Sorting pages o ensure that pages are compared in the same order, eg, auth-page 1 with import-page 1, etc...
+        ms_orig_pages = sorted(glob.glob(os.path.join(CONVERTED_DIR, "authoritative-*.bmp")))
+        lo_pages = sorted(glob.glob(os.path.join(CONVERTED_DIR, "import-*.bmp")))
+        ms_conv_pages = sorted(glob.glob(os.path.join(CONVERTED_DIR, "export-*.bmp")))
+        lo_previous_pages = []
+        ms_conv_previous_pages = []
 
+        if IS_FILE_LO_PREV:
+            lo_previous_pages = sorted(glob.glob(os.path.join(HISTORY_DIR, "import-*.bmp")))
+        if IS_FILE_MS_PREV:
+            ms_conv_previous_pages = sorted(glob.glob(os.path.join(HISTORY_DIR, "export-*.bmp")))
 
-    # if there a mismtach in the number of pages, get the lowest number of pages from the pdf's, so no error will be thrown
-    min_page_count = min(len(ms_orig_pages), len(lo_pages), len(ms_conv_pages))
-    if IS_FILE_LO_PREV:
-        min_page_count = min(len(lo_previous_pages), min_page_count)
-    if IS_FILE_MS_PREV:
-        min_page_count = min(len(ms_conv_previous_pages), min_page_count)
-    min_page_count = min(MAX_PAGES, min_page_count)
+        # initially converted all pages to bmp's so we can collect these stats
+        with open('diff-pdf-' + file_ext[1][1:] + '-statistics-anomalies.csv', 'a') as f:
+            if IS_FILE_LO_PREV and len(lo_pages) != len(lo_previous_pages):
+                f.write(args.base_file + f",import,page count different form {args.history_dir} [{len(lo_previous_pages)}] and converted [{len(lo_pages)}]. Should be[{len(ms_orig_pages)}]" + '\n')
+            if IS_FILE_MS_PREV and len(ms_conv_pages) != len(ms_conv_previous_pages):
+                f.write(args.base_file + f",export,page count different form {args.history_dir} [{len(ms_conv_previous_pages)}] and converted [{len(ms_conv_pages)}]. Should be[{len(ms_orig_pages)}]" + '\n')
+            if len(lo_pages) != len(ms_orig_pages):
+                f.write(args.base_file + f",import, absolute page count, {len(lo_pages)}, should be, {len(ms_orig_pages)}" + '\n')
+            if len(ms_conv_pages) != len(ms_orig_pages):
+                f.write(args.base_file + f",export, absolute page count, {len(ms_conv_pages)}, should be, {len(ms_orig_pages)}" + '\n')
 
-    # remove any pages from each set which are above the min_page threshold
-    for page in ms_orig_pages[min_page_count:]:
-        os.remove(page)
-    ms_orig_pages = ms_orig_pages[:min_page_count]
 
-    for page in lo_pages[min_page_count:]:
-        os.remove(page)
-    lo_pages = lo_pages[:min_page_count]
+        # if there a mismtach in the number of pages, get the lowest number of pages from the pdf's, so no error will be thrown
+        min_page_count = min(len(ms_orig_pages), len(lo_pages), len(ms_conv_pages))
+        if IS_FILE_LO_PREV:
+            min_page_count = min(len(lo_previous_pages), min_page_count)
+        if IS_FILE_MS_PREV:
+            min_page_count = min(len(ms_conv_previous_pages), min_page_count)
+        min_page_count = min(MAX_PAGES, min_page_count)
 
-    for page in ms_conv_pages[min_page_count:]:
-        os.remove(page)
-    ms_conv_pages = ms_conv_pages[:min_page_count]
+        # remove any pages from each set which are above the min_page threshold
+        for page in ms_orig_pages[min_page_count:]:
+            os.remove(page)
+        ms_orig_pages = ms_orig_pages[:min_page_count]
 
-    if IS_FILE_LO_PREV:
-        for page in lo_previous_pages[min_page_count:]:
+        for page in lo_pages[min_page_count:]:
             os.remove(page)
-        lo_previous_pages = lo_previous_pages[:min_page_count]
+        lo_pages = lo_pages[:min_page_count]
 
-    if IS_FILE_MS_PREV:
-        for page in ms_conv_previous_pages[min_page_count:]:
+        for page in ms_conv_pages[min_page_count:]:
             os.remove(page)
-        ms_conv_previous_pages = ms_conv_previous_pages[:min_page_count]
+        ms_conv_pages = ms_conv_pages[:min_page_count]
+
+        if IS_FILE_LO_PREV:
+            for page in lo_previous_pages[min_page_count:]:
+                os.remove(page)
+            lo_previous_pages = lo_previous_pages[:min_page_count]
+
+        if IS_FILE_MS_PREV:
+            for page in ms_conv_previous_pages[min_page_count:]:
+                os.remove(page)
+            ms_conv_previous_pages = ms_conv_previous_pages[:min_page_count]
 
     try:
         base_dir = os.path.dirname(os.path.abspath(__file__)) + os.sep
@@ -1218,6 +1230,8 @@ def main():
         # Run pixelbasher to compare differences between MSO and LO PDF pages
         subprocess.run(
             [PIXELBASHER_BIN] +
+            ["--stats-format=" + args.stats_format] +
+            raster_options +
             [args.base_file] +
             ms_orig_pages +
             lo_pages +
@@ -1240,21 +1254,22 @@ def main():
         print("An exception has occured with the Pixelbasher program", e)
 
     finally:
-        for page in ms_orig_pages:
-            os.remove(page)
-        for page in lo_pages:
-            os.remove(page)
-        for page in ms_conv_pages:
-            os.remove(page)
-
-        if IS_FILE_LO_PREV:
-            for page in lo_previous_pages:
+        if not args.in_process_raster:
+            for page in ms_orig_pages:
                 os.remove(page)
-
-        if IS_FILE_MS_PREV:
-            for page in ms_conv_previous_pages:
+            for page in lo_pages:
+                os.remove(page)
+            for page in ms_conv_pages:
                 os.remove(page)
 
+            if IS_FILE_LO_PREV:
+                for page in lo_previous_pages:
+                    os.remove(page)
+
+            if IS_FILE_MS_PREV:
+                for page in ms_conv_previous_pages:
+                    os.remove(page)
+
 if __name__ == "__main__":
     main()
 
@@ -0,0 +1,443 @@
+//
+//
+// Copyright the mso-test contributors
+//
+// SPDX-License-Identifier: MPL-2.0
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+// Python bindings of the comparison engine, built with make python:
+//
+//   import pixelbasher
+//   page = pixelbasher.Page(width, height)     # BGRA, bottom row first, all zero
+//   memoryview(page).cast("B")[:] = pixels     # or render straight into it, no copy is made
+//   page.analyse()
+//   diff = pixelbasher.compare(base, page)
+//   stats = pixelbasher.statistics("name.doc", 1, base, page, diff)
+//
+// A Page owns its pixels and exports them over the buffer protocol (shape height x width x 4, writable),
+// so a driver can keep pages in memory and fill or read them without going through BMP files. The GIL is
+// released while analysing and comparing, so pages can be compared from several Python threads at once.
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+
+#include <algorithm>
+#include <exception>
+#include <new>
+#include <string>
+
+#include "bmp.hpp"
+#include "pixelbasher.hpp"
+#include "statistics.hpp"
+
+namespace
+{
+struct PageObject
+{
+    PyObject_HEAD
+    BMP bmp;
+    bool analysed;
+    Py_ssize_t shape[3];
+    Py_ssize_t strides[3];
+};
+
+PyTypeObject page_type = {PyVarObject_HEAD_INIT(nullptr, 0)};
+
+// the engine scratch buffers, one set per calling thread as in the pixelbasher workers
+CompareWorkspace &workspace()
+{
+    thread_local CompareWorkspace workspace;
+    return workspace;
+}
+
+PageObject *new_page()
+{
+    PageObject *page = reinterpret_cast<PageObject *>(page_type.tp_alloc(&page_type, 0));
+    if (page)
+    {
+        new (&page->bmp) BMP();
+        page->analysed = false;
+    }
+    return page;
+}
+
+// Runs the engine with the GIL released and turns a C++ exception into a Python one,
+// returns false when an exception was raised
+template <typename Function>
+bool run_without_gil(Function &&function)
+{
+    std::string error;
+    Py_BEGIN_ALLOW_THREADS
+    try
+    {
+        function();
+    }
+    catch (const std::exception &e)
+    {
+        error = e.what();
+        if (error.empty())
+            error = "unknown error";
+    }
+    Py_END_ALLOW_THREADS
+
+    if (!error.empty())
+    {
+        PyErr_SetString(PyExc_RuntimeError, error.c_str());
+        return false;
+    }
+    return true;
+}
+
+// the pages a comparison reads need their edge masks, analysing again after the pixels changed is up to the caller
+bool check_analysed(PyObject *object, const char *name)
+{
+    if (!reinterpret_cast<PageObject *>(object)->analysed)
+    {
+        PyErr_Format(PyExc_ValueError, "%s page is not analysed, call analyse() once its pixels are filled in", name);
+        return false;
+    }
+    return true;
+}
+
+PyObject *page_new(PyTypeObject *, PyObject *args, PyObject *kwargs)
+{
+    static const char *keywords[] = {"width", "height", nullptr};
+    int width, height;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "ii", const_cast<char **>(keywords), &width, &height))
+        return nullptr;
+    if (width <= 0 || height <= 0)
+    {
+        PyErr_SetString(PyExc_ValueError, "width and height must be positive");
+        return nullptr;
+    }
+
+    PageObject *page = new_page();
+    if (!page)
+        return nullptr;
+    try
+    {
+        page->bmp = BMP(width, height, PixelBuffer(static_cast<std::size_t>(width) * height * pixel_stride));
+    }
+    catch (const std::exception &e)
+    {
+        Py_DECREF(page);
+        PyErr_SetString(PyExc_MemoryError, e.what());
+        return nullptr;
+    }
+    return reinterpret_cast<PyObject *>(page);
+}
+
+void page_dealloc(PyObject *self)
+{
+    reinterpret_cast<PageObject *>(self)->bmp.~BMP();
+    Py_TYPE(self)->tp_free(self);
+}
+
+// every view is writable, the pixel count of a page never changes so views stay valid for its lifetime
+int page_getbuffer(PyObject *self, Py_buffer *view, int flags)
+{
+    PageObject *page = reinterpret_cast<PageObject *>(self);
+    if (page->bmp.get_data().empty())
+    {
+        PyErr_SetString(PyExc_BufferError, "the page has no pixels");
+        view->obj = nullptr;
+        return -1;
+    }
+
+    PixelBuffer &data = page->bmp.get_mutable_data();
+    page->shape[0] = page->bmp.get_height();
+    page->shape[1] = page->bmp.get_width();
+    page->shape[2] = pixel_stride;
+    page->strides[0] = static_cast<Py_ssize_t>(page->bmp.get_width()) * pixel_stride;
+    page->strides[1] = pixel_stride;
+    page->strides[2] = 1;
+
+    view->buf = data.data();
+    view->obj = Py_NewRef(self);
+    view->len = static_cast<Py_ssize_t>(data.size());
+    view->readonly = 0;
+    view->itemsize = 1;
+    view->format = (flags & PyBUF_FORMAT) ? const_cast<char *>("B") : nullptr;
+    view->ndim = 3;
+    view->shape = (flags & PyBUF_ND) ? page->shape : nullptr;
+    view->strides = (flags & PyBUF_STRIDES) == PyBUF_STRIDES ? page->strides : nullptr;
+    view->suboffsets = nullptr;
+    view->internal = nullptr;
+    if (!(flags & PyBUF_ND))
+        view->ndim = 1;
+    return 0;
+}
+
+PyObject *page_read(PyObject *, PyObject *args)
+{
+    const char *filename;
+    if (!PyArg_ParseTuple(args, "s", &filename))
+        return nullptr;
+
+    PageObject *page = new_page();
+    if (!page)
+        return nullptr;
+    if (!run_without_gil([&] { page->bmp = BMP(filename); }))
+    {
+        Py_DECREF(page);
+        return nullptr;
+    }
+    page->analysed = true;
+    return reinterpret_cast<PyObject *>(page);
+}
+
+PyObject *page_analyse(PyObject *self, PyObject *)
+{
+    PageObject *page = reinterpret_cast<PageObject *>(self);
+    page->bmp.get_mutable_data(); // the pixels may have been written through a view since they were last analysed
+    if (!run_without_gil([&] { page->bmp.analyse(); }))
+        return nullptr;
+    page->analysed = true;
+    Py_RETURN_NONE;
+}
+
+PyObject *page_write(PyObject *self, PyObject *args, PyObject *kwargs)
+{
+    static const char *keywords[] = {"filename", "indexed", nullptr};
+    const char *filename;
+    int indexed = 0;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "s|p", const_cast<char **>(keywords), &filename, &indexed))
+        return nullptr;
+
+    PageObject *page = reinterpret_cast<PageObject *>(self);
+    if (!run_without_gil([&] {
+            if (indexed)
+                page->bmp.write_indexed(filename, PixelBasher::diff_colours());
+            else
+                page->bmp.write(filename);
+        }))
+        return nullptr;
+    Py_RETURN_NONE;
+}
+
+PyObject *page_get_width(PyObject *self, void *) { return PyLong_FromLong(reinterpret_cast<PageObject *>(self)->bmp.get_width()); }
+PyObject *page_get_height(PyObject *self, void *) { return PyLong_FromLong(reinterpret_cast<PageObject *>(self)->bmp.get_height()); }
+PyObject *page_get_analysed(PyObject *self, void *) { return PyBool_FromLong(reinterpret_cast<PageObject *>(self)->analysed); }
+PyObject *page_get_background(PyObject *self, void *) { return PyLong_FromLong(reinterpret_cast<PageObject *>(self)->bmp.get_background_value()); }
+PyObject *page_get_non_background(PyObject *self, void *) { return PyLong_FromLongLong(reinterpret_cast<PageObject *>(self)->bmp.get_non_background_count()); }
+PyObject *page_get_red_count(PyObject *self, void *) { return PyLong_FromLongLong(reinterpret_cast<PageObject *>(self)->bmp.get_red_count()); }
+PyObject *page_get_yellow_count(PyObject *self, void *) { return PyLong_FromLongLong(reinterpret_cast<PageObject *>(self)->bmp.get_yellow_count()); }
+
+// the diff regions as (x, y, width, height, area, red, minor, vertical_edge), y counted from the top
+PyObject *page_get_regions(PyObject *self, void *)
+{
+    const BMP &bmp = reinterpret_cast<PageObject *>(self)->bmp;
+    PyObject *list = PyList_New(0);
+    if (!list)
+        return nullptr;
+    for (const DiffRegion &region : bmp.get_regions())
+    {
+        PyObject *item = Py_BuildValue("(iiiiLLLL)", region.left, bmp.get_height() - 1 - region.top, region.width(), region.height(),
+                                       static_cast<long long>(region.area), static_cast<long long>(region.red),
+                                       static_cast<long long>(region.minor), static_cast<long long>(region.vertical_edge));
+        if (!item || PyList_Append(list, item) < 0)
+        {
+            Py_XDECREF(item);
+            Py_DECREF(list);
+            return nullptr;
+        }
+        Py_DECREF(item);
+    }
+    return list;
+}
+
+PyMethodDef page_methods[] = {
+    {"read", page_read, METH_VARARGS | METH_STATIC, "read(filename) -> Page, a BMP file read and analysed"},
+    {"analyse", page_analyse, METH_NOARGS, "analyse(), background, non-background count and edge masks of the current pixels"},
+    {"write", reinterpret_cast<PyCFunction>(reinterpret_cast<void (*)()>(page_write)), METH_VARARGS | METH_KEYWORDS,
+     "write(filename, indexed=False), as a 32-bit or 8-bit palettised BMP"},
+    {nullptr, nullptr, 0, nullptr}};
+
+PyGetSetDef page_getset[] = {
+    {"width", page_get_width, nullptr, nullptr, nullptr},
+    {"height", page_get_height, nullptr, nullptr, nullptr},
+    {"analysed", page_get_analysed, nullptr, "true once read() or analyse() ran", nullptr},
+    {"background", page_get_background, nullptr, "background gray level, once analysed", nullptr},
+    {"non_background", page_get_non_background, nullptr, "pixels away from the background, once analysed", nullptr},
+    {"red_count", page_get_red_count, nullptr, "red pixels of a diff", nullptr},
+    {"yellow_count", page_get_yellow_count, nullptr, "yellow pixels of a diff", nullptr},
+    {"regions", page_get_regions, nullptr, "largest regions of a diff, when regions were asked for", nullptr},
+    {nullptr, nullptr, nullptr, nullptr, nullptr}};
+
+PyBufferProcs page_buffer = {page_getbuffer, nullptr};
+
+PyObject *module_compare(PyObject *, PyObject *args, PyObject *kwargs)
+{
+    static const char *keywords[] = {"base", "target", "minor_differences", "max_regions", nullptr};
+    PyObject *base, *target;
+    int minor_differences = 0;
+    Py_ssize_t max_regions = 0;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O!O!|pn", const_cast<char **>(keywords), &page_type, &base, &page_type, &target,
+                                     &minor_differences, &max_regions))
+        return nullptr;
+    if (!check_analysed(base, "base") || !check_analysed(target, "target"))
+        return nullptr;
+
+    PageObject *diff = new_page();
+    if (!diff)
+        return nullptr;
+    const BMP &base_bmp = reinterpret_cast<PageObject *>(base)->bmp;
+    const BMP &target_bmp = reinterpret_cast<PageObject *>(target)->bmp;
+    if (!run_without_gil([&] {
+            CompareWorkspace &scratch = workspace();
+            scratch.max_regions = static_cast<std::size_t>(max_regions);
+            PixelBasher::compare_bmps(base_bmp, target_bmp, minor_differences, diff->bmp, scratch);
+        }))
+    {
+        Py_DECREF(diff);
+        return nullptr;
+    }
+    return reinterpret_cast<PyObject *>(diff);
+}
+
+PyObject *module_compare_regressions(PyObject *, PyObject *args)
+{
+    PyObject *base, *current, *previous;
+    if (!PyArg_ParseTuple(args, "O!O!O!", &page_type, &base, &page_type, &current, &page_type, &previous))
+        return nullptr;
+
+    // the previous diff is read over the overlap of the base and the current diff
+    const BMP &base_bmp = reinterpret_cast<PageObject *>(base)->bmp;
+    const BMP &current_bmp = reinterpret_cast<PageObject *>(current)->bmp;
+    const BMP &previous_bmp = reinterpret_cast<PageObject *>(previous)->bmp;
+    if (previous_bmp.get_width() < std::min(base_bmp.get_width(), current_bmp.get_width()) ||
+        previous_bmp.get_height() < std::min(base_bmp.get_height(), current_bmp.get_height()))
+    {
+        PyErr_SetString(PyExc_ValueError, "previous_diff is smaller than the overlap of base and current_diff");
+        return nullptr;
+    }
+
+    PageObject *diff = new_page();
+    if (!diff)
+        return nullptr;
+    if (!run_without_gil([&] { PixelBasher::compare_regressions(base_bmp, current_bmp, previous_bmp, diff->bmp); }))
+    {
+        Py_DECREF(diff);
+        return nullptr;
+    }
+    return reinterpret_cast<PyObject *>(diff);
+}
+
+PyObject *module_compare_three_way(PyObject *, PyObject *args, PyObject *kwargs)
+{
+    static const char *keywords[] = {"base", "current", "previous", "minor_differences", "max_regions", nullptr};
+    PyObject *base, *current, *previous;
+    int minor_differences = 0;
+    Py_ssize_t max_regions = 0;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O!O!O!|pn", const_cast<char **>(keywords), &page_type, &base, &page_type, &current,
+                                     &page_type, &previous, &minor_differences, &max_regions))
+        return nullptr;
+    if (!check_analysed(base, "base") || !check_analysed(current, "current") || !check_analysed(previous, "previous"))
+        return nullptr;
+
+    PageObject *current_diff = new_page();
+    PageObject *previous_diff = new_page();
+    PageObject *regressions = new_page();
+    RegressionCounts counts;
+    bool ok = current_diff && previous_diff && regressions && run_without_gil([&] {
+                  CompareWorkspace &scratch = workspace();
+                  scratch.max_regions = static_cast<std::size_t>(max_regions);
+                  counts = PixelBasher::compare_three_way(reinterpret_cast<PageObject *>(base)->bmp, reinterpret_cast<PageObject *>(current)->bmp,
+                                                          reinterpret_cast<PageObject *>(previous)->bmp, minor_differences,
+                                                          current_diff->bmp, previous_diff->bmp, regressions->bmp, scratch);
+              });
+    if (!ok)
+    {
+        Py_XDECREF(current_diff);
+        Py_XDECREF(previous_diff);
+        Py_XDECREF(regressions);
+        return nullptr;
+    }
+    return Py_BuildValue("(NNN(LLL))", current_diff, previous_diff, regressions, static_cast<long long>(counts.persisting),
+                         static_cast<long long>(counts.regressed), static_cast<long long>(counts.fixed));
+}
+
+// the row pixelbasher would write to the statistics files, as a dict with its CSV and JSON lines forms
+PyObject *module_statistics(PyObject *, PyObject *args, PyObject *kwargs)
+{
+    static const char *keywords[] = {"basename", "page", "base", "current", "diff", "previous", "previous_diff", "regression_counts", nullptr};
+    const char *basename;
+    int page_number;
+    PyObject *base, *current, *diff;
+    PyObject *previous = nullptr, *previous_diff = nullptr;
+    long long persisting = 0, regressed = 0, fixed = 0;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "siO!O!O!|O!O!(LLL)", const_cast<char **>(keywords), &basename, &page_number, &page_type, &base,
+                                     &page_type, &current, &page_type, &diff, &page_type, &previous, &page_type, &previous_diff,
+                                     &persisting, &regressed, &fixed))
+        return nullptr;
+    RegressionCounts counts{persisting, regressed, fixed};
+    if (!previous != !previous_diff)
+    {
+        PyErr_SetString(PyExc_TypeError, "previous and previous_diff go together");
+        return nullptr;
+    }
+
+    PageStatistics stats = PageStatistics::from_pages(basename, page_number, reinterpret_cast<PageObject *>(base)->bmp,
+                                                      reinterpret_cast<PageObject *>(current)->bmp, reinterpret_cast<PageObject *>(diff)->bmp);
+    if (previous)
+        stats.set_previous(reinterpret_cast<PageObject *>(previous)->bmp, reinterpret_cast<PageObject *>(previous_diff)->bmp, counts);
+    const BMP &diff_bmp = reinterpret_cast<PageObject *>(diff)->bmp;
+    if (diff_bmp.get_region_count() > 0 || !diff_bmp.get_regions().empty())
+        stats.set_regions(diff_bmp);
+
+    std::string csv = StatisticsSink::format_csv(stats);
+    std::string json = StatisticsSink::format_json(stats);
+    return Py_BuildValue("{s:s,s:i,s:L,s:L,s:L,s:L,s:L,s:L,s:L,s:L,s:s#,s:s#}", "basename", stats.basename.c_str(), "page", stats.page_number,
+                         "base_total_pixels", static_cast<long long>(stats.base_total_pixels),
+                         "base_non_background", static_cast<long long>(stats.base_non_background),
+                         "current_total_pixels", static_cast<long long>(stats.current_total_pixels),
+                         "current_non_background", static_cast<long long>(stats.current_non_background),
+                         "red_count", static_cast<long long>(stats.red_count),
+                         "previous_total_pixels", static_cast<long long>(stats.previous_total_pixels),
+                         "previous_non_background", static_cast<long long>(stats.previous_non_background),
+                         "previous_red_count", static_cast<long long>(stats.previous_red_count),
+                         "csv", csv.data(), static_cast<Py_ssize_t>(csv.size()), "json", json.data(), static_cast<Py_ssize_t>(json.size()));
+}
+
+PyMethodDef module_methods[] = {
+    {"compare", reinterpret_cast<PyCFunction>(reinterpret_cast<void (*)()>(module_compare)), METH_VARARGS | METH_KEYWORDS,
+     "compare(base, target, minor_differences=False, max_regions=0) -> Page, the diff drawn over the base page"},
+    {"compare_regressions", module_compare_regressions, METH_VARARGS,
+     "compare_regressions(base, current_diff, previous_diff) -> Page, the regression map of two diffs"},
+    {"compare_three_way", reinterpret_cast<PyCFunction>(reinterpret_cast<void (*)()>(module_compare_three_way)), METH_VARARGS | METH_KEYWORDS,
+     "compare_three_way(base, current, previous, minor_differences=False, max_regions=0)\n"
+     "-> (current_diff, previous_diff, regressions, (persisting, regressed, fixed)), in a single sweep"},
+    {"statistics", reinterpret_cast<PyCFunction>(reinterpret_cast<void (*)()>(module_statistics)), METH_VARARGS | METH_KEYWORDS,
+     "statistics(basename, page, base, current, diff, previous=None, previous_diff=None, regression_counts=(0, 0, 0)) -> dict"},
+    {nullptr, nullptr, 0, nullptr}};
+
+PyModuleDef module_definition = {PyModuleDef_HEAD_INIT, "pixelbasher", "Pixel comparison engine of pixelbasher", -1, module_methods};
+} // namespace
+
+PyMODINIT_FUNC PyInit_pixelbasher()
+{
+    page_type.tp_name = "pixelbasher.Page";
+    page_type.tp_doc = "Page(width, height), BGRA pixels bottom row first, exported over the buffer protocol";
+    page_type.tp_basicsize = sizeof(PageObject);
+    page_type.tp_flags = Py_TPFLAGS_DEFAULT;
+    page_type.tp_new = page_new;
+    page_type.tp_dealloc = page_dealloc;
+    page_type.tp_methods = page_methods;
+    page_type.tp_getset = page_getset;
+    page_type.tp_as_buffer = &page_buffer;
+    if (PyType_Ready(&page_type) < 0)
+        return nullptr;
+
+    PyObject *module = PyModule_Create(&module_definition);
+    if (!module)
+        return nullptr;
+    if (PyModule_AddObjectRef(module, "Page", reinterpret_cast<PyObject *>(&page_type)) < 0)
+    {
+        Py_DECREF(module);
+        return nullptr;
+    }
+    return module;
+}
@@ -0,0 +1,110 @@
+//
+//
+// Copyright the mso-test contributors
+//
+// SPDX-License-Identifier: MPL-2.0
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#include <algorithm>
+#include <limits>
+#include <stdexcept>
+#include <unistd.h>
+
+#include "band.hpp"
+
+namespace
+{
+constexpr long default_l2_size = 1024 * 1024; // when the C library does not know the cache
+
+// The rows of a strip whose pages, a diff drawn over each and their two mask rows take half the L2 cache, the
+// other half is left to the rows the kernels work in and the rest of the process
+int cache_strip_rows(std::initializer_list<BMP *> pages)
+{
+    static const long l2_size = []
+    {
+        const long size = sysconf(_SC_LEVEL2_CACHE_SIZE);
+        return size > 0 ? size : default_l2_size;
+    }();
+
+    std::size_t row_bytes = 0;
+    for (const BMP *page : pages)
+        row_bytes += static_cast<std::size_t>(page->get_width()) * (2 * pixel_stride + 2);
+    return static_cast<int>(std::clamp<std::size_t>(l2_size / 2 / std::max<std::size_t>(row_bytes, 1), 1, std::numeric_limits<int>::max()));
+}
+} // namespace
+
+void BandEngine::begin(std::initializer_list<BMP *> pages)
+{
+    if (pages.size() > m_bands.size())
+    {
+        throw std::runtime_error("The band engine compares at most " + std::to_string(m_bands.size()) + " pages at once");
+    }
+
+    const BMP &base = **pages.begin();
+    const bool same_width = std::all_of(pages.begin(), pages.end(), [&](const BMP *page) { return page->get_width() == base.get_width(); });
+    m_strip = m_strip_rows > 0 ? m_strip_rows : cache_strip_rows(pages);
+
+    // a ring holds the strip being compared and the rows analysed ahead of it, the analysis writes no row below it
+    m_band_count = 0;
+    for (BMP *page : pages)
+    {
+        Band &band = m_bands[m_band_count++];
+        band.page = page;
+        band.window = std::max(same_width ? std::min(m_strip + RowAnalyser::lag_rows, page->get_height()) : page->get_height(), 1);
+        band.analyser.begin(*page, band.blurred_edge_mask, band.vertical_edges, band.window);
+    }
+}
+
+void BandEngine::run(std::initializer_list<PageComparison *> comparisons)
+{
+    for (PageComparison *comparison : comparisons)
+    {
+        for (int index = 0; const BMP *page = comparison->get_page(index); index++)
+        {
+            const Band &band = band_of(*page);
+            comparison->set_edge_masks(index, {band.blurred_edge_mask.data(), band.vertical_edges.data(), band.window});
+        }
+    }
+
+    auto all_done = [&]
+    { return std::all_of(comparisons.begin(), comparisons.end(), [](const PageComparison *comparison) { return comparison->done(); }); };
+    for (int end = m_strip; !all_done(); end += m_strip)
+    {
+        for (std::size_t i = 0; i < m_band_count; i++)
+            m_bands[i].analyser.analyse(end);
+        for (PageComparison *comparison : comparisons)
+            comparison->compare_rows(ready_rows(*comparison));
+    }
+
+    // counting that stopped at the budget still has to know whether rows with content were left
+    for (std::size_t i = 0; i < m_band_count; i++)
+        m_bands[i].analyser.find_content();
+    for (PageComparison *comparison : comparisons)
+        comparison->finish();
+}
+
+const BandEngine::Band &BandEngine::band_of(const BMP &page) const
+{
+    for (std::size_t i = 0; i < m_band_count; i++)
+    {
+        if (m_bands[i].page == &page)
+            return m_bands[i];
+    }
+    throw std::runtime_error("A comparison of a page the band engine does not analyse");
+}
+
+// a page analysed to its top has every row a comparison can ask for, one shorter than the base included
+int BandEngine::ready_rows(const PageComparison &comparison) const
+{
+    int rows = std::numeric_limits<int>::max();
+    for (int index = 0; const BMP *page = comparison.get_page(index); index++)
+    {
+        const RowAnalyser &analyser = band_of(*page).analyser;
+        if (!analyser.done())
+            rows = std::min(rows, analyser.get_final_rows());
+    }
+    return rows;
+}
@@ -0,0 +1,58 @@
+//
+//
+// Copyright the mso-test contributors
+//
+// SPDX-License-Identifier: MPL-2.0
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#ifndef BAND_HPP
+#define BAND_HPP
+
+#include <array>
+#include <cstddef>
+#include <initializer_list>
+
+#include "bmp.hpp"
+#include "pixelbasher.hpp"
+
+// Analyses a base page and its targets and runs their comparisons in one sweep, bottom up in horizontal strips
+// (bands) sized to fit the L2 cache. A strip is analysed on every page and then classified, drawn and counted by
+// every comparison while it is still in cache, so the pixels come from memory once instead of once for the
+// analysis and once per comparison. The edge masks are rings holding the strip and the rows the analysis runs
+// ahead of it (RowAnalyser::lag_rows). Pages of different widths compare their masks over the narrower width,
+// which reaches into other rows of the wider page, so for those the rings are the whole page. Keep one per worker
+// thread, its rings are reused from page to page.
+class BandEngine
+{
+public:
+    // the rows of a strip, 0 sizes them to the L2 cache
+    void set_strip_rows(int rows) { m_strip_rows = rows; }
+
+    // Starts the analysis of the pages, the base first, which sets their background and margin, so comparisons
+    // of them can begin. The pages' own edge masks are emptied, the comparisons read the rings.
+    void begin(std::initializer_list<BMP *> pages);
+    // analyses and compares strip after strip until every comparison is done, then finishes them
+    void run(std::initializer_list<PageComparison *> comparisons);
+
+private:
+    struct Band
+    {
+        BMP *page = nullptr;
+        RowAnalyser analyser;
+        Mask blurred_edge_mask;
+        Mask vertical_edges;
+        int window = 1; // rows in the rings
+    };
+
+    const Band &band_of(const BMP &page) const;
+    int ready_rows(const PageComparison &comparison) const; // the rows of the comparison's pages that are analysed
+
+    int m_strip_rows = 0;
+    int m_strip = 1; // of the current pages
+    std::array<Band, 5> m_bands;
+    std::size_t m_band_count = 0;
+};
+#endif
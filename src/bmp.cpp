@@ -8,11 +8,17 @@
 // License, v. 2.0. If a copy of the MPL was not distributed with this
 // file, You can obtain one at http://mozilla.org/MPL/2.0/.
 
+#include <algorithm>
 #include <bit>
 #include <cmath>
+#include <cstring>
 #include <fstream>
+#include <limits>
 
 #include "bmp.hpp"
+#include "kernels.hpp"
+#include "output_store.hpp"
+#include "pixel.hpp"
 
 struct BMPColourHeader
 {
@@ -32,17 +38,89 @@ const static BMPColourHeader colour_header = {
     0x73524742,
     {}};
 
+namespace
+{
+// the 32-bit size fields of the headers, 0 for an image too large for them: readers work it out from the width and height
+std::uint32_t header_image_size(std::size_t bytes)
+{
+    return bytes > std::numeric_limits<std::uint32_t>::max() ? 0 : static_cast<std::uint32_t>(bytes);
+}
+} // namespace
+
+void GrayStatistics::reset()
+{
+    histogram.fill(0);
+    pixel_count = 0;
+}
+
+void GrayStatistics::add_row(const std::uint8_t *row, int width)
+{
+    std::uint32_t row_histogram[256] = {};
+    kernels().gray_histogram(row, 0, width - 1, row_histogram);
+    for (int gray = 0; gray < 256; gray++)
+        histogram[gray] += row_histogram[gray];
+    pixel_count += width;
+}
+
+std::uint64_t GrayStatistics::get_sum() const
+{
+    std::uint64_t sum = 0;
+    for (int gray = 0; gray < 256; gray++)
+        sum += histogram[gray] * gray;
+    return sum;
+}
+
+int GrayStatistics::get_average() const
+{
+    return pixel_count ? static_cast<int>(get_sum() / pixel_count) : 0;
+}
+
+std::int64_t GrayStatistics::count_outside(int centre, int tolerance) const
+{
+    std::uint64_t inside = 0;
+    for (int gray = std::max(centre - tolerance, 0); gray <= std::min(centre + tolerance, 255); gray++)
+        inside += histogram[gray];
+    return static_cast<std::int64_t>(pixel_count - inside);
+}
+
 BMP::BMP(const char *filename)
 {
     read(filename);
-    m_background_value = get_average_colour();
-    m_non_background_count = get_non_background_pixel_count(m_background_value);
-    m_blurred_edge_mask = blur_edge_mask(sobel_edges<245>());
-    m_vertical_edges = filter_long_vertical_edge_runs(get_vertical_edges<245>(), 10);
+    analyse();
+}
+
+BMP::BMP(std::int32_t width, std::int32_t height, PixelBuffer data)
+{
+    if (width <= 0 || height <= 0 || data.size() != static_cast<std::size_t>(width) * height * pixel_stride)
+    {
+        throw std::runtime_error("Pixel data does not match a " + std::to_string(width) + "x" + std::to_string(height) + " 32-bit image");
+    }
+
+    m_info_header.x_per_meter = m_info_header.y_per_meter = 2835;
+    set_bgra_headers(width, height);
+    m_data = std::move(data);
+}
+
+// the headers write() emits: file header, info header and colour header, then the pixels
+void BMP::set_bgra_headers(std::int32_t width, std::int32_t height)
+{
+    std::uint32_t header_size = sizeof(BMPInfoHeader) + sizeof(BMPColourHeader);
+    m_file_header = {0x4D42, 0, 0, 0, static_cast<std::uint32_t>(sizeof(BMPFileHeader) + header_size)};
+    const std::uint32_t image_size = header_image_size(static_cast<std::size_t>(width) * height * pixel_stride);
+    m_file_header.file_size = header_image_size(std::size_t(m_file_header.offset_data) + static_cast<std::size_t>(width) * height * pixel_stride);
+    m_info_header = {header_size, width, height, 1, 32, 3 /* BI_BITFIELDS */, image_size,
+                     m_info_header.x_per_meter, m_info_header.y_per_meter, 0, 0};
 }
 
 BMP::BMP() {}
 
+void BMP::analyse()
+{
+    RowAnalyser analyser;
+    analyser.begin(*this, m_blurred_edge_mask, m_vertical_edges, get_height());
+    analyser.analyse(get_height());
+}
+
 void BMP::read(const char *filename)
 {
     static_assert(std::endian::native == std::endian::little, "This code only works for little endian");
@@ -67,69 +145,226 @@ void BMP::read(const char *filename)
     {
         throw std::runtime_error(std::string("Error: reading info header has led to bad input state"));
     }
-    if (m_info_header.bit_count != 32)
+    if (m_info_header.bit_count != 32 && !(m_info_header.bit_count == 8 && m_info_header.compression == 0 /* BI_RGB */))
     {
-        throw std::runtime_error("Needs to be in RGBA format (32 bits), nothing else");
+        throw std::runtime_error("Needs to be in RGBA format (32 bits) or palettised (8 bits), nothing else");
     }
     if (m_info_header.height < 0)
     {
         throw std::runtime_error("The program can treat only BMP images with the origin in the bottom left corner!");
     }
 
+    if (m_info_header.bit_count == 8)
+    {
+        read_indexed(input);
+        return;
+    }
+
     input.seekg(m_file_header.offset_data, input.beg);
 
-    std::int32_t row_stride = m_info_header.width * m_info_header.bit_count / 8;
-    std::uint32_t alligned_stride = (row_stride + 3) & ~3; // This rounds up to the nearest multiple of 4
-    size_t padding_size = alligned_stride - row_stride;
+    // sizes and offsets in 64 bits, a 600 dpi A0 page is more than 2 GB
+    const std::size_t row_stride = static_cast<std::size_t>(m_info_header.width) * m_info_header.bit_count / 8;
+    const std::size_t alligned_stride = (row_stride + 3) & ~static_cast<std::size_t>(3); // This rounds up to the nearest multiple of 4
+    const std::size_t padding_size = alligned_stride - row_stride;
 
     m_data.resize(row_stride * m_info_header.height);
+    m_gray_statistics.reset();
+
+    // read the pixel data row by row, and handle the padding if its necessary; each row goes
+    // into the gray statistics while it is still in cache
+    for (int y = 0; y < m_info_header.height; y++)
+    {
+        input.read(reinterpret_cast<char *>(m_data.data() + y * row_stride), static_cast<std::streamsize>(row_stride));
+        input.seekg(static_cast<std::streamoff>(padding_size), input.cur);
+        m_gray_statistics.add_row(m_data.data() + y * row_stride, m_info_header.width);
+    }
+    m_gray_statistics_valid = true;
+}
+
+// An 8-bit image is expanded to BGRA through its palette, and from then on is the same as a 32-bit one
+void BMP::read_indexed(std::ifstream &input)
+{
+    std::uint32_t palette_size = m_info_header.colours_used ? m_info_header.colours_used : 256;
+    if (palette_size > 256)
+    {
+        throw std::runtime_error("An 8-bit BMP cannot have " + std::to_string(palette_size) + " colours");
+    }
+
+    std::array<PixelValues, 256> palette{};
+    input.seekg(sizeof(BMPFileHeader) + m_info_header.size, input.beg);
+    input.read(reinterpret_cast<char *>(palette.data()), palette_size * sizeof(PixelValues));
+    if (!input)
+    {
+        throw std::runtime_error(std::string("Error: reading the palette has led to bad input state"));
+    }
+    for (PixelValues &colour : palette)
+    {
+        colour[3] = 255; // the fourth palette byte is reserved, not alpha
+    }
+
+    input.seekg(m_file_header.offset_data, input.beg);
+
+    const int width = m_info_header.width;
+    const std::size_t alligned_stride = (static_cast<std::size_t>(width) + 3) & ~static_cast<std::size_t>(3);
+    std::vector<std::uint8_t> indices(alligned_stride);
+
+    m_data.resize(static_cast<std::size_t>(width) * m_info_header.height * pixel_stride);
+    m_gray_statistics.reset();
 
-    // read the pixel data row by row, and handle the padding if its necessary
     for (int y = 0; y < m_info_header.height; y++)
     {
-        input.read(reinterpret_cast<char *>(m_data.data() + y * row_stride), row_stride);
-        input.seekg(padding_size, input.cur);
+        input.read(reinterpret_cast<char *>(indices.data()), alligned_stride);
+        if (!input)
+        {
+            throw std::runtime_error(std::string("Error: reading the pixel data has led to bad input state"));
+        }
+
+        std::uint8_t *row = m_data.data() + static_cast<std::size_t>(y) * width * pixel_stride;
+        for (int x = 0; x < width; x++)
+        {
+            std::memcpy(row + x * pixel_stride, palette[indices[x]].data(), pixel_stride);
+        }
+        m_gray_statistics.add_row(row, width);
     }
+
+    set_bgra_headers(width, m_info_header.height);
+    m_gray_statistics_valid = true;
 }
 
-void BMP::write(const char *filename)
+// The file is written as it is encoded, a row at a time, so a large page is never held twice
+void BMP::write(const char *filename) const
 {
-    std::ofstream output{filename, std::ios_base::binary};
-    if (!output)
+    std::ofstream output = open_output_file(filename);
+    encode_to([&](const char *bytes, std::size_t size)
+              { output.write(bytes, static_cast<std::streamsize>(size)); });
+    if (!output.flush())
     {
-        throw std::runtime_error("Cannot open/create the file to write");
+        throw std::runtime_error(std::string("Cannot write the file: ") + filename);
     }
+}
 
-    // write the headers
-    output.write(reinterpret_cast<char *>(&m_file_header), sizeof(m_file_header));
-    output.write(reinterpret_cast<char *>(&m_info_header), sizeof(m_info_header));
-    output.write(reinterpret_cast<const char *>(&colour_header), sizeof(colour_header));
+std::string BMP::encode() const
+{
+    std::string output;
+    output.reserve(sizeof(m_file_header) + sizeof(m_info_header) + sizeof(colour_header) + m_data.size());
+    encode_to([&](const char *bytes, std::size_t size)
+              { output.append(bytes, size); });
+    return output;
+}
 
-    size_t row_stride = m_info_header.width * m_info_header.bit_count / 8;
-    size_t alligned_stride = (row_stride + 3) & ~3;
-    size_t padding_size = alligned_stride - row_stride;
+template <typename Append>
+void BMP::encode_to(Append &&append) const
+{
+    const std::size_t row_stride = static_cast<std::size_t>(m_info_header.width) * m_info_header.bit_count / 8;
+    const std::size_t alligned_stride = (row_stride + 3) & ~static_cast<std::size_t>(3);
+    static const char padding[4] = {};
 
-    std::vector<std::uint8_t> padding(padding_size, 0);
+    // the headers
+    append(reinterpret_cast<const char *>(&m_file_header), sizeof(m_file_header));
+    append(reinterpret_cast<const char *>(&m_info_header), sizeof(m_info_header));
+    append(reinterpret_cast<const char *>(&colour_header), sizeof(colour_header));
 
-    // write the pixel data row by row
+    // the pixel data row by row, padded to 4 bytes
     for (int y = 0; y < m_info_header.height; y++)
     {
-        output.write(reinterpret_cast<char *>(m_data.data() + y * row_stride), row_stride);
-        if (padding_size > 0)
+        append(reinterpret_cast<const char *>(m_data.data() + y * row_stride), row_stride);
+        append(padding, alligned_stride - row_stride);
+    }
+}
+
+// Gray pixels are written as the nearest of the 251 gray levels, so they may move by one level. A pixel of
+// one of the colours keeps it, and any other colour is written as the gray of its first (blue) byte, the
+// byte the comparison looks at. The overlays of gray pages lose nothing else.
+void BMP::write_indexed(const char *filename, const std::vector<PixelValues> &colours) const
+{
+    std::ofstream output = open_output_file(filename);
+    encode_indexed_to(colours, [&](const char *bytes, std::size_t size)
+                      { output.write(bytes, static_cast<std::streamsize>(size)); });
+    if (!output.flush())
+    {
+        throw std::runtime_error(std::string("Cannot write the file: ") + filename);
+    }
+}
+
+std::string BMP::encode_indexed(const std::vector<PixelValues> &colours) const
+{
+    std::string output;
+    output.reserve(sizeof(BMPFileHeader) + sizeof(BMPInfoHeader) + 256 * sizeof(PixelValues) +
+                   ((static_cast<std::size_t>(get_width()) + 3) & ~static_cast<std::size_t>(3)) * get_height());
+    encode_indexed_to(colours, [&](const char *bytes, std::size_t size)
+                      { output.append(bytes, size); });
+    return output;
+}
+
+template <typename Append>
+void BMP::encode_indexed_to(const std::vector<PixelValues> &colours, Append &&append) const
+{
+    if (colours.size() > 256 - indexed_gray_levels)
+    {
+        throw std::runtime_error("An 8-bit palette has room for " + std::to_string(256 - indexed_gray_levels) + " colours besides the grays");
+    }
+
+    std::array<PixelValues, 256> palette{};
+    std::array<std::uint8_t, 256> gray_index;
+    for (int level = 0; level < indexed_gray_levels; level++)
+    {
+        std::uint8_t gray = static_cast<std::uint8_t>((level * 255 + (indexed_gray_levels - 1) / 2) / (indexed_gray_levels - 1));
+        palette[level] = {gray, gray, gray, 0};
+    }
+    for (int gray = 0; gray < 256; gray++)
+    {
+        gray_index[gray] = static_cast<std::uint8_t>((gray * (indexed_gray_levels - 1) + 127) / 255);
+    }
+    for (std::size_t i = 0; i < colours.size(); i++)
+    {
+        palette[indexed_gray_levels + i] = {colours[i][0], colours[i][1], colours[i][2], 0};
+    }
+
+    const int width = get_width();
+    const std::size_t alligned_stride = (static_cast<std::size_t>(width) + 3) & ~static_cast<std::size_t>(3);
+    const std::uint32_t header_size = sizeof(BMPFileHeader) + sizeof(BMPInfoHeader) + sizeof(palette);
+    const std::size_t image_size = alligned_stride * get_height();
+
+    BMPFileHeader file_header = {0x4D42, header_image_size(header_size + image_size), 0, 0, header_size};
+    BMPInfoHeader info_header = {sizeof(BMPInfoHeader), width, get_height(), 1, 8, 0 /* BI_RGB */, header_image_size(image_size),
+                                 m_info_header.x_per_meter, m_info_header.y_per_meter, 256, 0};
+    append(reinterpret_cast<const char *>(&file_header), sizeof(file_header));
+    append(reinterpret_cast<const char *>(&info_header), sizeof(info_header));
+    append(reinterpret_cast<const char *>(palette.data()), sizeof(palette));
+
+    std::vector<std::uint8_t> indices(alligned_stride, 0);
+    for (int y = 0; y < get_height(); y++)
+    {
+        const std::uint8_t *row = m_data.data() + static_cast<std::size_t>(y) * width * pixel_stride;
+        for (int x = 0; x < width; x++)
         {
-            output.write(reinterpret_cast<char *>(padding.data()), padding_size);
+            const std::uint8_t *pixel = row + x * pixel_stride;
+            std::uint8_t index = gray_index[pixel[0]];
+            if (pixel[0] != pixel[1] || pixel[1] != pixel[2])
+            {
+                for (std::size_t i = 0; i < colours.size(); i++)
+                {
+                    if (pixel[0] == colours[i][0] && pixel[1] == colours[i][1] && pixel[2] == colours[i][2])
+                    {
+                        index = static_cast<std::uint8_t>(indexed_gray_levels + i);
+                        break;
+                    }
+                }
+            }
+            indices[x] = index;
         }
+        append(reinterpret_cast<const char *>(indices.data()), alligned_stride);
     }
 }
 
-void BMP::write_with_filter(const char *filename, std::vector<bool> filter_mask)
+void BMP::write_with_filter(const char *filename, const Mask &filter_mask)
 {
     for (int y = 0; y < m_info_header.height; y++)
     {
         for (int x = 0; x < m_info_header.width; x++)
         {
-            int index = y * m_info_header.width + x;
-            int byte_index = index * 4;
+            std::size_t index = static_cast<std::size_t>(y) * m_info_header.width + x;
+            std::size_t byte_index = index * 4;
 
             if (filter_mask[index])
             {
@@ -143,11 +378,100 @@ void BMP::write_with_filter(const char *filename, std::vector<bool> filter_mask)
     write(filename);
 }
 
+BMP BMP::crop(int left, int bottom, int right, int top) const
+{
+    left = std::max(left, 0);
+    bottom = std::max(bottom, 0);
+    right = std::min(right, get_width() - 1);
+    top = std::min(top, get_height() - 1);
+    if (left > right || bottom > top)
+    {
+        throw std::runtime_error("Crop outside of the " + std::to_string(get_width()) + "x" + std::to_string(get_height()) + " image");
+    }
+
+    const int width = right - left + 1;
+    const int height = top - bottom + 1;
+    const std::size_t row_bytes = static_cast<std::size_t>(width) * pixel_stride;
+    PixelBuffer cropped(row_bytes * height);
+    for (int y = 0; y < height; y++)
+    {
+        const std::uint8_t *source = m_data.data() + (static_cast<std::size_t>(bottom + y) * get_width() + left) * pixel_stride;
+        std::copy(source, source + row_bytes, cropped.data() + y * row_bytes);
+    }
+    return BMP(width, height, std::move(cropped));
+}
+
+BMP BMP::downscale(int factor) const
+{
+    if (factor < 1)
+    {
+        throw std::runtime_error("Cannot downscale by " + std::to_string(factor));
+    }
+
+    const int width = (get_width() + factor - 1) / factor;
+    const int height = (get_height() + factor - 1) / factor;
+    PixelBuffer scaled(static_cast<std::size_t>(width) * height * pixel_stride);
+
+    // the columns of a row of blocks are summed by the kernels one source row at a time, in order; only the
+    // rows with a coloured pixel are looked at again for the marks
+    const Kernels &k = kernels();
+    std::vector<std::uint32_t> sums(static_cast<std::size_t>(get_width()) * pixel_stride);
+    std::vector<const std::uint8_t *> marks(width); // red, or else the first other colour seen in the block
+
+    for (int block_y = 0; block_y < height; block_y++)
+    {
+        std::fill(sums.begin(), sums.end(), 0);
+        std::fill(marks.begin(), marks.end(), nullptr);
+
+        const int end_y = std::min((block_y + 1) * factor, get_height());
+        for (int y = block_y * factor; y < end_y; y++)
+        {
+            const std::uint8_t *row = m_data.data() + static_cast<std::size_t>(y) * get_width() * pixel_stride;
+            if (!k.sum_columns(row, 0, get_width() - 1, sums.data()))
+                continue;
+
+            // the pages are gray, so anything coloured was drawn by the comparison
+            for (int x = 0; x < get_width(); x++)
+            {
+                const std::uint8_t *pixel = row + x * pixel_stride;
+                if (pixel[0] != pixel[1] || pixel[1] != pixel[2])
+                {
+                    const int block_x = x / factor;
+                    if (!marks[block_x] || Pixel::is_red(Pixel::get_bgra(pixel)))
+                        marks[block_x] = pixel;
+                }
+            }
+        }
+
+        std::uint8_t *scaled_row = scaled.data() + static_cast<std::size_t>(block_y) * width * pixel_stride;
+        for (int block_x = 0; block_x < width; block_x++)
+        {
+            std::uint8_t *out = scaled_row + block_x * pixel_stride;
+            if (marks[block_x])
+            {
+                std::copy(marks[block_x], marks[block_x] + pixel_stride, out);
+                continue;
+            }
+            const int first_x = block_x * factor;
+            const int end_x = std::min(first_x + factor, get_width());
+            const std::uint32_t count = static_cast<std::uint32_t>(end_x - first_x) * (end_y - block_y * factor);
+            for (int channel = 0; channel < pixel_stride; channel++)
+            {
+                std::uint32_t sum = 0;
+                for (int x = first_x; x < end_x; x++)
+                    sum += sums[x * pixel_stride + channel];
+                out[channel] = static_cast<std::uint8_t>(sum / count);
+            }
+        }
+    }
+    return BMP(width, height, std::move(scaled));
+}
+
 void BMP::stamp_name(BMP &stamp)
 {
     const auto &stamp_data = stamp.get_data();
-    const std::size_t stamp_row_stride = stamp.get_width() * 4;
-    const std::size_t base_row_stride = get_width() * 4;
+    const std::size_t stamp_row_stride = static_cast<std::size_t>(stamp.get_width()) * 4;
+    const std::size_t base_row_stride = static_cast<std::size_t>(get_width()) * 4;
 
     if (stamp.get_width() > get_width() || stamp.get_height() > get_height())
     {
@@ -158,8 +482,8 @@ void BMP::stamp_name(BMP &stamp)
     {
         for (int x = 0; x < stamp.get_width(); ++x)
         {
-            std::size_t stamp_index = (stamp.get_height() - 1 - y) * stamp_row_stride + x * 4;
-            std::size_t base_index = (m_info_header.height - 1 - y) * base_row_stride + x * 4;
+            std::size_t stamp_index = static_cast<std::size_t>(stamp.get_height() - 1 - y) * stamp_row_stride + x * 4;
+            std::size_t base_index = static_cast<std::size_t>(m_info_header.height - 1 - y) * base_row_stride + x * 4;
 
             for (int b = 0; b < 4; ++b)
             {
@@ -170,6 +494,15 @@ void BMP::stamp_name(BMP &stamp)
 }
 
 void BMP::write_side_by_side(const BMP &diff, const BMP &base, const BMP &target, std::string stamp_location, const char *filename)
+{
+    std::optional<BMP> combined = side_by_side(diff, base, target, stamp_location, filename);
+    if (combined)
+    {
+        combined->write(filename);
+    }
+}
+
+std::optional<BMP> BMP::side_by_side(const BMP &diff, const BMP &base, const BMP &target, const std::string &stamp_location, const char *filename)
 {
     if (diff.get_height() != base.get_height() || base.get_height() != target.get_height() ||
         diff.get_width() != base.get_width() || base.get_width() != target.get_width())
@@ -178,13 +511,7 @@ void BMP::write_side_by_side(const BMP &diff, const BMP &base, const BMP &target
         std::cerr << "Diff: " << diff.get_width() << "x" << diff.get_height() << std::endl;
         std::cerr << "Base: " << base.get_width() << "x" << base.get_height() << std::endl;
         std::cerr << "Target: " << target.get_width() << "x" << target.get_height() << std::endl;
-        return;
-    }
-
-    std::ofstream output{filename, std::ios_base::binary};
-    if (!output)
-    {
-        throw std::runtime_error("Cannot open/create the file to write");
+        return std::nullopt;
     }
 
     int height = diff.get_height();
@@ -192,11 +519,10 @@ void BMP::write_side_by_side(const BMP &diff, const BMP &base, const BMP &target
     int bytes_per_pixel = bit_count / 8;
 
     int combined_width = diff.get_width() + base.get_width() + target.get_width();
-    std::size_t row_stride = combined_width * bytes_per_pixel;
+    std::size_t row_stride = static_cast<std::size_t>(combined_width) * bytes_per_pixel;
     std::size_t alligned_stride = (row_stride + 3) & ~3; // rounds down to the nearest 4 (4 bytes per pixel in a 32-bit RGBA BMP)
-    std::size_t padding_size = alligned_stride - row_stride;
 
-    std::vector<std::uint8_t> combined_data(alligned_stride * height, 0);
+    PixelBuffer combined_data(row_stride * height, 0);
 
     // stamping/labelling the images for better differentiation
     std::string diff_location = stamp_location + "/diff.bmp";
@@ -217,12 +543,12 @@ void BMP::write_side_by_side(const BMP &diff, const BMP &base, const BMP &target
 
     for (int y = 0; y < height; ++y)
     {
-        std::uint8_t *dest_row = &combined_data[y * alligned_stride];
+        std::uint8_t *dest_row = &combined_data[y * row_stride];
         std::size_t dest_col = 0;
 
         int src_width = diff.get_width();
-        std::size_t src_row_stride = src_width * bytes_per_pixel;
-        const std::vector<std::uint8_t> &src_data = diff_copy.get_data();
+        std::size_t src_row_stride = static_cast<std::size_t>(src_width) * bytes_per_pixel;
+        const PixelBuffer &src_data = diff_copy.get_data();
         const std::uint8_t *src_row = &src_data[y * src_row_stride];
 
         for (int x = 0; x < src_width; ++x)
@@ -235,8 +561,8 @@ void BMP::write_side_by_side(const BMP &diff, const BMP &base, const BMP &target
         }
 
         src_width = base.get_width();
-        src_row_stride = src_width * bytes_per_pixel;
-        const std::vector<std::uint8_t> &base_data = base_copy.get_data();
+        src_row_stride = static_cast<std::size_t>(src_width) * bytes_per_pixel;
+        const PixelBuffer &base_data = base_copy.get_data();
         const std::uint8_t *base_row = &base_data[y * src_row_stride];
 
         for (int x = 0; x < src_width; ++x)
@@ -249,8 +575,8 @@ void BMP::write_side_by_side(const BMP &diff, const BMP &base, const BMP &target
         }
 
         src_width = base.get_width();
-        src_row_stride = src_width * bytes_per_pixel;
-        const std::vector<std::uint8_t> &target_data = target_copy.get_data();
+        src_row_stride = static_cast<std::size_t>(src_width) * bytes_per_pixel;
+        const PixelBuffer &target_data = target_copy.get_data();
         const std::uint8_t *target_row = &target_data[y * src_row_stride];
 
         for (int x = 0; x < src_width; ++x)
@@ -263,217 +589,283 @@ void BMP::write_side_by_side(const BMP &diff, const BMP &base, const BMP &target
         }
     }
 
-    BMPFileHeader file_header = diff.m_file_header;
-    BMPInfoHeader info_header = diff.m_info_header;
+    BMP combined;
+    combined.m_file_header = diff.m_file_header;
+    combined.m_info_header = diff.m_info_header;
 
-    int image_size = alligned_stride * diff.get_height(); // alligned stride is width in bytes
-    info_header.width = combined_width;
-    file_header.file_size = sizeof(BMPFileHeader) + sizeof(BMPInfoHeader) + sizeof(BMPColourHeader) + image_size;
-
-    output.write(reinterpret_cast<char *>(&file_header), sizeof(file_header));
-    output.write(reinterpret_cast<char *>(&info_header), sizeof(info_header));
-    output.write(reinterpret_cast<const char *>(&colour_header), sizeof(colour_header));
+    std::size_t image_size = alligned_stride * diff.get_height(); // alligned stride is width in bytes
+    combined.m_info_header.width = combined_width;
+    combined.m_file_header.file_size = header_image_size(sizeof(BMPFileHeader) + sizeof(BMPInfoHeader) + sizeof(BMPColourHeader) + image_size);
+    combined.m_data = std::move(combined_data);
+    return combined;
+}
 
-    std::vector<std::uint8_t> padding(padding_size, 0);
-    for (int y = 0; y < info_header.height; y++)
+void BMP::set_data(const PixelBuffer &new_data)
+{
+    if (new_data.size() != m_data.size())
     {
-        output.write(reinterpret_cast<char *>(combined_data.data() + y * row_stride), row_stride);
-        if (padding_size > 0)
-        {
-            output.write(reinterpret_cast<char *>(padding.data()), padding_size);
-        }
+        throw std::runtime_error("New data size " + std::to_string(new_data.size()) +
+                                 " differs to current data size " + std::to_string(m_data.size()));
     }
+    m_data = new_data;
+    m_gray_statistics_valid = false;
 }
 
-int BMP::get_non_background_pixel_count(int background_value) const
+void BMP::set_data(PixelBuffer &&new_data)
 {
-    int non_background_count = 0;
-    std::size_t pixel_count = get_width() * get_height();
-    for (std::size_t i = 0; i < pixel_count; i++)
+    if (new_data.size() != m_data.size())
     {
-        std::uint8_t gray_value = m_data[i * 4]; // Assuming 32-bit BMP, gray value is in the first byte
-
-        if (std::abs(gray_value - background_value) > 8)
-        {
-            non_background_count++;
-        }
+        throw std::runtime_error("New data size " + std::to_string(new_data.size()) +
+                                 " differs to current data size " + std::to_string(m_data.size()));
     }
-    return non_background_count;
+    m_data = std::move(new_data);
+    m_gray_statistics_valid = false;
 }
 
-int BMP::get_average_colour() const
+void BMP::assign_pixels(const BMP &source)
 {
-    int total_gray = 0;
-    std::int32_t stride = m_info_header.bit_count / 8;
-    std::size_t pixel_count = get_width() * get_height();
-    for (std::size_t i = 0; i < pixel_count; i++)
-    {
-        std::uint8_t gray = m_data[i * stride];
-        total_gray += gray;
-    }
+    assign_headers(source);
+    copy_rows(source, 0, get_height());
+}
 
-    return total_gray / pixel_count;
+void BMP::assign_headers(const BMP &source)
+{
+    m_file_header = source.m_file_header;
+    m_info_header = source.m_info_header;
+    m_data.resize(source.m_data.size()); // no allocation once the capacity is there
+    m_gray_statistics_valid = false; // the diff is drawn over the copy
+    m_blurred_edge_mask.clear();
+    m_vertical_edges.clear();
+    m_red_count = 0;
+    m_yellow_count = 0;
+    m_regions.clear();
+    m_region_count = 0;
+    m_background_value = source.m_background_value;
+    m_non_background_count = source.m_non_background_count;
+    // not analysed, so no margin is known and every pixel counts as content
+    m_content_rows.assign(get_height(), RowSpan{0, get_width() - 1});
+    m_content_box = {0, 0, get_width() - 1, get_height() - 1};
+    m_margin_pixel = {};
 }
 
-void BMP::set_data(std::vector<std::uint8_t> &new_data)
+void BMP::copy_rows(const BMP &source, int first, int end)
 {
-    if (new_data.size() != m_data.size())
-    {
-        throw std::runtime_error("New data size " + std::to_string(new_data.size()) +
-                                 " differs to current data size " + std::to_string(m_data.size()));
-    }
-    m_data = new_data;
+    const std::size_t row_size = static_cast<std::size_t>(get_width()) * pixel_stride;
+    if (first < end && !m_data.empty())
+        std::memcpy(m_data.data() + first * row_size, source.m_data.data() + first * row_size, (end - first) * row_size);
 }
 
-std::vector<bool> BMP::blur_edge_mask(const std::vector<bool> &edge_map)
+void VerticalRunFilter::begin(int width, int min_run_length)
 {
-    std::int32_t width = m_info_header.width;
-    std::int32_t height = m_info_header.height;
-    std::vector<bool> blurred_mask(width * height, false);
+    m_width = width;
+    m_min_run_length = min_run_length;
+    m_run_lengths.assign(width, 0);
+    m_runs_in_word.assign((width + word_size - 1) / word_size, 0);
+}
 
-    for (int y = 1; y < height - 1; y++)
+// A run is kept from the row where it reaches min_run_length on: its rows so far are set in result then, and each
+// row after that as it comes, so no row of result waits for the run to end. The top row of a page has no edges,
+// so every run ends before it, as the runs of the reference do. The row is read 8 pixels (one word) at a time and
+// a word with no edge and no run going on is skipped.
+void VerticalRunFilter::add_row(int y, const std::uint8_t *row, std::uint8_t *result, int window)
+{
+    std::uint8_t *result_row = result + static_cast<std::size_t>(y % window) * m_width;
+    for (int x = 0; x < m_width; x += word_size)
     {
-        for (int x = 1; x < width - 1; x++)
+        const int end = std::min(x + word_size, m_width);
+        const int word_index = x / word_size;
+        if (end - x == word_size && !m_runs_in_word[word_index])
         {
-            int index = y * width + x;
+            std::uint64_t word;
+            std::memcpy(&word, row + x, word_size);
+            if (word == 0)
+                continue;
+        }
 
-            // If the current pixel is not an edge, skip it
-            if (!edge_map[index])
+        bool runs = false;
+        for (int column = x; column < end; column++)
+        {
+            if (!row[column])
+            {
+                m_run_lengths[column] = 0;
                 continue;
+            }
 
-            blur_pixels<2>(x, y, width, height, blurred_mask);
+            runs = true;
+            const int length = ++m_run_lengths[column];
+            if (length > m_min_run_length)
+            {
+                result_row[column] = 1;
+            }
+            else if (length == m_min_run_length)
+            {
+                for (int i = y - length + 1; i <= y; i++)
+                    result[static_cast<std::size_t>(i % window) * m_width + column] = 1;
+            }
         }
+        m_runs_in_word[word_index] = runs;
     }
-    return blurred_mask;
 }
 
-template <int Threshold>
-std::vector<bool> BMP::sobel_edges()
+// Rendered pages have wide blank margins: every row is searched for content from both ends (a blank row is one
+// compare of each pixel with the margin pixel) one row ahead of the Sobel kernel, which only looks at the content
+// and one pixel around it. The vertical edges of a row go straight into the run filter, its edges are dilated
+// along the row into a ring of the last 2 * radius + 1 rows, and the OR of the ring is the row radius rows down of
+// the blurred mask. The window of rows stays in cache, so the pixels are read once.
+void RowAnalyser::begin(BMP &page, Mask &blurred_edge_mask, Mask &vertical_edges, int window)
 {
-    std::int32_t width = m_info_header.width;
-    std::int32_t height = m_info_header.height;
-    const std::vector<std::uint8_t> &data = m_data;
+    m_page = &page;
+    page.m_red_count = 0;
+    page.m_yellow_count = 0;
+    if (!page.m_gray_statistics_valid)
+    {
+        page.m_gray_statistics.reset();
+        for (int y = 0; y < page.get_height(); y++)
+            page.m_gray_statistics.add_row(page.m_data.data() + static_cast<std::size_t>(y) * page.get_width() * pixel_stride, page.get_width());
+        page.m_gray_statistics_valid = true;
+    }
+    page.m_background_value = page.m_gray_statistics.get_average();
+    page.m_non_background_count = page.m_gray_statistics.count_outside(page.m_background_value, 8);
+
+    m_blurred_edge_mask = &blurred_edge_mask;
+    m_vertical_edges = &vertical_edges;
+    if (&blurred_edge_mask != &page.m_blurred_edge_mask)
+        page.m_blurred_edge_mask.clear();
+    if (&vertical_edges != &page.m_vertical_edges)
+        page.m_vertical_edges.clear();
+
+    m_width = page.get_width();
+    m_height = page.get_height();
+    m_window = std::max(window, 1);
+    m_next_row = 0;
+    m_content_rows = 0;
+    m_final_rows = 0;
+    page.m_content_rows.assign(m_height, RowSpan());
+    page.m_content_box = PixelBox();
+    blurred_edge_mask.resize(static_cast<std::size_t>(m_window) * m_width); // every row is cleared when it is reached
+    vertical_edges.resize(static_cast<std::size_t>(m_window) * m_width);
+    if (page.m_data.empty())
+    {
+        m_final_rows = m_height;
+        return;
+    }
 
-    std::vector<bool> result(width * height, false);
+    // the top right pixel, the first pixels read from a file whose pixel offset points into its headers are header bytes
+    const std::uint8_t *corner = page.m_data.data() + page.m_data.size() - pixel_stride;
+    std::memcpy(&m_margin, corner, sizeof(m_margin));
+    std::memcpy(page.m_margin_pixel.data(), corner, pixel_stride);
+
+    m_edges.assign(m_width, 0);
+    m_vertical_row.assign(m_width, 0);
+    m_dilated.assign(m_dilated_spans.size() * m_width, 0);
+    m_dilated_spans.fill(RowSpan());
+    m_run_filter.begin(m_width, analysis_config.min_vertical_run);
+    find_content(0);
+}
 
-    // Loop through each pixel in the image, skipping the edges to avoid out-of-bounds access
-    for (int y = 1; y < height - 1; y++)
+void RowAnalyser::analyse(int rows)
+{
+    constexpr int radius = analysis_config.dilation_radius;
+    rows = std::min(rows, m_height);
+    while (m_final_rows < rows)
     {
-        for (int x = 1; x < width - 1; x++)
-        {
-            auto [g_x, g_y] = get_sobel_gradients(y, x, data, width);
+        analyse_row(m_next_row);
 
-            // Calculate gradient magnitude (clamped to 255)
-            int magnitude = std::min(255, static_cast<int>(std::sqrt(g_x * g_x + g_y * g_y)));
-
-            result[y * width + x] = (magnitude >= Threshold);
-        }
+        // a blurred row is final once the rows radius above it are dilated, a vertical edge once its run is kept or
+        // has ended, at the latest min_vertical_run - 1 rows up; at the top row every run has ended
+        const int y = m_next_row++;
+        const int vertical_rows = y >= m_height - 1 ? m_height : y - analysis_config.min_vertical_run + 2;
+        m_final_rows = std::clamp(std::min(y - radius + 1, vertical_rows), 0, m_height);
     }
-    return result;
 }
 
-std::vector<bool> BMP::filter_long_vertical_edge_runs(const std::vector<bool> &vertical_edges, int min_run_length)
+void RowAnalyser::find_content()
 {
-    std::vector<bool> result(vertical_edges.size(), false);
-    int width = m_info_header.width;
-    int height = m_info_header.height;
+    while (m_content_rows < m_height)
+        find_content(m_content_rows);
+}
 
-    for (int x = 0; x < width; x++)
+void RowAnalyser::find_content(int y)
+{
+    auto is_margin = [&](const std::uint8_t *row, int x)
     {
-        int run_start = -1;
-        int run_length = 0;
+        std::uint32_t pixel;
+        std::memcpy(&pixel, row + x * pixel_stride, sizeof(pixel));
+        return pixel == m_margin;
+    };
 
-        for (int y = 0; y < height; y++)
-        {
-            int index = y * width + x;
-            if (vertical_edges[index])
-            {
-                if (run_start == -1)
-                {
-                    run_start = y;
-                }
-                run_length++;
-            }
-            else
-            {
-                if (run_length >= min_run_length)
-                {
-                    // copy the run
-                    for (int i = run_start; i < run_start + run_length; i++)
-                    {
-                        result[i * width + x] = true;
-                    }
-                }
-                run_start = -1;
-                run_length = 0;
-            }
-        }
+    const std::uint8_t *row = m_page->m_data.data() + static_cast<std::size_t>(y) * m_width * pixel_stride;
+    RowSpan &span = m_page->m_content_rows[y];
+    m_content_rows = y + 1;
+    span.first = 0;
+    while (span.first < m_width && is_margin(row, span.first))
+        span.first++;
+    if (span.first == m_width)
+    {
+        span = RowSpan();
+        return;
     }
-    return result;
+
+    span.last = m_width - 1;
+    while (is_margin(row, span.last))
+        span.last--;
+    m_page->m_content_box.add_row(y, span);
 }
 
-template <int Threshold>
-std::vector<bool> BMP::get_vertical_edges()
+void RowAnalyser::analyse_row(int y)
 {
-    std::int32_t width = m_info_header.width;
-    std::int32_t height = m_info_header.height;
-    const std::vector<std::uint8_t> &data = m_data;
-
-    std::vector<bool> result(width * height, false);
-
-    for (int y = 1; y < height - 1; y++)
+    constexpr int radius = analysis_config.dilation_radius;
+    constexpr int ring_rows = 2 * radius + 1;
+    // a magnitude of at least the threshold, clamped to 255, is a squared magnitude of at least its square
+    constexpr int threshold = analysis_config.sobel_threshold;
+    constexpr int edge_squared = threshold <= 0 ? 0 : threshold > 255 ? std::numeric_limits<int>::max() : threshold * threshold;
+
+    const Kernels &k = kernels();
+    const std::size_t row_size = static_cast<std::size_t>(m_width) * pixel_stride;
+    if (y < m_height)
     {
-        for (int x = 1; x < width - 1; x++)
+        if (y + 1 < m_height)
+            find_content(y + 1);
+
+        // the rows and columns of the page border have no edges, the kernel would read outside the page
+        const RowSpan span = y >= 1 && y <= m_height - 2 ? m_page->edge_span(y) : RowSpan();
+        const std::uint8_t *row = m_page->m_data.data() + y * row_size;
+        k.sobel_row(row - row_size, row, row + row_size, span.first, span.last, edge_squared, analysis_config.vertical_threshold,
+                    m_edges.data(), m_vertical_row.data());
+
+        std::uint8_t *vertical_row = m_vertical_edges->data() + static_cast<std::size_t>(y % m_window) * m_width;
+        std::memset(vertical_row, 0, m_width); // before the runs going on in this row are set in it
+        m_run_filter.add_row(y, m_vertical_row.data(), m_vertical_edges->data(), m_window);
+
+        const int slot = y % ring_rows;
+        std::uint8_t *dilated_row = m_dilated.data() + static_cast<std::size_t>(slot) * m_width;
+        const RowSpan old_span = m_dilated_spans[slot];
+        if (!old_span.empty())
+            std::fill(dilated_row + old_span.first, dilated_row + old_span.last + 1, 0);
+        m_dilated_spans[slot] = span.grown(radius).intersected(0, m_width - 1);
+        k.dilate_row(m_edges.data(), m_width, radius, m_dilated_spans[slot].first, m_dilated_spans[slot].last, dilated_row);
+
+        if (!span.empty())
         {
-            auto [g_x, g_y] = get_sobel_gradients(y, x, data, width);
-
-            int abs_gx = std::abs(g_x);
-
-            result[y * width + x] = (abs_gx >= Threshold);
+            std::fill(m_edges.data() + span.first, m_edges.data() + span.last + 1, 0);
+            std::fill(m_vertical_row.data() + span.first, m_vertical_row.data() + span.last + 1, 0);
         }
     }
-    return result;
-}
 
-template <int Radius>
-void BMP::blur_pixels(int x, int y, int width, int height, std::vector<bool> &mask)
-{
-    for (int dy = -Radius; dy <= Radius; dy++)
+    const int blurred_y = y - radius;
+    if (blurred_y >= 0)
     {
-        for (int dx = -Radius; dx <= Radius; dx++)
+        std::uint8_t *blurred_row = m_blurred_edge_mask->data() + static_cast<std::size_t>(blurred_y % m_window) * m_width;
+        std::memset(blurred_row, 0, m_width);
+        for (int source = std::max(blurred_y - radius, 0); source <= std::min(blurred_y + radius, m_height - 1); source++)
         {
-            int new_x = x + dx;
-            int new_y = y + dy;
-
-            // Check if the new coordinates are within bounds
-            if (new_x >= 0 && new_x < width && new_y >= 0 && new_y < height)
-            {
-                mask[new_y * width + new_x] = true;
-            }
+            const int slot = source % ring_rows;
+            k.or_row(m_dilated.data() + static_cast<std::size_t>(slot) * m_width, m_dilated_spans[slot].first, m_dilated_spans[slot].last, blurred_row);
         }
     }
 }
 
-std::array<int, 2> BMP::get_sobel_gradients(int y, int x, const std::vector<std::uint8_t> &data, int width)
+RowSpan BMP::edge_span(int y) const
 {
-    auto index = [&](int row, int col)
-    {
-        return (row * width + col) * pixel_stride;
-    };
-
-    int top_left = data[index(y - 1, x - 1)];
-    int top_mid = data[index(y - 1, x)];
-    int top_right = data[index(y - 1, x + 1)];
-    int middle_left = data[index(y, x - 1)];
-    int middle_right = data[index(y, x + 1)];
-    int bottom_left = data[index(y + 1, x - 1)];
-    int bottom_mid = data[index(y + 1, x)];
-    int bottom_right = data[index(y + 1, x + 1)];
-
-    int g_x = (-1 * top_left) + (-2 * middle_left) + (-1 * bottom_left) +
-              (top_right) + (2 * middle_right) + (bottom_right);
-    int g_y = (top_left) + (2 * top_mid) + (top_right) +
-              (-1 * bottom_left) + (-2 * bottom_mid) + (-1 * bottom_right);
-
-    return {g_x, g_y};
-}
\ No newline at end of file
+    return m_content_rows[y - 1].united(m_content_rows[y]).united(m_content_rows[y + 1]).grown(1).intersected(1, get_width() - 2);
+}
@@ -11,12 +11,20 @@
 #ifndef BMP_HPP
 #define BMP_HPP
 
+#include <algorithm>
 #include <array>
 #include <cstddef>
 #include <cstdint>
+#include <fstream>
 #include <iostream>
+#include <optional>
+#include <string>
 #include <vector>
 
+#include "compare_config.hpp"
+#include "image_buffer.hpp"
+#include "regions.hpp"
+
 #pragma pack(push, 1)
 struct BMPFileHeader
 {
@@ -44,59 +52,211 @@ struct BMPInfoHeader
 #pragma pack(pop)
 
 constexpr int pixel_stride = 4;
+using PixelValues = std::array<std::uint8_t, pixel_stride>;
+
+constexpr int indexed_gray_levels = 251; // the rest of an 8-bit palette holds the diff colours
+
+// Histogram of the gray values of a page, gathered row by row while it is decoded so the background
+// and the non-background count need no extra passes over the pixels
+struct GrayStatistics
+{
+    void reset();
+    void add_row(const std::uint8_t *row, int width);
+
+    std::uint64_t get_sum() const;
+    int get_average() const;                                       // the background value
+    std::int64_t count_outside(int centre, int tolerance) const; // pixels more than tolerance away from centre
+
+    std::array<std::uint64_t, 256> histogram{};
+    std::uint64_t pixel_count = 0;
+};
+
+// The columns of a row that matter, first and last inclusive, empty when first > last
+struct RowSpan
+{
+    int first = 0;
+    int last = -1;
+
+    bool empty() const { return first > last; }
+    RowSpan united(const RowSpan &other) const
+    {
+        if (empty())
+            return other;
+        if (other.empty())
+            return *this;
+        return {std::min(first, other.first), std::max(last, other.last)};
+    }
+    RowSpan intersected(int low, int high) const { return {std::max(first, low), std::min(last, high)}; }
+    RowSpan grown(int by) const { return empty() ? *this : RowSpan{first - by, last + by}; }
+};
+
+// An inclusive rectangle of pixels in BMP row order (row 0 is the bottom row), empty when left > right
+struct PixelBox
+{
+    int left = 0;
+    int bottom = 0;
+    int right = -1;
+    int top = -1;
+
+    bool empty() const { return left > right || bottom > top; }
+    void add_row(int y, const RowSpan &span) // grows the box over span of row y, rows are added bottom up
+    {
+        if (span.empty())
+            return;
+        if (empty())
+            *this = {span.first, y, span.last, y};
+        left = std::min(left, span.first);
+        right = std::max(right, span.last);
+        top = y;
+    }
+    PixelBox intersected(const PixelBox &other) const
+    {
+        return {std::max(left, other.left), std::max(bottom, other.bottom), std::min(right, other.right), std::min(top, other.top)};
+    }
+    PixelBox grown(int by) const { return empty() ? *this : PixelBox{left - by, bottom - by, right + by, top + by}; }
+};
 
 class BMP
 {
 public:
     BMP(const char *filename);
+    BMP(std::int32_t width, std::int32_t height, PixelBuffer data); // from BGRA pixels in memory, bottom row first; not analysed
     BMP();
     void read(const char *filename);
-    void write(const char *filename);
+    void analyse(); // background, non-background count and edge masks, done by the constructor after read(); see RowAnalyser
+    void write(const char *filename) const;
+    // 8-bit palettised, 251 gray levels and then the given colours; see write_indexed() in bmp.cpp for what is lost
+    void write_indexed(const char *filename, const std::vector<PixelValues> &colours) const;
+    std::string encode() const; // the file write() writes
+    std::string encode_indexed(const std::vector<PixelValues> &colours) const;
     void stamp_name(BMP &stamp);
     static void write_side_by_side(const BMP &diff, const BMP &base, const BMP &target, std::string stamp_location, const char *filename);
-    void write_with_filter(const char *filename, std::vector<bool> filter_mask);
+    // the stamped diff, base and target next to each other; warns (naming filename) and gives nothing if their sizes differ
+    static std::optional<BMP> side_by_side(const BMP &diff, const BMP &base, const BMP &target, const std::string &stamp_location, const char *filename);
+    void write_with_filter(const char *filename, const Mask &filter_mask);
+    BMP crop(int left, int bottom, int right, int top) const; // inclusive, in BMP row order, clamped to the page
+    BMP downscale(int factor) const;                           // box filtered, but diff colours are never averaged away
 
-    const std::vector<std::uint8_t> &get_data() const { return m_data; }
-    const std::vector<bool> &get_blurred_edge_mask() const { return m_blurred_edge_mask; }
-    const std::vector<bool> &get_vertical_edge_mask() const { return m_vertical_edges; }
+    const PixelBuffer &get_data() const { return m_data; }
+    PixelBuffer &get_mutable_data() // the gray statistics are recomputed by the next analyse()
+    {
+        m_gray_statistics_valid = false;
+        return m_data;
+    }
+    const Mask &get_blurred_edge_mask() const { return m_blurred_edge_mask; }
+    const Mask &get_vertical_edge_mask() const { return m_vertical_edges; }
     int get_width() const { return m_info_header.width; }
     int get_height() const { return m_info_header.height; }
-    int get_red_count() const { return m_red_count; }
-    int get_yellow_count() const { return m_yellow_count; }
+    std::int64_t get_red_count() const { return m_red_count; }
+    std::int64_t get_yellow_count() const { return m_yellow_count; }
     int get_background_value() const { return m_background_value; }
-    int get_non_background_count() const { return m_non_background_count; }
+    std::int64_t get_non_background_count() const { return m_non_background_count; }
+    // every pixel outside the content of a row is the margin pixel (the top right one), set by analyse()
+    const std::vector<RowSpan> &get_content_rows() const { return m_content_rows; }
+    const PixelBox &get_content_box() const { return m_content_box; } // around the content of every row
+    PixelValues get_margin_pixel() const { return m_margin_pixel; }
+    const std::vector<DiffRegion> &get_regions() const { return m_regions; } // of a diff, when regions were asked for
+    int get_region_count() const { return m_region_count; }                   // before the list was cut to the largest
 
-    void increment_red_count(int new_red) { m_red_count += new_red; }
-    void increment_yellow_count(int new_yellow) { m_yellow_count += new_yellow; }
-    void set_data(std::vector<std::uint8_t> &new_data);
+    void increment_red_count(std::int64_t new_red) { m_red_count += new_red; }
+    void increment_yellow_count(std::int64_t new_yellow) { m_yellow_count += new_yellow; }
+    std::vector<DiffRegion> &get_mutable_regions() { return m_regions; }
+    void set_region_count(int region_count) { m_region_count = region_count; }
+    void set_data(const PixelBuffer &new_data);
+    void set_data(PixelBuffer &&new_data);
+
+    // Makes this a plain copy of source's pixels and headers (no edge masks, counts and regions reset),
+    // reusing the buffer already held so a diff BMP can be recycled from page to page
+    void assign_pixels(const BMP &source);
+    // The same with the pixels left to copy_rows(), so a diff can be drawn over a strip of rows right after it is copied
+    void assign_headers(const BMP &source);
+    void copy_rows(const BMP &source, int first, int end); // rows first to end - 1 of source, the same size as this
 
 private:
-    int get_average_colour() const;
-    int get_non_background_pixel_count(int background_value) const;
+    friend class RowAnalyser;
 
-    template <int Threshold>
-    std::vector<bool> sobel_edges();
+    void read_indexed(std::ifstream &input);
+    // the file of write() or write_indexed(), handed to append(bytes, size) a piece at a time
+    template <typename Append>
+    void encode_to(Append &&append) const;
+    template <typename Append>
+    void encode_indexed_to(const std::vector<PixelValues> &colours, Append &&append) const;
+    void set_bgra_headers(std::int32_t width, std::int32_t height);
+    // where the Sobel kernel can find an edge in row y: the content and one pixel around it, within the page border
+    RowSpan edge_span(int y) const;
 
-    template <int Threshold> // compile-time constant
-    std::vector<bool> get_vertical_edges();
-    std::vector<bool> filter_long_vertical_edge_runs(const std::vector<bool> &vertical_edges, int min_run_length);
+    BMPFileHeader m_file_header;
+    BMPInfoHeader m_info_header;
 
-    static std::array<int, 2> get_sobel_gradients(int y, int x, const std::vector<std::uint8_t> &data, int width);
+    PixelBuffer m_data;
+    GrayStatistics m_gray_statistics;
+    bool m_gray_statistics_valid = false; // true while m_gray_statistics matches m_data
+    Mask m_blurred_edge_mask;
+    Mask m_vertical_edges;
+    std::int64_t m_red_count = 0;
+    std::int64_t m_yellow_count = 0;
+    int m_background_value = 0; // used to determine background colour
+    std::int64_t m_non_background_count = 0;
+    std::vector<RowSpan> m_content_rows;
+    PixelBox m_content_box;
+    PixelValues m_margin_pixel{};
+    std::vector<DiffRegion> m_regions;
+    int m_region_count = 0;
+};
 
-    std::vector<bool> blur_edge_mask(const std::vector<bool> &edge_map);
+// Keeps the vertical runs of at least min_run_length edge pixels, fed the rows of vertical edges bottom up
+class VerticalRunFilter
+{
+public:
+    void begin(int width, int min_run_length);
+    // row y of the vertical edges, into result whose row i is at i % window rows; see bmp.cpp
+    void add_row(int y, const std::uint8_t *row, std::uint8_t *result, int window);
 
-    template <int Radius> // compile-time constant
-    static void blur_pixels(int x, int y, int width, int height, std::vector<bool> &mask);
+private:
+    static constexpr int word_size = sizeof(std::uint64_t);
+    int m_width = 0;
+    int m_min_run_length = 0;
+    std::vector<int> m_run_lengths;           // of the run going on in every column
+    std::vector<std::uint8_t> m_runs_in_word; // a run is going on in a column of the word
+};
 
-    BMPFileHeader m_file_header;
-    BMPInfoHeader m_info_header;
+// The analysis of a page a row at a time, bottom up: its content rows, the blurred edge mask and the long vertical
+// edges. analyse() runs it over the whole page into the page's own masks; the band engine (band.hpp) runs it a strip
+// at a time into rings of rows, row y at y % window, that only hold the rows it has not compared yet.
+class RowAnalyser
+{
+public:
+    // a mask row is final at most this many rows after the last row analysed: the dilation reaches radius rows up,
+    // and a vertical edge run is only known to be kept once it is min_vertical_run rows long
+    static constexpr int lag_rows = std::max(analysis_config.dilation_radius, analysis_config.min_vertical_run - 1);
 
-    std::vector<std::uint8_t> m_data;
-    std::vector<bool> m_blurred_edge_mask;
-    std::vector<bool> m_vertical_edges;
-    int m_red_count = 0;
-    int m_yellow_count = 0;
-    int m_background_value = 0; // used to determine background colour
-    int m_non_background_count = 0;
+    // the counts, background and margin of page are set here; with other masks than its own, the page's are emptied
+    void begin(BMP &page, Mask &blurred_edge_mask, Mask &vertical_edges, int window);
+    void analyse(int rows);  // until the first rows rows, or every row, of the masks and the content are final
+    void find_content();     // the content of the rows left, without their masks
+    int get_final_rows() const { return m_final_rows; }
+    bool done() const { return m_final_rows == m_height; }
+
+private:
+    void find_content(int y);
+    void analyse_row(int y); // one step of the sweep, rows past the top only finish the blurred mask
+
+    BMP *m_page = nullptr;
+    Mask *m_blurred_edge_mask = nullptr;
+    Mask *m_vertical_edges = nullptr;
+    int m_window = 1;
+    int m_width = 0;
+    int m_height = 0;
+    std::uint32_t m_margin = 0;
+    int m_next_row = 0;      // the next step of the sweep
+    int m_content_rows = 0;  // rows searched for content
+    int m_final_rows = 0;
+
+    // one row of edges and of vertical edges, zero outside the columns the Sobel kernel wrote, and the ring of dilated rows
+    Mask m_edges;
+    Mask m_vertical_row;
+    Mask m_dilated;
+    std::array<RowSpan, 2 * analysis_config.dilation_radius + 1> m_dilated_spans;
+    VerticalRunFilter m_run_filter;
 };
 #endif
@@ -0,0 +1,44 @@
+//
+//
+// Copyright the mso-test contributors
+//
+// SPDX-License-Identifier: MPL-2.0
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#ifndef COMPARE_CONFIG_HPP
+#define COMPARE_CONFIG_HPP
+
+// Tuning of the page analysis and the pixel comparison. Used as a template argument, so every
+// preset gets its own compiled loops and nothing here is tested per pixel at runtime.
+struct CompareConfig
+{
+    // pixel comparison
+    int threshold = 40;          // gray levels two pixels may differ by
+    int noise_distance = 15;     // pixels this close to the background are likely noise...
+    int noise_allowance = 20;    // ...and may differ by this much more
+    int edge_allowance = 50;     // extra allowance for pixels next to an edge
+    bool minor_differences = false; // report differences hidden by the edge allowance in yellow
+
+    // page analysis, done once when a page is loaded
+    int sobel_threshold = 245;    // gradient magnitude that makes an edge
+    int vertical_threshold = 245; // horizontal gradient that makes a vertical edge
+    int dilation_radius = 2;      // how far the edge mask is grown
+    int min_vertical_run = 10;    // shorter vertical edge runs are dropped
+};
+
+constexpr CompareConfig default_compare_config{};
+
+constexpr CompareConfig minor_differences_compare_config = []
+{
+    CompareConfig config;
+    config.minor_differences = true;
+    return config;
+}();
+
+// The page analysis is shared by every preset, only the comparison may differ between them
+constexpr CompareConfig analysis_config = default_compare_config;
+
+#endif
@@ -0,0 +1,193 @@
+//
+//
+// Copyright the mso-test contributors
+//
+// SPDX-License-Identifier: MPL-2.0
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#include <algorithm>
+#include <bit>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <stdexcept>
+
+#include "history.hpp"
+#include "kernels.hpp"
+
+namespace
+{
+constexpr char history_magic[4] = {'P', 'B', 'R', 'H'};
+constexpr std::uint32_t history_version = 1;
+
+template <typename T>
+void write_value(std::ofstream &output, T value)
+{
+    output.write(reinterpret_cast<const char *>(&value), sizeof(value));
+}
+
+template <typename T>
+T read_value(std::ifstream &input)
+{
+    T value{};
+    input.read(reinterpret_cast<char *>(&value), sizeof(value));
+    return value;
+}
+} // namespace
+
+// The file: magic, version, width, height and run count, then per run its label (length and bytes),
+// then the bit-planes, oldest first, in native (little endian) words
+bool RedHistory::load(const std::string &filename)
+{
+    static_assert(std::endian::native == std::endian::little, "This code only works for little endian");
+    m_width = m_height = 0;
+    m_words = 0;
+    m_labels.clear();
+    m_planes.clear();
+
+    std::ifstream input{filename, std::ios_base::binary};
+    if (!input)
+        return false;
+
+    char magic[sizeof(history_magic)];
+    input.read(magic, sizeof(magic));
+    if (!input || std::memcmp(magic, history_magic, sizeof(magic)) != 0 || read_value<std::uint32_t>(input) != history_version)
+    {
+        throw std::runtime_error("Not a red pixel history file: " + filename);
+    }
+
+    m_width = read_value<std::int32_t>(input);
+    m_height = read_value<std::int32_t>(input);
+    std::uint32_t runs = read_value<std::uint32_t>(input);
+    if (!input || m_width <= 0 || m_height <= 0 || runs > max_runs)
+    {
+        throw std::runtime_error("Corrupt red pixel history file: " + filename);
+    }
+
+    for (std::uint32_t run = 0; run < runs; run++)
+    {
+        std::uint32_t length = read_value<std::uint32_t>(input);
+        if (!input || length > 4096)
+        {
+            throw std::runtime_error("Corrupt red pixel history file: " + filename);
+        }
+        std::string label(length, '\0');
+        input.read(label.data(), length);
+        m_labels.push_back(std::move(label));
+    }
+
+    m_words = (static_cast<std::size_t>(m_width) * m_height + 63) / 64;
+    m_planes.resize(m_words * runs);
+    input.read(reinterpret_cast<char *>(m_planes.data()), static_cast<std::streamsize>(m_planes.size() * sizeof(std::uint64_t)));
+    if (!input)
+    {
+        throw std::runtime_error("Truncated red pixel history file: " + filename);
+    }
+    return true;
+}
+
+void RedHistory::save(const std::string &filename) const
+{
+    // written next to the old one and renamed over it, like the manifest
+    std::string temporary = filename + ".tmp";
+    {
+        std::ofstream output(temporary, std::ios_base::binary | std::ios_base::trunc);
+        if (!output)
+        {
+            throw std::runtime_error("Cannot write the red pixel history: " + temporary);
+        }
+
+        output.write(history_magic, sizeof(history_magic));
+        write_value(output, history_version);
+        write_value(output, static_cast<std::int32_t>(m_width));
+        write_value(output, static_cast<std::int32_t>(m_height));
+        write_value(output, static_cast<std::uint32_t>(m_labels.size()));
+        for (const std::string &label : m_labels)
+        {
+            write_value(output, static_cast<std::uint32_t>(label.size()));
+            output.write(label.data(), static_cast<std::streamsize>(label.size()));
+        }
+        output.write(reinterpret_cast<const char *>(m_planes.data()), static_cast<std::streamsize>(m_planes.size() * sizeof(std::uint64_t)));
+        if (!output.flush())
+        {
+            throw std::runtime_error("Cannot write the red pixel history: " + temporary);
+        }
+    }
+    std::filesystem::rename(temporary, filename);
+}
+
+void RedHistory::add_run(const std::string &label, const BMP &diff, std::size_t keep)
+{
+    keep = std::clamp<std::size_t>(keep, 1, max_runs);
+    if (diff.get_width() != m_width || diff.get_height() != m_height)
+    {
+        m_width = diff.get_width();
+        m_height = diff.get_height();
+        m_words = (static_cast<std::size_t>(m_width) * m_height + 63) / 64;
+        m_labels.clear();
+        m_planes.clear();
+    }
+
+    if (!m_labels.empty() && !label.empty() && m_labels.back() == label)
+    {
+        m_labels.pop_back();
+        m_planes.resize(m_planes.size() - m_words);
+    }
+    while (m_labels.size() >= keep)
+    {
+        m_labels.erase(m_labels.begin());
+        m_planes.erase(m_planes.begin(), m_planes.begin() + static_cast<std::ptrdiff_t>(m_words));
+    }
+
+    // pack the red pixels 64 to a word, the bits past the last pixel stay clear
+    std::size_t first_word = m_planes.size();
+    m_planes.resize(first_word + m_words, 0);
+    m_labels.push_back(label);
+
+    std::size_t pixel_count = static_cast<std::size_t>(m_width) * m_height;
+    kernels().red_bits(diff.get_data().data(), 0, pixel_count, m_planes.data() + first_word);
+}
+
+HistorySummary RedHistory::summarise() const
+{
+    HistorySummary summary;
+    std::size_t runs = m_labels.size();
+    summary.runs = static_cast<int>(runs);
+    summary.first_seen.assign(runs, 0);
+    if (runs == 0)
+        return summary;
+
+    for (std::size_t word = 0; word < m_words; word++)
+    {
+        std::uint64_t seen = 0;          // red in any run so far
+        std::uint64_t always = ~0ull;    // red in every run so far
+        std::uint64_t changed = 0;       // changed at least once
+        std::uint64_t changed_again = 0; // changed more than once
+        std::uint64_t before = 0;        // the run before the newest
+        std::uint64_t last = plane(0)[word];
+        for (std::size_t run = 0; run < runs; run++)
+        {
+            std::uint64_t red = plane(run)[word];
+            summary.first_seen[run] += std::popcount(red & ~seen);
+            seen |= red;
+            always &= red;
+
+            std::uint64_t change = red ^ last;
+            changed_again |= changed & change;
+            changed |= change;
+            before = last;
+            last = red;
+        }
+
+        summary.red += std::popcount(last);
+        summary.persisting += std::popcount(always);
+        summary.flapping += std::popcount(changed_again);
+        if (runs > 1)
+            summary.fixed += std::popcount(before & ~last);
+    }
+    summary.new_red = summary.first_seen.back();
+    return summary;
+}
@@ -0,0 +1,62 @@
+//
+//
+// Copyright the mso-test contributors
+//
+// SPDX-License-Identifier: MPL-2.0
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#ifndef HISTORY_HPP
+#define HISTORY_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "bmp.hpp"
+
+// Pixel counts over the runs kept in a RedHistory
+struct HistorySummary
+{
+    int runs = 0;
+    std::int64_t red = 0;                 // red in the newest run
+    std::int64_t new_red = 0;             // red in the newest run and in none before it
+    std::int64_t persisting = 0;          // red in every run
+    std::int64_t fixed = 0;               // red in the run before the newest but not in the newest
+    std::int64_t flapping = 0;            // changed between red and not red more than once
+    std::vector<std::int64_t> first_seen; // per run, oldest first: the pixels that were red for the first time in it
+};
+
+// The red pixels of a page's diff over its last runs, one bit per pixel and one bit-plane per run, so
+// regressions can be followed across many nightly runs without keeping their diffs or pages. A page
+// that changed size starts a new history.
+class RedHistory
+{
+public:
+    static constexpr std::size_t max_runs = 64;
+
+    bool load(const std::string &filename); // false when the page has no history yet
+    void save(const std::string &filename) const;
+
+    // the red pixels of diff as the newest run, replacing the newest run when it has the same label;
+    // beyond keep runs the oldest are dropped
+    void add_run(const std::string &label, const BMP &diff, std::size_t keep);
+
+    // one pass over the bit-planes, a word of 64 pixels at a time
+    HistorySummary summarise() const;
+
+    std::size_t get_run_count() const { return m_labels.size(); }
+
+private:
+    const std::uint64_t *plane(std::size_t run) const { return m_planes.data() + run * m_words; }
+
+    int m_width = 0;
+    int m_height = 0;
+    std::size_t m_words = 0;             // per plane
+    std::vector<std::string> m_labels;   // oldest first
+    std::vector<std::uint64_t> m_planes; // plane after plane, bit i of a plane is pixel i in BMP row order
+};
+#endif
@@ -0,0 +1,215 @@
+//
+//
+// Copyright the mso-test contributors
+//
+// SPDX-License-Identifier: MPL-2.0
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <mutex>
+#include <stdexcept>
+#include <utility>
+
+#ifdef __linux__
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#include "image_buffer.hpp"
+
+namespace
+{
+// enough for the pages, masks and diffs of a few pipeline threads at 300 dpi
+constexpr std::size_t max_pooled_bytes = 512 * 1024 * 1024;
+
+struct Block
+{
+    std::size_t bytes;
+    void *pointer;
+};
+
+struct ImagePool
+{
+    std::mutex mutex;
+    std::vector<Block> blocks; // most recently freed last
+    std::size_t bytes = 0;
+
+    std::string spill_directory;                 // --spill
+    std::atomic<std::size_t> spill_min_bytes{0}; // 0 while not spilling, read without the lock
+    std::vector<void *> spilled;                 // the mapped blocks in use
+    std::atomic<std::size_t> spilled_count{0};   // its size, read without the lock
+};
+
+// never destroyed, buffers may still be freed by thread_local workspaces after the statics are gone
+ImagePool &get_pool()
+{
+    static ImagePool *pool = new ImagePool;
+    return *pool;
+}
+
+std::size_t round_up(std::size_t bytes, std::size_t multiple)
+{
+    return (bytes + multiple - 1) / multiple * multiple;
+}
+
+// the size and alignment a request is actually served with, the same on allocation and release
+std::pair<std::size_t, std::size_t> get_block_layout(std::size_t bytes)
+{
+    if (bytes >= huge_page_size)
+        return {round_up(bytes, huge_page_size), huge_page_size};
+    return {round_up(bytes, buffer_alignment), buffer_alignment};
+}
+
+#ifdef __linux__
+// a file of its own, unlinked at once so nothing is left behind whatever happens to the process; -1 on an error
+int open_spill_file(const std::string &directory)
+{
+    std::string name = directory + "/pixelbasher-spill-XXXXXX";
+    int file = ::mkstemp(name.data());
+    if (file >= 0)
+        ::unlink(name.c_str());
+    return file;
+}
+
+void *new_spilled_block(const std::string &directory, std::size_t bytes)
+{
+    int file = open_spill_file(directory);
+    if (file < 0)
+        throw std::bad_alloc();
+    void *pointer = MAP_FAILED;
+    if (::ftruncate(file, static_cast<off_t>(bytes)) == 0)
+        pointer = ::mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, file, 0);
+    ::close(file);
+    if (pointer == MAP_FAILED)
+        throw std::bad_alloc();
+    return pointer;
+}
+#endif
+
+void *new_block(std::size_t bytes, std::size_t alignment)
+{
+    void *pointer = ::operator new(bytes, std::align_val_t(alignment));
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+    // only a hint, the kernel may have transparent huge pages switched off
+    if (alignment == huge_page_size)
+        madvise(pointer, bytes, MADV_HUGEPAGE);
+#endif
+    return pointer;
+}
+} // namespace
+
+void *allocate_image_memory(std::size_t bytes)
+{
+    auto [block_bytes, alignment] = get_block_layout(bytes);
+#ifdef __linux__
+    {
+        ImagePool &pool = get_pool();
+        const std::size_t spill_min_bytes = pool.spill_min_bytes.load(std::memory_order_relaxed);
+        if (spill_min_bytes && bytes >= spill_min_bytes)
+        {
+            std::unique_lock<std::mutex> lock(pool.mutex);
+            const std::string directory = pool.spill_directory;
+            lock.unlock();
+            void *pointer = new_spilled_block(directory, block_bytes); // mapped at a page boundary, so aligned
+            lock.lock();
+            pool.spilled.push_back(pointer);
+            pool.spilled_count = pool.spilled.size();
+            return pointer;
+        }
+    }
+#endif
+    if (block_bytes >= pooled_buffer_size)
+    {
+        ImagePool &pool = get_pool();
+        std::lock_guard<std::mutex> lock(pool.mutex);
+        for (std::size_t i = pool.blocks.size(); i-- > 0;)
+        {
+            if (pool.blocks[i].bytes == block_bytes)
+            {
+                void *pointer = pool.blocks[i].pointer;
+                pool.blocks.erase(pool.blocks.begin() + static_cast<std::ptrdiff_t>(i));
+                pool.bytes -= block_bytes;
+                return pointer;
+            }
+        }
+    }
+    return new_block(block_bytes, alignment);
+}
+
+void release_image_memory(void *pointer, std::size_t bytes) noexcept
+{
+    if (pointer == nullptr)
+        return;
+
+    auto [block_bytes, alignment] = get_block_layout(bytes);
+#ifdef __linux__
+    if (get_pool().spilled_count.load(std::memory_order_relaxed))
+    {
+        ImagePool &pool = get_pool();
+        std::lock_guard<std::mutex> lock(pool.mutex);
+        auto spilled = std::find(pool.spilled.begin(), pool.spilled.end(), pointer);
+        if (spilled != pool.spilled.end())
+        {
+            pool.spilled.erase(spilled);
+            pool.spilled_count = pool.spilled.size();
+            ::munmap(pointer, block_bytes);
+            return;
+        }
+    }
+#endif
+    if (block_bytes >= pooled_buffer_size && block_bytes <= max_pooled_bytes)
+    {
+        ImagePool &pool = get_pool();
+        std::lock_guard<std::mutex> lock(pool.mutex);
+        // the oldest blocks make room, they are of page sizes the run has moved on from
+        std::size_t evicted = 0;
+        while (pool.bytes + block_bytes > max_pooled_bytes)
+        {
+            Block &oldest = pool.blocks[evicted++];
+            ::operator delete(oldest.pointer, std::align_val_t(get_block_layout(oldest.bytes).second));
+            pool.bytes -= oldest.bytes;
+        }
+        pool.blocks.erase(pool.blocks.begin(), pool.blocks.begin() + static_cast<std::ptrdiff_t>(evicted));
+        try
+        {
+            pool.blocks.push_back({block_bytes, pointer});
+            pool.bytes += block_bytes;
+            return;
+        }
+        catch (const std::bad_alloc &)
+        {
+            // freed below instead
+        }
+    }
+    ::operator delete(pointer, std::align_val_t(alignment));
+}
+
+void set_image_spill(const std::string &directory, std::size_t min_bytes)
+{
+#ifdef __linux__
+    int file = directory.empty() ? 0 : open_spill_file(directory);
+    if (file < 0)
+        throw std::runtime_error("Cannot create files in the spill directory: " + directory);
+    if (!directory.empty())
+        ::close(file);
+#else
+    if (!directory.empty())
+        throw std::runtime_error("Spilling pages to files is only supported on Linux");
+#endif
+    ImagePool &pool = get_pool();
+    std::lock_guard<std::mutex> lock(pool.mutex);
+    pool.spill_directory = directory;
+    pool.spill_min_bytes = directory.empty() ? 0 : std::max<std::size_t>(min_bytes, 1);
+}
+
+ImagePoolStatistics get_image_pool_statistics()
+{
+    ImagePool &pool = get_pool();
+    std::lock_guard<std::mutex> lock(pool.mutex);
+    return {pool.blocks.size(), pool.bytes};
+}
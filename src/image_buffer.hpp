@@ -0,0 +1,78 @@
+//
+//
+// Copyright the mso-test contributors
+//
+// SPDX-License-Identifier: MPL-2.0
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#ifndef IMAGE_BUFFER_HPP
+#define IMAGE_BUFFER_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <string>
+#include <vector>
+
+constexpr std::size_t buffer_alignment = 64;           // a cache line, and the width of an AVX-512 register
+constexpr std::size_t pooled_buffer_size = 256 * 1024;  // from here on buffers are recycled between pages
+constexpr std::size_t huge_page_size = 2 * 1024 * 1024; // from here on buffers are backed by transparent huge pages
+
+// Storage for pages and masks. Every block is at least buffer_alignment aligned. Blocks of
+// pooled_buffer_size and up go back to a pool when freed and are handed out again for the next page
+// of the same size, so a run over a corpus stops allocating after its first pages; blocks of
+// huge_page_size and up are rounded to whole huge pages and madvise()d for transparent huge pages.
+// Thread safe.
+void *allocate_image_memory(std::size_t bytes);
+void release_image_memory(void *pointer, std::size_t bytes) noexcept;
+
+// Large-page mode (--spill): blocks of min_bytes and up are mapped from files in directory, deleted as soon as
+// they are created, instead of taken from memory. The kernel writes their pages out to the file system
+// and reads them back as they are touched, so pages larger than the memory still compare, and as every
+// pass over a page goes through it row by row in order, at the speed of reading the files. Spilled
+// blocks are not pooled. Set before the first page, an empty directory turns it off; throws when the
+// directory cannot be used.
+void set_image_spill(const std::string &directory, std::size_t min_bytes);
+
+// What the pool currently keeps, for the tests
+struct ImagePoolStatistics
+{
+    std::size_t blocks = 0;
+    std::size_t bytes = 0;
+};
+ImagePoolStatistics get_image_pool_statistics();
+
+// Allocator handing out cache line aligned storage, so the kernels never straddle a line at the start of a row
+template <typename T>
+struct AlignedAllocator
+{
+    using value_type = T;
+
+    AlignedAllocator() noexcept = default;
+    template <typename U>
+    AlignedAllocator(const AlignedAllocator<U> &) noexcept {}
+
+    T *allocate(std::size_t count)
+    {
+        return static_cast<T *>(allocate_image_memory(count * sizeof(T)));
+    }
+
+    void deallocate(T *pointer, std::size_t count) noexcept
+    {
+        release_image_memory(pointer, count * sizeof(T));
+    }
+
+    template <typename U>
+    bool operator==(const AlignedAllocator<U> &) const noexcept { return true; }
+};
+
+// BGRA pixel data, pixel_stride bytes per pixel
+using PixelBuffer = std::vector<std::uint8_t, AlignedAllocator<std::uint8_t>>;
+
+// One byte per pixel, 0 or 1. Bytes rather than bits so the kernels can work on whole words of the mask
+using Mask = std::vector<std::uint8_t, AlignedAllocator<std::uint8_t>>;
+
+#endif
@@ -0,0 +1,221 @@
+//
+//
+// Copyright the mso-test contributors
+//
+// SPDX-License-Identifier: MPL-2.0
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <stdexcept>
+
+#include "kernels.hpp"
+#include "pixel.hpp"
+#include "regions.hpp"
+
+namespace
+{
+void sobel_row(const std::uint8_t *previous_row, const std::uint8_t *row, const std::uint8_t *next_row, int first, int last,
+               int edge_squared, int vertical_threshold, std::uint8_t *edges, std::uint8_t *vertical_edges)
+{
+    for (int x = first; x <= last; x++)
+    {
+        const int left = (x - 1) * pixel_stride;
+        const int middle = x * pixel_stride;
+        const int right = (x + 1) * pixel_stride;
+
+        int g_x = (-1 * previous_row[left]) + (-2 * row[left]) + (-1 * next_row[left]) +
+                  (previous_row[right]) + (2 * row[right]) + (next_row[right]);
+        int g_y = (previous_row[left]) + (2 * previous_row[middle]) + (previous_row[right]) +
+                  (-1 * next_row[left]) + (-2 * next_row[middle]) + (-1 * next_row[right]);
+
+        edges[x] = g_x * g_x + g_y * g_y >= edge_squared;
+        vertical_edges[x] = std::abs(g_x) >= vertical_threshold;
+    }
+}
+
+void dilate_row(const std::uint8_t *source, int width, int radius, int first, int last, std::uint8_t *destination)
+{
+    for (int x = first; x <= last; x++)
+    {
+        std::uint8_t value = 0;
+        for (int i = std::max(x - radius, 0); i <= std::min(x + radius, width - 1); i++)
+            value |= source[i];
+        destination[x] = value;
+    }
+}
+
+void or_row(const std::uint8_t *source, int first, int last, std::uint8_t *destination)
+{
+    for (int x = first; x <= last; x++)
+        destination[x] |= source[x];
+}
+
+// Classifies pixel pairs by gray value. The main check reproduces what Pixel::differs_from was called
+// with historically (near_edge and the background value in swapped order), which the expected output
+// in converted/expected depends on: the noise allowance applies within noise_distance of the near_edge
+// flag, and page_edge_allowance (edge_allowance unless the background is black) always applies.
+void classify_row(const std::uint8_t *original_row, const std::uint8_t *target_row, const std::uint8_t *near_edge,
+                  const std::uint8_t *vertical_edge, int first, int last, const ClassifyParameters &parameters, std::uint8_t *classes)
+{
+    for (int x = first; x <= last; x++)
+    {
+        const int original_gray = original_row[x * pixel_stride];
+        const int gray_diff = std::abs(original_gray - target_row[x * pixel_stride]);
+        const int threshold = parameters.threshold + parameters.page_edge_allowance +
+                              (std::abs(original_gray - near_edge[x]) < parameters.noise_distance ? parameters.noise_allowance : 0);
+
+        std::uint8_t pixel_class = RegionLabeler::NONE;
+        if (gray_diff <= threshold)
+        {
+            const int minor_threshold = parameters.threshold +
+                                        (std::abs(original_gray - parameters.background_value) < parameters.noise_distance ? parameters.noise_allowance : 0);
+            if (parameters.minor_differences && near_edge[x] && gray_diff > minor_threshold)
+                pixel_class = RegionLabeler::MINOR;
+        }
+        else if (vertical_edge[x])
+        {
+            pixel_class = RegionLabeler::VERTICAL_EDGE;
+        }
+        else if (!near_edge[x])
+        {
+            pixel_class = RegionLabeler::RED;
+        }
+        classes[x] = pixel_class;
+    }
+}
+
+void red_bits(const std::uint8_t *pixels, std::size_t first, std::size_t end, std::uint64_t *words)
+{
+    for (std::size_t i = first; i < end; i++)
+    {
+        if (Pixel::is_red(Pixel::get_bgra(pixels + i * pixel_stride)))
+            words[i / 64] |= std::uint64_t(1) << (i % 64);
+    }
+}
+
+// a run of one gray (most of a page) is counted in a register, rather than by increments of one
+// counter that each wait for the one before
+void gray_histogram(const std::uint8_t *row, int first, int last, std::uint32_t *histogram)
+{
+    if (first > last)
+        return;
+    int run_gray = row[first * pixel_stride];
+    std::uint32_t run_count = 0;
+    for (int x = first; x <= last; x++)
+    {
+        const int gray = row[x * pixel_stride];
+        if (gray != run_gray)
+        {
+            histogram[run_gray] += run_count;
+            run_gray = gray;
+            run_count = 0;
+        }
+        run_count++;
+    }
+    histogram[run_gray] += run_count;
+}
+
+bool sum_columns(const std::uint8_t *row, int first, int last, std::uint32_t *sums)
+{
+    bool coloured = false;
+    for (int x = first; x <= last; x++)
+    {
+        const std::uint8_t *pixel = row + x * pixel_stride;
+        for (int channel = 0; channel < pixel_stride; channel++)
+            sums[x * pixel_stride + channel] += pixel[channel];
+        coloured = coloured || pixel[0] != pixel[1] || pixel[1] != pixel[2];
+    }
+    return coloured;
+}
+
+constexpr Kernels scalar_kernels = {Isa::SCALAR, sobel_row, dilate_row, or_row, classify_row, red_bits, gray_histogram, sum_columns};
+
+std::atomic<const Kernels *> selected_kernels{nullptr};
+
+const Kernels &get_kernels(Isa isa)
+{
+    switch (isa)
+    {
+    case Isa::SSE42:
+        return get_sse42_kernels();
+    case Isa::AVX2:
+        return get_avx2_kernels();
+    case Isa::AVX512:
+        return get_avx512_kernels();
+    case Isa::SCALAR:
+        break;
+    }
+    return scalar_kernels;
+}
+} // namespace
+
+const Kernels &get_scalar_kernels()
+{
+    return scalar_kernels;
+}
+
+const Kernels &kernels()
+{
+    const Kernels *selected = selected_kernels.load(std::memory_order_acquire);
+    if (!selected)
+    {
+        selected = &get_kernels(get_best_isa());
+        selected_kernels.store(selected, std::memory_order_release);
+    }
+    return *selected;
+}
+
+Isa get_best_isa()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    // the CPU and the operating system (which has to save the wider registers) both have to support it
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f"))
+        return Isa::AVX512;
+    if (__builtin_cpu_supports("avx2"))
+        return Isa::AVX2;
+    if (__builtin_cpu_supports("sse4.2"))
+        return Isa::SSE42;
+#endif
+    return Isa::SCALAR;
+}
+
+void force_isa(Isa isa)
+{
+    if (isa > get_best_isa())
+    {
+        throw std::runtime_error(std::string("This CPU does not support ") + get_isa_name(isa) + ", the best it has is " + get_isa_name(get_best_isa()));
+    }
+    selected_kernels.store(&get_kernels(isa), std::memory_order_release);
+}
+
+Isa parse_isa(const std::string &name)
+{
+    for (Isa isa : {Isa::SCALAR, Isa::SSE42, Isa::AVX2, Isa::AVX512})
+    {
+        if (name == get_isa_name(isa))
+            return isa;
+    }
+    throw std::runtime_error("Unknown instruction set: " + name + " (expected scalar, sse4.2, avx2 or avx512)");
+}
+
+const char *get_isa_name(Isa isa)
+{
+    switch (isa)
+    {
+    case Isa::SSE42:
+        return "sse4.2";
+    case Isa::AVX2:
+        return "avx2";
+    case Isa::AVX512:
+        return "avx512";
+    case Isa::SCALAR:
+        break;
+    }
+    return "scalar";
+}
@@ -0,0 +1,86 @@
+//
+//
+// Copyright the mso-test contributors
+//
+// SPDX-License-Identifier: MPL-2.0
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#ifndef KERNELS_HPP
+#define KERNELS_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// The instruction sets the hot loops are built for, in order: a CPU that has one has the ones before it
+enum class Isa
+{
+    SCALAR,
+    SSE42,
+    AVX2,
+    AVX512
+};
+
+// The thresholds of a CompareConfig and the page they are applied to, see classify_row in kernels.cpp
+struct ClassifyParameters
+{
+    int threshold = 0;
+    int noise_distance = 0;
+    int noise_allowance = 0;
+    int page_edge_allowance = 0;
+    int background_value = 0;
+    bool minor_differences = false;
+};
+
+// The hot loops of the page analysis, the comparison and the history, one row (or run of pixels) per
+// call. Rows are BGRA and only channel 0 is looked at; masks are one byte per pixel, 0 or 1. Pointers
+// are to the start of a row and x runs from first to last inclusive, so a call for an empty span does
+// nothing. Every instruction set gives bit-identical results, kernel-check runs each against the reference.
+struct Kernels
+{
+    Isa isa;
+
+    // Sobel of the pixels of row between previous_row (y - 1) and next_row (y + 1): an edge where the gradient
+    // magnitude squared reaches edge_squared, a vertical edge where |gx| reaches vertical_threshold.
+    // first is at least 1 and last at most the width - 2.
+    void (*sobel_row)(const std::uint8_t *previous_row, const std::uint8_t *row, const std::uint8_t *next_row, int first, int last,
+                      int edge_squared, int vertical_threshold, std::uint8_t *edges, std::uint8_t *vertical_edges);
+
+    // destination[x] = the OR of source[x - radius] to source[x + radius], within 0 to width - 1
+    void (*dilate_row)(const std::uint8_t *source, int width, int radius, int first, int last, std::uint8_t *destination);
+    // destination[x] |= source[x]
+    void (*or_row)(const std::uint8_t *source, int first, int last, std::uint8_t *destination);
+
+    // the RegionLabeler class of every pixel pair of the rows
+    void (*classify_row)(const std::uint8_t *original_row, const std::uint8_t *target_row, const std::uint8_t *near_edge,
+                         const std::uint8_t *vertical_edge, int first, int last, const ClassifyParameters &parameters, std::uint8_t *classes);
+
+    // sets bit i % 64 of words[i / 64] for every red pixel i from first to end (exclusive)
+    void (*red_bits)(const std::uint8_t *pixels, std::size_t first, std::size_t end, std::uint64_t *words);
+
+    // histogram[gray] += the number of pixels of that gray, for the background value
+    void (*gray_histogram)(const std::uint8_t *row, int first, int last, std::uint32_t *histogram);
+
+    // sums[x * 4 + channel] += row[x * 4 + channel], all four channels, for the box filter of the previews; true when a
+    // pixel of the span is coloured (its blue, green and red are not all the same)
+    bool (*sum_columns)(const std::uint8_t *row, int first, int last, std::uint32_t *sums);
+};
+
+// The kernels for the best instruction set of this CPU, found with CPUID on first use, or the forced ones
+const Kernels &kernels();
+
+Isa get_best_isa(); // of this CPU and this build
+void force_isa(Isa isa); // throws when the CPU does not have it
+Isa parse_isa(const std::string &name);
+const char *get_isa_name(Isa isa);
+
+// the plain C++ kernels, also what the vector kernels hand their odd ends of a row to
+const Kernels &get_scalar_kernels();
+const Kernels &get_sse42_kernels();
+const Kernels &get_avx2_kernels();
+const Kernels &get_avx512_kernels();
+
+#endif
@@ -0,0 +1,83 @@
+//
+//
+// Copyright the mso-test contributors
+//
+// SPDX-License-Identifier: MPL-2.0
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#include <cstring>
+
+#include "kernels.hpp"
+#include "pixel.hpp"
+#include "regions.hpp"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+// everything below is built for AVX2, it is only called once get_best_isa() found it
+#pragma GCC target("avx2")
+
+namespace
+{
+// eight pixels at a time
+struct Avx2
+{
+    using Int = __m256i;
+    using Mask = __m256i;
+    using Bytes = __m256i;
+    static constexpr int lanes = 8;
+    static constexpr int byte_lanes = 32;
+
+    [[gnu::always_inline]] static Int set(int value) { return _mm256_set1_epi32(value); }
+    [[gnu::always_inline]] static Int pixels(const std::uint8_t *bgra) { return _mm256_loadu_si256(reinterpret_cast<const __m256i *>(bgra)); }
+    [[gnu::always_inline]] static Int load(const std::uint32_t *values) { return _mm256_loadu_si256(reinterpret_cast<const __m256i *>(values)); }
+    [[gnu::always_inline]] static void store(std::uint32_t *values, Int value) { _mm256_storeu_si256(reinterpret_cast<__m256i *>(values), value); }
+    [[gnu::always_inline]] static Int gray(const std::uint8_t *bgra) { return _mm256_and_si256(pixels(bgra), _mm256_set1_epi32(0xff)); }
+    [[gnu::always_inline]] static Int widen(const std::uint8_t *bytes) { return _mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i *>(bytes))); }
+    [[gnu::always_inline]] static void narrow_store(std::uint8_t *bytes, Int values) // values of 0 to 255
+    {
+        // the packs work within each 128-bit half, the first four bytes of each half are its values
+        __m256i words = _mm256_packus_epi32(values, values);
+        __m256i packed = _mm256_packus_epi16(words, words);
+        std::int32_t low = _mm_cvtsi128_si32(_mm256_castsi256_si128(packed));
+        std::int32_t high = _mm_cvtsi128_si32(_mm256_extracti128_si256(packed, 1));
+        std::memcpy(bytes, &low, sizeof(low));
+        std::memcpy(bytes + sizeof(low), &high, sizeof(high));
+    }
+
+    [[gnu::always_inline]] static Int add(Int a, Int b) { return _mm256_add_epi32(a, b); }
+    [[gnu::always_inline]] static Int sub(Int a, Int b) { return _mm256_sub_epi32(a, b); }
+    [[gnu::always_inline]] static Int mul(Int a, Int b) { return _mm256_mullo_epi32(a, b); }
+    [[gnu::always_inline]] static Int abs(Int a) { return _mm256_abs_epi32(a); }
+    [[gnu::always_inline]] static Int bitwise_and(Int a, Int b) { return _mm256_and_si256(a, b); }
+
+    [[gnu::always_inline]] static Mask greater(Int a, Int b) { return _mm256_cmpgt_epi32(a, b); }
+    [[gnu::always_inline]] static Mask equal(Int a, Int b) { return _mm256_cmpeq_epi32(a, b); }
+    [[gnu::always_inline]] static Mask both(Mask a, Mask b) { return _mm256_and_si256(a, b); }
+    [[gnu::always_inline]] static Mask but_not(Mask a, Mask b) { return _mm256_andnot_si256(b, a); }
+    [[gnu::always_inline]] static Int select(Mask mask, Int if_set, Int if_clear) { return _mm256_blendv_epi8(if_clear, if_set, mask); }
+    [[gnu::always_inline]] static std::uint32_t bits(Mask mask) { return _mm256_movemask_ps(_mm256_castsi256_ps(mask)); }
+
+    [[gnu::always_inline]] static Bytes load_bytes(const std::uint8_t *bytes) { return _mm256_loadu_si256(reinterpret_cast<const __m256i *>(bytes)); }
+    [[gnu::always_inline]] static void store_bytes(std::uint8_t *bytes, Bytes value) { _mm256_storeu_si256(reinterpret_cast<__m256i *>(bytes), value); }
+    [[gnu::always_inline]] static Bytes or_bytes(Bytes a, Bytes b) { return _mm256_or_si256(a, b); }
+};
+
+#include "kernels_simd.hpp"
+
+constexpr Kernels avx2_kernels = vector_kernels<Avx2>(Isa::AVX2);
+} // namespace
+
+const Kernels &get_avx2_kernels()
+{
+    return avx2_kernels;
+}
+#else
+const Kernels &get_avx2_kernels()
+{
+    return get_scalar_kernels();
+}
+#endif
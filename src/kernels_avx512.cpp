@@ -0,0 +1,78 @@
+//
+//
+// Copyright the mso-test contributors
+//
+// SPDX-License-Identifier: MPL-2.0
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#include <cstring>
+
+#include "kernels.hpp"
+#include "pixel.hpp"
+#include "regions.hpp"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+// everything below is built for AVX-512 (the foundation instructions only), it is only called once
+// get_best_isa() found it
+#pragma GCC target("avx512f")
+
+namespace
+{
+// sixteen pixels at a time, the comparisons give bit masks
+struct Avx512
+{
+    using Int = __m512i;
+    using Mask = __mmask16;
+    using Bytes = __m512i;
+    static constexpr int lanes = 16;
+    static constexpr int byte_lanes = 64;
+
+    [[gnu::always_inline]] static Int set(int value) { return _mm512_set1_epi32(value); }
+    [[gnu::always_inline]] static Int pixels(const std::uint8_t *bgra) { return _mm512_loadu_si512(bgra); }
+    [[gnu::always_inline]] static Int load(const std::uint32_t *values) { return _mm512_loadu_si512(values); }
+    [[gnu::always_inline]] static void store(std::uint32_t *values, Int value) { _mm512_storeu_si512(values, value); }
+    [[gnu::always_inline]] static Int gray(const std::uint8_t *bgra) { return _mm512_and_si512(pixels(bgra), _mm512_set1_epi32(0xff)); }
+    [[gnu::always_inline]] static Int widen(const std::uint8_t *bytes) { return _mm512_cvtepu8_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i *>(bytes))); }
+    [[gnu::always_inline]] static void narrow_store(std::uint8_t *bytes, Int values) // values of 0 to 255
+    {
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(bytes), _mm512_cvtepi32_epi8(values));
+    }
+
+    [[gnu::always_inline]] static Int add(Int a, Int b) { return _mm512_add_epi32(a, b); }
+    [[gnu::always_inline]] static Int sub(Int a, Int b) { return _mm512_sub_epi32(a, b); }
+    [[gnu::always_inline]] static Int mul(Int a, Int b) { return _mm512_mullo_epi32(a, b); }
+    [[gnu::always_inline]] static Int abs(Int a) { return _mm512_abs_epi32(a); }
+    [[gnu::always_inline]] static Int bitwise_and(Int a, Int b) { return _mm512_and_si512(a, b); }
+
+    [[gnu::always_inline]] static Mask greater(Int a, Int b) { return _mm512_cmpgt_epi32_mask(a, b); }
+    [[gnu::always_inline]] static Mask equal(Int a, Int b) { return _mm512_cmpeq_epi32_mask(a, b); }
+    [[gnu::always_inline]] static Mask both(Mask a, Mask b) { return _mm512_kand(a, b); }
+    [[gnu::always_inline]] static Mask but_not(Mask a, Mask b) { return _mm512_kandn(b, a); }
+    [[gnu::always_inline]] static Int select(Mask mask, Int if_set, Int if_clear) { return _mm512_mask_blend_epi32(mask, if_clear, if_set); }
+    [[gnu::always_inline]] static std::uint32_t bits(Mask mask) { return mask; }
+
+    [[gnu::always_inline]] static Bytes load_bytes(const std::uint8_t *bytes) { return _mm512_loadu_si512(bytes); }
+    [[gnu::always_inline]] static void store_bytes(std::uint8_t *bytes, Bytes value) { _mm512_storeu_si512(bytes, value); }
+    [[gnu::always_inline]] static Bytes or_bytes(Bytes a, Bytes b) { return _mm512_or_si512(a, b); }
+};
+
+#include "kernels_simd.hpp"
+
+constexpr Kernels avx512_kernels = vector_kernels<Avx512>(Isa::AVX512);
+} // namespace
+
+const Kernels &get_avx512_kernels()
+{
+    return avx512_kernels;
+}
+#else
+const Kernels &get_avx512_kernels()
+{
+    return get_scalar_kernels();
+}
+#endif
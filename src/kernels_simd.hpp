@@ -0,0 +1,212 @@
+//
+//
+// Copyright the mso-test contributors
+//
+// SPDX-License-Identifier: MPL-2.0
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+// The vector kernels, written once over the operations of a vector type V. Included by kernels_<isa>.cpp
+// only, after its #pragma GCC target and inside its anonymous namespace, so each instantiation is compiled
+// for that instruction set alone and nothing built for it can end up called on a CPU without it. The
+// parts of a row that do not fill a vector go to the scalar kernels.
+//
+// V has lanes 32-bit integers in an Int (loaded from and stored to 32-bit integers, or pixels, or widened
+// from bytes) and byte_lanes bytes in a Bytes, and a Mask of lanes flags.
+
+template <typename V>
+void vector_sobel_row(const std::uint8_t *previous_row, const std::uint8_t *row, const std::uint8_t *next_row, int first, int last,
+                      int edge_squared, int vertical_threshold, std::uint8_t *edges, std::uint8_t *vertical_edges)
+{
+    using Int = typename V::Int;
+    const Int two = V::set(2);
+    const Int one = V::set(1);
+    const Int zero = V::set(0);
+    const Int edge_limit = V::set(edge_squared - 1);
+    const Int vertical_limit = V::set(vertical_threshold - 1);
+
+    // the loads reach from pixel x - 1 to x + lanes, within the row as last is at most the width - 2
+    int x = first;
+    for (; x + V::lanes - 1 <= last; x += V::lanes)
+    {
+        const int left = (x - 1) * pixel_stride;
+        const int middle = x * pixel_stride;
+        const int right = (x + 1) * pixel_stride;
+
+        const Int previous_left = V::gray(previous_row + left);
+        const Int previous_right = V::gray(previous_row + right);
+        const Int next_left = V::gray(next_row + left);
+        const Int next_right = V::gray(next_row + right);
+
+        const Int g_x = V::sub(V::add(V::add(previous_right, V::mul(two, V::gray(row + right))), next_right),
+                               V::add(V::add(previous_left, V::mul(two, V::gray(row + left))), next_left));
+        const Int g_y = V::sub(V::add(V::add(previous_left, V::mul(two, V::gray(previous_row + middle))), previous_right),
+                               V::add(V::add(next_left, V::mul(two, V::gray(next_row + middle))), next_right));
+
+        const Int magnitude_squared = V::add(V::mul(g_x, g_x), V::mul(g_y, g_y));
+        V::narrow_store(edges + x, V::select(V::greater(magnitude_squared, edge_limit), one, zero));
+        V::narrow_store(vertical_edges + x, V::select(V::greater(V::abs(g_x), vertical_limit), one, zero));
+    }
+    get_scalar_kernels().sobel_row(previous_row, row, next_row, x, last, edge_squared, vertical_threshold, edges, vertical_edges);
+}
+
+template <typename V>
+void vector_dilate_row(const std::uint8_t *source, int width, int radius, int first, int last, std::uint8_t *destination)
+{
+    using Bytes = typename V::Bytes;
+
+    // the first radius columns have fewer neighbours on the left
+    int x = first;
+    if (x < radius)
+    {
+        get_scalar_kernels().dilate_row(source, width, radius, x, last < radius ? last : radius - 1, destination);
+        x = radius;
+    }
+
+    for (; x + V::byte_lanes - 1 <= last && x + V::byte_lanes - 1 + radius <= width - 1; x += V::byte_lanes)
+    {
+        Bytes value = V::load_bytes(source + x - radius);
+        for (int i = -radius + 1; i <= radius; i++)
+            value = V::or_bytes(value, V::load_bytes(source + x + i));
+        V::store_bytes(destination + x, value);
+    }
+    get_scalar_kernels().dilate_row(source, width, radius, x, last, destination);
+}
+
+template <typename V>
+void vector_or_row(const std::uint8_t *source, int first, int last, std::uint8_t *destination)
+{
+    int x = first;
+    for (; x + V::byte_lanes - 1 <= last; x += V::byte_lanes)
+        V::store_bytes(destination + x, V::or_bytes(V::load_bytes(destination + x), V::load_bytes(source + x)));
+    get_scalar_kernels().or_row(source, x, last, destination);
+}
+
+template <typename V>
+void vector_classify_row(const std::uint8_t *original_row, const std::uint8_t *target_row, const std::uint8_t *near_edge,
+                         const std::uint8_t *vertical_edge, int first, int last, const ClassifyParameters &parameters, std::uint8_t *classes)
+{
+    using Int = typename V::Int;
+    using Mask = typename V::Mask;
+    const Int zero = V::set(0);
+    const Int threshold = V::set(parameters.threshold + parameters.page_edge_allowance);
+    const Int minor_threshold = V::set(parameters.threshold);
+    const Int noise_distance = V::set(parameters.noise_distance);
+    const Int noise_allowance = V::set(parameters.noise_allowance);
+    const Int background = V::set(parameters.background_value);
+    const Int red = V::set(RegionLabeler::RED);
+    const Int minor = V::set(RegionLabeler::MINOR);
+    const Int vertical = V::set(RegionLabeler::VERTICAL_EDGE);
+
+    int x = first;
+    for (; x + V::lanes - 1 <= last; x += V::lanes)
+    {
+        const Int original_gray = V::gray(original_row + x * pixel_stride);
+        const Int near = V::widen(near_edge + x);
+        const Int gray_diff = V::abs(V::sub(original_gray, V::gray(target_row + x * pixel_stride)));
+        const Int allowance = V::select(V::greater(noise_distance, V::abs(V::sub(original_gray, near))), noise_allowance, zero);
+        const Mask changed = V::greater(gray_diff, V::add(threshold, allowance));
+        const Mask is_near = V::greater(near, zero);
+
+        // changed: dark yellow on a vertical edge, else red unless near an edge
+        Int pixel_class = V::select(is_near, zero, red);
+        pixel_class = V::select(V::greater(V::widen(vertical_edge + x), zero), vertical, pixel_class);
+        pixel_class = V::select(changed, pixel_class, zero);
+        if (parameters.minor_differences)
+        {
+            const Int minor_allowance = V::select(V::greater(noise_distance, V::abs(V::sub(original_gray, background))), noise_allowance, zero);
+            const Mask is_minor = V::both(V::but_not(is_near, changed), V::greater(gray_diff, V::add(minor_threshold, minor_allowance)));
+            pixel_class = V::select(is_minor, minor, pixel_class);
+        }
+        V::narrow_store(classes + x, pixel_class);
+    }
+    get_scalar_kernels().classify_row(original_row, target_row, near_edge, vertical_edge, x, last, parameters, classes);
+}
+
+template <typename V>
+void vector_red_bits(const std::uint8_t *pixels, std::size_t first, std::size_t end, std::uint64_t *words)
+{
+    using Int = typename V::Int;
+    const Int colour = V::set(0x00ffffff); // blue, green and red, not alpha
+    const Int red = V::set(0x00ff0000);
+
+    // lanes divides 64, so from a multiple of lanes a vector never straddles two words
+    std::size_t i = first;
+    for (; i % V::lanes != 0 && i < end; i++)
+        get_scalar_kernels().red_bits(pixels, i, i + 1, words);
+    for (; i + V::lanes <= end; i += V::lanes)
+    {
+        std::uint64_t bits = V::bits(V::equal(V::bitwise_and(V::pixels(pixels + i * pixel_stride), colour), red));
+        if (bits)
+            words[i / 64] |= bits << (i % 64);
+    }
+    get_scalar_kernels().red_bits(pixels, i, end, words);
+}
+
+template <typename V>
+void vector_gray_histogram(const std::uint8_t *row, int first, int last, std::uint32_t *histogram)
+{
+    using Int = typename V::Int;
+    constexpr std::uint32_t all_lanes = (1u << V::lanes) - 1;
+    if (first > last)
+        return;
+
+    // a vector of the gray of the run so far adds lanes pixels to the run, any other is counted pixel by
+    // pixel and the run goes on with the gray of its last pixel
+    int run_gray = row[first * pixel_stride];
+    Int run = V::set(run_gray);
+    std::uint32_t run_count = 0;
+    int x = first;
+    for (; x + V::lanes - 1 <= last; x += V::lanes)
+    {
+        const std::uint8_t *pixels = row + x * pixel_stride;
+        if (V::bits(V::equal(V::gray(pixels), run)) == all_lanes)
+        {
+            run_count += V::lanes;
+            continue;
+        }
+        get_scalar_kernels().gray_histogram(row, x, x + V::lanes - 1, histogram);
+        histogram[run_gray] += run_count;
+        run_count = 0;
+        run_gray = pixels[(V::lanes - 1) * pixel_stride];
+        run = V::set(run_gray);
+    }
+    histogram[run_gray] += run_count;
+    get_scalar_kernels().gray_histogram(row, x, last, histogram);
+}
+
+template <typename V>
+bool vector_sum_columns(const std::uint8_t *row, int first, int last, std::uint32_t *sums)
+{
+    using Int = typename V::Int;
+    constexpr std::uint32_t all_lanes = (1u << V::lanes) - 1;
+    const Int colour = V::set(0x00ffffff);
+    const Int blue = V::set(0xff);
+    const Int gray = V::set(0x010101); // times the blue byte: the pixel if it is gray
+
+    // the sums are laid out like the bytes of the row, so lanes bytes are widened and added at a time
+    bool coloured = false;
+    int x = first;
+    for (; x + V::lanes - 1 <= last; x += V::lanes)
+    {
+        const std::uint8_t *pixels = row + x * pixel_stride;
+        const Int bgra = V::pixels(pixels);
+        coloured = coloured || V::bits(V::equal(V::bitwise_and(bgra, colour), V::mul(V::bitwise_and(bgra, blue), gray))) != all_lanes;
+        for (int part = 0; part < pixel_stride; part++)
+        {
+            std::uint32_t *part_sums = sums + x * pixel_stride + part * V::lanes;
+            V::store(part_sums, V::add(V::load(part_sums), V::widen(pixels + part * V::lanes)));
+        }
+    }
+    const bool rest_coloured = get_scalar_kernels().sum_columns(row, x, last, sums);
+    return coloured || rest_coloured;
+}
+
+template <typename V>
+constexpr Kernels vector_kernels(Isa isa)
+{
+    return {isa, vector_sobel_row<V>, vector_dilate_row<V>, vector_or_row<V>, vector_classify_row<V>, vector_red_bits<V>, vector_gray_histogram<V>,
+            vector_sum_columns<V>};
+}
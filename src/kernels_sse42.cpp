@@ -0,0 +1,85 @@
+//
+//
+// Copyright the mso-test contributors
+//
+// SPDX-License-Identifier: MPL-2.0
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#include <cstring>
+
+#include "kernels.hpp"
+#include "pixel.hpp"
+#include "regions.hpp"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+// everything below is built for SSE 4.2, it is only called once get_best_isa() found it
+#pragma GCC target("sse4.2")
+
+namespace
+{
+// four pixels at a time
+struct Sse42
+{
+    using Int = __m128i;
+    using Mask = __m128i;
+    using Bytes = __m128i;
+    static constexpr int lanes = 4;
+    static constexpr int byte_lanes = 16;
+
+    [[gnu::always_inline]] static Int set(int value) { return _mm_set1_epi32(value); }
+    [[gnu::always_inline]] static Int pixels(const std::uint8_t *bgra) { return _mm_loadu_si128(reinterpret_cast<const __m128i *>(bgra)); }
+    [[gnu::always_inline]] static Int load(const std::uint32_t *values) { return _mm_loadu_si128(reinterpret_cast<const __m128i *>(values)); }
+    [[gnu::always_inline]] static void store(std::uint32_t *values, Int value) { _mm_storeu_si128(reinterpret_cast<__m128i *>(values), value); }
+    [[gnu::always_inline]] static Int gray(const std::uint8_t *bgra) { return _mm_and_si128(pixels(bgra), _mm_set1_epi32(0xff)); }
+    [[gnu::always_inline]] static Int widen(const std::uint8_t *bytes)
+    {
+        std::int32_t packed;
+        std::memcpy(&packed, bytes, sizeof(packed));
+        return _mm_cvtepu8_epi32(_mm_cvtsi32_si128(packed));
+    }
+    [[gnu::always_inline]] static void narrow_store(std::uint8_t *bytes, Int values) // values of 0 to 255
+    {
+        __m128i words = _mm_packus_epi32(values, values);
+        __m128i packed = _mm_packus_epi16(words, words);
+        std::int32_t low = _mm_cvtsi128_si32(packed);
+        std::memcpy(bytes, &low, sizeof(low));
+    }
+
+    [[gnu::always_inline]] static Int add(Int a, Int b) { return _mm_add_epi32(a, b); }
+    [[gnu::always_inline]] static Int sub(Int a, Int b) { return _mm_sub_epi32(a, b); }
+    [[gnu::always_inline]] static Int mul(Int a, Int b) { return _mm_mullo_epi32(a, b); }
+    [[gnu::always_inline]] static Int abs(Int a) { return _mm_abs_epi32(a); }
+    [[gnu::always_inline]] static Int bitwise_and(Int a, Int b) { return _mm_and_si128(a, b); }
+
+    [[gnu::always_inline]] static Mask greater(Int a, Int b) { return _mm_cmpgt_epi32(a, b); }
+    [[gnu::always_inline]] static Mask equal(Int a, Int b) { return _mm_cmpeq_epi32(a, b); }
+    [[gnu::always_inline]] static Mask both(Mask a, Mask b) { return _mm_and_si128(a, b); }
+    [[gnu::always_inline]] static Mask but_not(Mask a, Mask b) { return _mm_andnot_si128(b, a); }
+    [[gnu::always_inline]] static Int select(Mask mask, Int if_set, Int if_clear) { return _mm_blendv_epi8(if_clear, if_set, mask); }
+    [[gnu::always_inline]] static std::uint32_t bits(Mask mask) { return _mm_movemask_ps(_mm_castsi128_ps(mask)); }
+
+    [[gnu::always_inline]] static Bytes load_bytes(const std::uint8_t *bytes) { return _mm_loadu_si128(reinterpret_cast<const __m128i *>(bytes)); }
+    [[gnu::always_inline]] static void store_bytes(std::uint8_t *bytes, Bytes value) { _mm_storeu_si128(reinterpret_cast<__m128i *>(bytes), value); }
+    [[gnu::always_inline]] static Bytes or_bytes(Bytes a, Bytes b) { return _mm_or_si128(a, b); }
+};
+
+#include "kernels_simd.hpp"
+
+constexpr Kernels sse42_kernels = vector_kernels<Sse42>(Isa::SSE42);
+} // namespace
+
+const Kernels &get_sse42_kernels()
+{
+    return sse42_kernels;
+}
+#else
+const Kernels &get_sse42_kernels()
+{
+    return get_scalar_kernels();
+}
+#endif
@@ -9,17 +9,67 @@
 // file, You can obtain one at http://mozilla.org/MPL/2.0/.
 
 #include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <chrono>
 #include <cstdlib>
+#include <filesystem>
 #include <fstream>
 #include <iostream>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <thread>
 #include <vector>
 
+#include "band.hpp"
 #include "bmp.hpp"
+#include "history.hpp"
+#include "image_buffer.hpp"
+#include "kernels.hpp"
+#include "manifest.hpp"
+#include "output_store.hpp"
+#include "pdf_raster.hpp"
+#include "pipeline.hpp"
 #include "pixelbasher.hpp"
+#include "statistics.hpp"
+
+// The default --queue-depth is twice the threads up to this many page sets. A page set holds its pages, diffs
+// and masks at full size (around 100 MB for A4 at 150 dpi with the previous run's pages), so the memory of a run
+// is bounded by this and not by the number of cores; a bigger machine can give a deeper queue explicitly.
+constexpr std::size_t max_default_queue_depth = 16;
+
+// Options for the whole run, given as --name=value anywhere on the command line
+struct RunOptions
+{
+    unsigned stats_formats = StatisticsSink::CSV;
+    unsigned threads = 0;        // 0 means one per hardware thread
+    std::size_t queue_depth = 0; // page sets in flight (and so in memory), 0 means twice the threads up to max_default_queue_depth
+    std::string batch_file;      // one document per line, tab separated arguments
+    std::size_t max_regions = 0; // diff regions reported per page, 0 turns the clustering off
+    bool region_crops = false;   // also write a cropped overlay of every reported region
+    int preview_scale = 0;       // also write the image dump scaled down this many times, from 2
+    bool preview_only = false;   // write only the scaled down image dump
+    bool indexed_output = false; // write 8-bit palettised images instead of 32-bit ones
+    std::string manifest_file;   // results of earlier runs, documents with unchanged inputs are replayed from it
+    int pdf_dpi = 0;             // the image groups are one PDF file each, rendered in process at this resolution
+    std::size_t pdf_max_pages = 0; // with pdf_dpi, compare at most this many pages, 0 for all
+    std::string history_dir;       // the red pixels of every page over its last runs are kept here
+    std::string history_label;     // names this run in the history, a run with the same name replaces it
+    std::size_t history_runs = 30; // runs kept per page
+    std::string store_dir;         // the written images are kept here once per content, the outputs link to them
+    unsigned shard_index = 0;      // with shard_count, run only the documents of this shard, from 1
+    unsigned shard_count = 0;      // the batch is split into this many shards, 0 runs every document
+    bool statistics_only = false;  // count the differences for the statistics, draw and write no images
+    int max_red = PixelBasher::no_red_budget; // a page with more red pixels is over the budget and fails the run
+    std::string timings_file;      // the time of every page from its decoding to its statistics, for tools/replay.py
+    std::string spill_dir;         // large-page mode: the buffers of big pages are mapped from files here
+    std::size_t spill_mb = 256;    // buffers of this many MB and up are spilled
+};
 
 struct ParsedArguments
 {
+    std::vector<std::string> arguments; // as given, without the program name
     std::string basename;
     std::string extension;
     std::string import_dir;
@@ -28,11 +78,11 @@ struct ParsedArguments
     std::string export_compare_dir;
     std::string image_dump_dir;
     std::string stamp_dir;
-    std::vector<BMP> ms_orig_images;
-    std::vector<BMP> lo_images;
-    std::vector<BMP> ms_conv_images;
-    std::vector<BMP> lo_previous_images;
-    std::vector<BMP> ms_conv_previous_images;
+    std::vector<std::string> ms_orig_images;
+    std::vector<std::string> lo_images;
+    std::vector<std::string> ms_conv_images;
+    std::vector<std::string> lo_previous_images;
+    std::vector<std::string> ms_conv_previous_images;
     bool enable_minor_differences;
     bool no_save_overlay;
     bool image_dump;
@@ -40,42 +90,224 @@ struct ParsedArguments
     bool ms_previous;
 };
 
-void write_stats_to_csv(const BMP &base, const BMP &current, const BMP &previous, const BMP &diff, int page_number, std::string basename,
-                        std::string filename, bool previous_exists)
+// A document while its pages are in the pipeline
+struct DocumentState
 {
-    std::ofstream csv_file(filename);
-    if (!csv_file.is_open())
+    const RunOptions *options = nullptr;
+    ParsedArguments args;
+    std::vector<PageStatistics> import_stats;
+    std::vector<PageStatistics> export_stats;
+    std::size_t page_count = 0;
+    std::atomic<std::size_t> pages_remaining{0};
+    std::atomic<bool> failed{false};
+
+    std::vector<std::vector<std::string>> outputs; // images written, per page
+    bool memoised = false;                         // its inputs could be hashed, so it goes into the manifest
+    std::uint64_t inputs_hash = 0;
+    bool replayed = false; // unchanged since the last run, nothing to do
+    std::vector<std::pair<std::string, std::string>> stats_rows; // statistics file and row, kept until the documents before it are done
+    std::atomic<std::size_t> pages_over_budget{0}; // diffs with more than --max-red red pixels
+};
+
+// The pages of one page number of a document and everything computed from them. Tasks are
+// recycled by the pipeline, so the BMP buffers are reused by the next page that gets the slot.
+struct PageTask
+{
+    DocumentState *document = nullptr;
+    std::size_t page = 0;
+
+    BMP base;
+    BMP lo;
+    BMP ms_conv;
+    BMP lo_previous;
+    BMP ms_conv_previous;
+
+    BMP lo_diff;
+    BMP ms_conv_diff;
+    BMP lo_previous_diff;
+    BMP ms_conv_previous_diff;
+    BMP lo_compare;
+    BMP ms_conv_compare;
+    RegressionCounts lo_regressions;
+    RegressionCounts ms_conv_regressions;
+    DiffCounts lo_counts; // of the diffs, also when they were not drawn
+    DiffCounts ms_conv_counts;
+    DiffCounts lo_previous_counts;
+    DiffCounts ms_conv_previous_counts;
+
+    bool force_save_import = false;
+    bool force_save_export = false;
+    std::chrono::steady_clock::time_point started; // when its decoding began, for --timings
+};
+
+unsigned parse_count(const std::string &option, const std::string &value)
+{
+    try
     {
-        throw std::runtime_error("Cannot open CSV file for writing");
+        std::size_t used = 0;
+        unsigned long count = std::stoul(value, &used);
+        if (used == value.size())
+            return static_cast<unsigned>(count);
     }
+    catch (const std::exception &)
+    {
+    }
+    throw std::runtime_error("Incorrect usage for --" + option + ": " + value + " should be a number");
+}
 
-    double base_total_pixels = base.get_width() * base.get_height();
-    double current_total_pixels = current.get_width() * current.get_height();
-
-    csv_file << basename << ","
-             << page_number << ","
-             << base_total_pixels << ","
-             << base.get_non_background_count() << ","
-             << (static_cast<double>(base.get_non_background_count()) / base_total_pixels) << ","
-             << current_total_pixels << ","
-             << current.get_non_background_count() << ","
-             << (static_cast<double>(current.get_non_background_count()) / current_total_pixels) << ","
-             << diff.get_red_count() << ","
-             << (static_cast<double>(diff.get_red_count()) / current_total_pixels);
-
-    if (previous_exists)
+// Named options (--name=value) may appear anywhere after the program name, they are
+// removed from argv so the positional arguments can be parsed from the end as before
+void parse_options(std::vector<std::string> &argv, RunOptions &options)
+{
+    std::vector<std::string> positional;
+    for (const std::string &option : argv)
     {
-        double previous_total_pixels = previous.get_width() * previous.get_height();
-        csv_file << "," << previous_total_pixels << ","
-                 << previous.get_non_background_count() << ","
-                 << (static_cast<double>(previous.get_non_background_count()) / previous_total_pixels) << ","
-                 << previous.get_red_count() << ","
-                 << (static_cast<double>(previous.get_red_count()) / previous_total_pixels);
+        if (positional.empty() || option.rfind("--", 0) != 0)
+        {
+            positional.push_back(option);
+            continue;
+        }
+
+        std::size_t equals = option.find('=');
+        std::string name = option.substr(2, equals == std::string::npos ? std::string::npos : equals - 2);
+        std::string value = equals == std::string::npos ? "" : option.substr(equals + 1);
+
+        if (name == "stats-format")
+        {
+            options.stats_formats = StatisticsSink::parse_formats(value);
+        }
+        else if (name == "threads")
+        {
+            options.threads = parse_count(name, value);
+        }
+        else if (name == "queue-depth")
+        {
+            options.queue_depth = parse_count(name, value);
+        }
+        else if (name == "batch")
+        {
+            options.batch_file = value;
+        }
+        else if (name == "manifest")
+        {
+            options.manifest_file = value;
+        }
+        else if (name == "pdf-dpi")
+        {
+            options.pdf_dpi = parse_count(name, value);
+        }
+        else if (name == "pdf-max-pages")
+        {
+            options.pdf_max_pages = parse_count(name, value);
+        }
+        else if (name == "history")
+        {
+            options.history_dir = value;
+        }
+        else if (name == "history-label")
+        {
+            options.history_label = value;
+        }
+        else if (name == "history-runs")
+        {
+            options.history_runs = parse_count(name, value);
+            if (options.history_runs < 1 || options.history_runs > RedHistory::max_runs)
+            {
+                throw std::runtime_error("Incorrect usage for --history-runs: " + value + " should be 1 to " + std::to_string(RedHistory::max_runs));
+            }
+        }
+        else if (name == "store")
+        {
+            options.store_dir = value;
+        }
+        else if (name == "shard")
+        {
+            std::size_t slash = value.find('/');
+            if (slash == std::string::npos)
+            {
+                throw std::runtime_error("Incorrect usage for --shard: " + value + " should be i/N");
+            }
+            options.shard_index = parse_count(name, value.substr(0, slash));
+            options.shard_count = parse_count(name, value.substr(slash + 1));
+            if (options.shard_index < 1 || options.shard_index > options.shard_count)
+            {
+                throw std::runtime_error("Incorrect usage for --shard: " + value + " should be i/N with i from 1 to N");
+            }
+        }
+        else if (name == "force-isa")
+        {
+            // for testing and benchmarking, the best instruction set of the CPU is used otherwise
+            force_isa(parse_isa(value));
+        }
+        else if (name == "statistics-only")
+        {
+            if (!value.empty())
+            {
+                throw std::runtime_error("Incorrect usage for --statistics-only: it takes no value");
+            }
+            options.statistics_only = true;
+        }
+        else if (name == "timings")
+        {
+            options.timings_file = value;
+        }
+        else if (name == "spill")
+        {
+            options.spill_dir = value;
+        }
+        else if (name == "spill-mb")
+        {
+            options.spill_mb = parse_count(name, value);
+        }
+        else if (name == "max-red")
+        {
+            options.max_red = static_cast<int>(std::min<unsigned>(parse_count(name, value), PixelBasher::no_red_budget));
+        }
+        else if (name == "regions")
+        {
+            options.max_regions = parse_count(name, value);
+        }
+        else if (name == "region-crops")
+        {
+            if (!value.empty())
+            {
+                throw std::runtime_error("Incorrect usage for --region-crops: it takes no value");
+            }
+            options.region_crops = true;
+        }
+        else if (name == "preview")
+        {
+            options.preview_scale = parse_count(name, value);
+            if (options.preview_scale < 2)
+            {
+                throw std::runtime_error("Incorrect usage for --preview: " + value + " should be 2 or more");
+            }
+        }
+        else if (name == "preview-only")
+        {
+            if (!value.empty())
+            {
+                throw std::runtime_error("Incorrect usage for --preview-only: it takes no value");
+            }
+            options.preview_only = true;
+        }
+        else if (name == "indexed-output")
+        {
+            if (!value.empty())
+            {
+                throw std::runtime_error("Incorrect usage for --indexed-output: it takes no value");
+            }
+            options.indexed_output = true;
+        }
+        else
+        {
+            throw std::runtime_error("Unknown option: " + option);
+        }
     }
-    csv_file << "\n";
+    argv.swap(positional);
 }
 
-void parse_flag(char *argv[], int &arg_index, bool &option, std::string option_name)
+void parse_flag(const std::vector<std::string> &argv, int &arg_index, bool &option, std::string option_name)
 {
     std::string value = argv[arg_index - 1];
     if (value == "true" || value == "false")
@@ -89,7 +321,7 @@ void parse_flag(char *argv[], int &arg_index, bool &option, std::string option_n
     }
 }
 
-void parse_flags(int &arg_index, char *argv[], ParsedArguments &args)
+void parse_flags(int &arg_index, const std::vector<std::string> &argv, ParsedArguments &args)
 {
     assert(arg_index >= 5);
     parse_flag(argv, arg_index, args.enable_minor_differences, "minor-differences");
@@ -99,7 +331,7 @@ void parse_flags(int &arg_index, char *argv[], ParsedArguments &args)
     parse_flag(argv, arg_index, args.lo_previous, "lo_previous");
 }
 
-void parse_directories(int &arg_index, char *argv[], ParsedArguments &args)
+void parse_directories(int &arg_index, const std::vector<std::string> &argv, ParsedArguments &args)
 {
     assert(arg_index >= 6);
     args.stamp_dir = argv[--arg_index];
@@ -110,26 +342,34 @@ void parse_directories(int &arg_index, char *argv[], ParsedArguments &args)
     args.import_dir = argv[--arg_index];
 }
 
-void parse_image_group(char *argv[], int start, int pages, std::vector<BMP> &images)
+void parse_image_group(const std::vector<std::string> &argv, int start, int pages, std::vector<std::string> &images)
 {
     for (int i = 0; i < pages; i++)
     {
-        images.push_back(BMP(argv[start + i]));
+        images.push_back(argv[start + i]);
     }
 }
 
-ParsedArguments parse_arguments(int argc, char *argv[], int pdf_count = 3)
+ParsedArguments parse_arguments(const std::vector<std::string> &argv, int pdf_count = 3)
 {
+    int argc = static_cast<int>(argv.size());
     if (argc < 11)
     {
-        throw std::runtime_error("Incorrect usage: " + std::string(argv[0]) + " filename.ext" +
+        throw std::runtime_error("Incorrect usage: " + argv[0] + " filename.ext" +
                                  "ms_orig-1.bmp ms_orig-2.bmp ... lo-1.bmp lo-2.bmp ... ms_conv.bmp-1.bmp ms_conv-2.bmp ..." +
                                  "[lo_previous-1.bmp lo_previous-2.bmp ... ms_conv_previous-1.bmp ms_conv_previous-2.bmp ...]" +
                                  "import_dir/ exported_dir/ import-compare_dir/ export-compare_dir/ image-dump_dir/ stamp_dir/" +
-                                 "[lo_previous] [ms_preivous] [image_dump] [no_save_overlay] [enable_minor_differences]");
+                                 "[lo_previous] [ms_preivous] [image_dump] [no_save_overlay] [enable_minor_differences]" +
+                                 " [--stats-format=csv,jsonl] [--threads=N] [--queue-depth=N] [--batch=jobs.tsv]" +
+                                 " [--regions=N] [--region-crops] [--preview=N] [--preview-only] [--indexed-output]" +
+                                 " [--manifest=manifest.tsv] [--pdf-dpi=N] [--pdf-max-pages=N]" +
+                                 " [--history=dir] [--history-label=name] [--history-runs=N] [--store=dir] [--shard=i/N]" +
+                                 " [--statistics-only] [--max-red=N] [--force-isa=scalar,sse4.2,avx2,avx512] [--timings=file]" +
+                                 " [--spill=dir] [--spill-mb=N]");
     }
 
     ParsedArguments args;
+    args.arguments.assign(argv.begin() + 1, argv.end());
     int arg_index = argc;
 
     parse_flags(arg_index, argv, args);
@@ -176,173 +416,747 @@ ParsedArguments parse_arguments(int argc, char *argv[], int pdf_count = 3)
     return args;
 }
 
-BMP diff(PixelBasher &pixel_basher, BMP &base, BMP &target, bool allow_minor_diffs)
+// Every non-empty line not starting with '#' holds the arguments of one document, separated by tabs
+std::vector<ParsedArguments> parse_batch_file(const std::string &program, const std::string &filename)
 {
-    BMP diff = pixel_basher.compare_bmps(base, target, allow_minor_diffs);
-    return diff;
+    std::ifstream input(filename);
+    if (!input)
+    {
+        throw std::runtime_error("Cannot open the batch file: " + filename);
+    }
+
+    std::vector<ParsedArguments> documents;
+    std::string line;
+    int line_number = 0;
+    while (std::getline(input, line))
+    {
+        line_number++;
+        if (!line.empty() && line.back() == '\r')
+            line.pop_back();
+        if (line.empty() || line[0] == '#')
+            continue;
+
+        std::vector<std::string> argv = {program};
+        std::size_t start = 0;
+        for (;;)
+        {
+            std::size_t tab = line.find('\t', start);
+            argv.push_back(line.substr(start, tab == std::string::npos ? std::string::npos : tab - start));
+            if (tab == std::string::npos)
+                break;
+            start = tab + 1;
+        }
+
+        try
+        {
+            documents.push_back(parse_arguments(argv));
+        }
+        catch (const std::exception &e)
+        {
+            throw std::runtime_error(filename + ":" + std::to_string(line_number) + ": " + e.what());
+        }
+    }
+    return documents;
 }
 
-int main(int argc, char *argv[])
+// A page is read from its BMP file or, with --pdf-dpi, rendered from the one PDF file of the group
+void load_page(const std::vector<std::string> &images, std::size_t page, const RunOptions &options, BMP &bmp)
 {
-    try
+    if (options.pdf_dpi)
+        render_pdf_page(images[0], static_cast<int>(page), options.pdf_dpi, bmp);
+    else
+        bmp.read(images[page].c_str());
+}
+
+void decode_pages(PageTask &task)
+{
+    const ParsedArguments &args = task.document->args;
+    const RunOptions &options = *task.document->options;
+    task.started = std::chrono::steady_clock::now();
+    if (task.document->failed)
+        return;
+
+    load_page(args.ms_orig_images, task.page, options, task.base);
+    load_page(args.lo_images, task.page, options, task.lo);
+    load_page(args.ms_conv_images, task.page, options, task.ms_conv);
+    if (args.lo_previous)
+        load_page(args.lo_previous_images, task.page, options, task.lo_previous);
+    if (args.ms_previous)
+        load_page(args.ms_conv_previous_images, task.page, options, task.ms_conv_previous);
+}
+
+// The counts of a drawn diff, over the budget as a counted one would be
+DiffCounts counts_of(const BMP &diff, int max_red)
+{
+    return {diff.get_red_count(), diff.get_yellow_count(), diff.get_red_count() > max_red};
+}
+
+// The pages are analysed and compared in one sweep of strips by the band engine: the import and the export
+// comparison each draw their diffs (with a previous run both diffs and the regression map) or, with
+// --statistics-only, only count them, and a page over the budget stops being counted
+void compare_pages(PageTask &task)
+{
+    const ParsedArguments &args = task.document->args;
+    const RunOptions &options = *task.document->options;
+    if (task.document->failed)
+        return;
+
+    // one engine per worker and one workspace per comparison, their buffers are reused by every page the worker compares
+    thread_local BandEngine bands;
+    thread_local CompareWorkspace lo_workspace;
+    thread_local CompareWorkspace ms_conv_workspace;
+    lo_workspace.max_regions = options.max_regions;
+    ms_conv_workspace.max_regions = options.max_regions;
+
+    if (args.lo_previous && args.ms_previous)
+        bands.begin({&task.base, &task.lo, &task.ms_conv, &task.lo_previous, &task.ms_conv_previous});
+    else if (args.lo_previous)
+        bands.begin({&task.base, &task.lo, &task.ms_conv, &task.lo_previous});
+    else if (args.ms_previous)
+        bands.begin({&task.base, &task.lo, &task.ms_conv, &task.ms_conv_previous});
+    else
+        bands.begin({&task.base, &task.lo, &task.ms_conv});
+
+    task.force_save_import = false;
+    task.force_save_export = false;
+    PageComparison lo;
+    PageComparison ms_conv;
+    const BMP *lo_previous = args.lo_previous ? &task.lo_previous : nullptr;
+    const BMP *ms_conv_previous = args.ms_previous ? &task.ms_conv_previous : nullptr;
+    if (options.statistics_only)
     {
-        ParsedArguments args = parse_arguments(argc, argv);
-        PixelBasher pixel_basher;
-        const std::string csv_filename = "diff-pdf-" + args.extension;
+        lo.begin_counting(task.base, task.lo, lo_previous, args.enable_minor_differences, lo_workspace, options.max_red);
+        ms_conv.begin_counting(task.base, task.ms_conv, ms_conv_previous, args.enable_minor_differences, ms_conv_workspace, options.max_red);
+        bands.run({&lo, &ms_conv});
 
-        size_t num_pages = args.ms_orig_images.size();
-        if (num_pages != args.lo_images.size() || num_pages != args.ms_conv_images.size())
+        task.lo_counts = lo.get_counts().current;
+        task.ms_conv_counts = ms_conv.get_counts().current;
+        if (args.lo_previous)
+        {
+            task.lo_previous_counts = lo.get_counts().previous;
+            task.lo_regressions = lo.get_counts().regressions;
+        }
+        if (args.ms_previous)
         {
-            throw std::runtime_error("Error: mismatched number of pages (" + std::to_string(num_pages) + ") between MS_ORIG, LO, MS_CONV and/or LO_PREVIOUS, MS_CONV_PREVIOUS");
+            task.ms_conv_previous_counts = ms_conv.get_counts().previous;
+            task.ms_conv_regressions = ms_conv.get_counts().regressions;
         }
+        return;
+    }
+
+    if (args.lo_previous)
+        lo.begin(task.base, task.lo, task.lo_previous, args.enable_minor_differences, task.lo_diff, task.lo_previous_diff, task.lo_compare,
+                 lo_workspace);
+    else
+        lo.begin(task.base, task.lo, args.enable_minor_differences, task.lo_diff, lo_workspace);
+    if (args.ms_previous)
+        ms_conv.begin(task.base, task.ms_conv, task.ms_conv_previous, args.enable_minor_differences, task.ms_conv_diff,
+                      task.ms_conv_previous_diff, task.ms_conv_compare, ms_conv_workspace);
+    else
+        ms_conv.begin(task.base, task.ms_conv, args.enable_minor_differences, task.ms_conv_diff, ms_conv_workspace);
+    bands.run({&lo, &ms_conv});
 
-        for (size_t i = 0; i < num_pages; i++)
+    if (args.lo_previous)
+    {
+        task.lo_regressions = lo.get_regressions();
+        if (args.no_save_overlay)
+        {
+            if (task.lo_diff.get_red_count() > task.lo_previous_diff.get_red_count())
+            {
+                task.force_save_import = true;
+            }
+        }
+    }
+    if (args.ms_previous)
+    {
+        task.ms_conv_regressions = ms_conv.get_regressions();
+        if (args.no_save_overlay)
         {
-            bool force_save_import = false;
-            bool force_save_export = false;
+            if (task.ms_conv_diff.get_red_count() > task.ms_conv_previous_diff.get_red_count())
+            {
+                task.force_save_export = true;
+            }
+        }
+    }
 
-            BMP base = args.ms_orig_images[i];
-            BMP lo = args.lo_images[i];
-            BMP ms_conv = args.ms_conv_images[i];
-            BMP lo_previous;
-            BMP ms_conv_previous;
+    task.lo_counts = counts_of(task.lo_diff, options.max_red);
+    task.ms_conv_counts = counts_of(task.ms_conv_diff, options.max_red);
+    if (args.lo_previous)
+        task.lo_previous_counts = counts_of(task.lo_previous_diff, options.max_red);
+    if (args.ms_previous)
+        task.ms_conv_previous_counts = counts_of(task.ms_conv_previous_diff, options.max_red);
+}
 
-            BMP lo_diff = diff(pixel_basher, base, lo, args.enable_minor_differences);
-            BMP ms_conv_diff = diff(pixel_basher, base, ms_conv, args.enable_minor_differences);
+// Writes an output image in the format asked for, 32-bit BGRA unless --indexed-output, into the store with --store
+void write_image(const BMP &image, const std::string &path, PageTask &task)
+{
+    const RunOptions &options = *task.document->options;
+    static const std::vector<PixelValues> palette_colours = PixelBasher::diff_colours();
+    if (options.store_dir.empty())
+    {
+        // streamed to the file, only the store needs the whole encoding to name it
+        if (options.indexed_output)
+            image.write_indexed(path.c_str(), palette_colours);
+        else
+            image.write(path.c_str());
+    }
+    else
+    {
+        store_output_file(options.store_dir, path, options.indexed_output ? image.encode_indexed(palette_colours) : image.encode());
+    }
+    task.document->outputs[task.page].push_back(path);
+}
 
-            BMP lo_previous_diff;
-            BMP ms_conv_previous_diff;
-            BMP lo_compare;
-            BMP ms_conv_compare;
+// Writes an image of the image dump at full size, as a preview scaled down by --preview, or both
+void write_dump_image(const BMP &image, const std::string &path_prefix, const std::string &page_ext, PageTask &task)
+{
+    const RunOptions &options = *task.document->options;
+    if (!options.preview_only)
+        write_image(image, path_prefix + page_ext, task);
+    if (options.preview_scale > 1)
+        write_image(image.downscale(options.preview_scale), path_prefix + "preview-" + page_ext, task);
+}
 
-            std::string page_ext = std::to_string(i + 1) + ".bmp";
+// Writes a cropped overlay of every region of the diff, with a margin so the difference can be seen in context
+void write_region_crops(const BMP &diff, const std::string &path_prefix, PageTask &task)
+{
+    constexpr int margin = 16;
+    for (std::size_t i = 0; i < diff.get_regions().size(); i++)
+    {
+        const DiffRegion &region = diff.get_regions()[i];
+        std::string output_path = path_prefix + std::to_string(i + 1) + ".bmp";
+        write_image(diff.crop(region.left - margin, region.bottom - margin, region.right + margin, region.top + margin), output_path, task);
+    }
+}
 
-            if (args.lo_previous)
-            {
-                lo_previous = args.lo_previous_images[i];
-                lo_previous_diff = diff(pixel_basher, base, lo_previous, args.enable_minor_differences);
+// Adds the red pixels of the diff to the page's history as the newest run, the summary goes into its statistics
+HistorySummary update_history(const BMP &diff, const std::string &path, const RunOptions &options)
+{
+    RedHistory history;
+    history.load(path);
+    history.add_run(options.history_label, diff, options.history_runs);
+    history.save(path);
+    return history.summarise();
+}
 
-                lo_compare = pixel_basher.compare_regressions(base, lo_diff, lo_previous_diff);
-                if (args.no_save_overlay)
-                {
-                    if (lo_diff.get_red_count() > lo_previous_diff.get_red_count())
-                    {
-                        force_save_import = true;
-                    }
-                }
-            }
+void write_pages(PageTask &task)
+{
+    DocumentState &document = *task.document;
+    const ParsedArguments &args = document.args;
+    if (document.failed)
+        return;
+
+    const BMP &base = task.base;
+    const BMP &lo = task.lo;
+    const BMP &ms_conv = task.ms_conv;
+    const RunOptions &options = *document.options;
+    std::string page_ext = std::to_string(task.page + 1) + ".bmp";
 
-            if (args.ms_previous)
+    const bool write_overlays = !options.statistics_only && !args.no_save_overlay;
+    if (write_overlays || task.force_save_import)
+    {
+        std::string output_path = args.import_dir + "/" + args.basename + "_import-" + page_ext;
+        write_image(task.lo_diff, output_path, task);
+        if (options.region_crops)
+            write_region_crops(task.lo_diff, args.import_dir + "/" + args.basename + "_import-" + std::to_string(task.page + 1) + "-region-", task);
+
+        if (args.lo_previous)
+        {
+            output_path = args.import_dir + "/" + args.basename + "_prev-import-" + page_ext;
+            write_image(task.lo_previous_diff, output_path, task);
+
+            output_path = args.import_compare_dir + "/" + args.basename + "_import-compare-" + page_ext;
+            write_image(task.lo_compare, output_path, task);
+
+            if (args.image_dump)
             {
-                ms_conv_previous = args.ms_conv_previous_images[i];
-                ms_conv_previous_diff = diff(pixel_basher, base, ms_conv_previous, args.enable_minor_differences);
+                write_dump_image(task.lo_compare, args.image_dump_dir + "/" + args.basename + "_import-compare-", page_ext, task);
+            }
+        }
+    }
 
-                ms_conv_compare = pixel_basher.compare_regressions(base, ms_conv_diff, ms_conv_previous_diff);
-                if (args.no_save_overlay)
-                {
-                    if (ms_conv_diff.get_red_count() > ms_conv_previous_diff.get_red_count())
-                    {
-                        force_save_export = true;
-                    }
-                }
+    if (write_overlays || task.force_save_export)
+    {
+        std::string output_path = args.export_dir + "/" + args.basename + "_export-" + page_ext;
+        write_image(task.ms_conv_diff, output_path, task);
+        if (options.region_crops)
+            write_region_crops(task.ms_conv_diff, args.export_dir + "/" + args.basename + "_export-" + std::to_string(task.page + 1) + "-region-", task);
+
+        if (args.ms_previous)
+        {
+            output_path = args.export_dir + "/" + args.basename + "_prev-export-" + page_ext;
+            write_image(task.ms_conv_previous_diff, output_path, task);
+
+            output_path = args.export_compare_dir + "/" + args.basename + "_export-compare-" + page_ext;
+            write_image(task.ms_conv_compare, output_path, task);
+
+            if (args.image_dump)
+            {
+                write_dump_image(task.ms_conv_compare, args.image_dump_dir + "/" + args.basename + "_export-compare-", page_ext, task);
             }
+        }
+    }
+
+    if (args.image_dump && !options.statistics_only)
+    {
+        const std::string dump_prefix = args.image_dump_dir + "/" + args.basename;
+        write_dump_image(base, dump_prefix + "_authoritative_original-", page_ext, task);
+        write_dump_image(lo, dump_prefix + "_import-grayscale-", page_ext, task);
+        write_dump_image(ms_conv, dump_prefix + "_export-grayscale-", page_ext, task);
+        write_dump_image(task.lo_diff, dump_prefix + "_import-overlay-", page_ext, task);
+        write_dump_image(task.ms_conv_diff, dump_prefix + "_export-overlay-", page_ext, task);
+
+        std::string output_path = dump_prefix + "_import-side-by-side-" + page_ext;
+        if (std::optional<BMP> side_by_side = BMP::side_by_side(task.lo_diff, base, lo, args.stamp_dir, output_path.c_str()))
+            write_dump_image(*side_by_side, dump_prefix + "_import-side-by-side-", page_ext, task);
+
+        output_path = dump_prefix + "_export-side-by-side-" + page_ext;
+        if (std::optional<BMP> side_by_side = BMP::side_by_side(task.ms_conv_diff, base, ms_conv, args.stamp_dir, output_path.c_str()))
+            write_dump_image(*side_by_side, dump_prefix + "_export-side-by-side-", page_ext, task);
+
+        if (args.lo_previous)
+        {
+            write_dump_image(task.lo_previous, dump_prefix + "_prev-import-grayscale-", page_ext, task);
+            write_dump_image(task.lo_previous_diff, dump_prefix + "_prev-import-overlay-", page_ext, task);
+        }
+        if (args.ms_previous)
+        {
+            write_dump_image(task.ms_conv_previous, dump_prefix + "_prev-export-grayscale-", page_ext, task);
+            write_dump_image(task.ms_conv_previous_diff, dump_prefix + "_prev-export-overlay-", page_ext, task);
+        }
+    }
+
+    PageStatistics import_stats = PageStatistics::from_pages(args.basename, task.page + 1, base, lo, task.lo_counts.red);
+    import_stats.over_max_red = task.lo_counts.over_budget;
+    import_stats.counts_partial = task.lo_counts.partial;
+    if (args.lo_previous)
+        import_stats.set_previous(task.lo_previous, task.lo_previous_counts.red, task.lo_regressions);
+    if (options.max_regions)
+        import_stats.set_regions(task.lo_diff);
+    const std::string history_prefix = options.history_dir + "/" + args.basename;
+    const std::string history_ext = std::to_string(task.page + 1) + ".history";
+    if (!options.history_dir.empty())
+        import_stats.set_history(update_history(task.lo_diff, history_prefix + "_import-" + history_ext, options));
+    document.import_stats[task.page] = import_stats;
+
+    PageStatistics export_stats = PageStatistics::from_pages(args.basename, task.page + 1, base, ms_conv, task.ms_conv_counts.red);
+    export_stats.over_max_red = task.ms_conv_counts.over_budget;
+    export_stats.counts_partial = task.ms_conv_counts.partial;
+    if (args.ms_previous)
+        export_stats.set_previous(task.ms_conv_previous, task.ms_conv_previous_counts.red, task.ms_conv_regressions);
+    if (options.max_regions)
+        export_stats.set_regions(task.ms_conv_diff);
+    if (!options.history_dir.empty())
+        export_stats.set_history(update_history(task.ms_conv_diff, history_prefix + "_export-" + history_ext, options));
+    document.export_stats[task.page] = export_stats;
+    document.pages_over_budget += import_stats.over_max_red + export_stats.over_max_red;
 
-            if (!args.no_save_overlay || force_save_import)
+    // for debugging
+    // std::string filter_path = args.import_dir + "/" + args.basename + "_import-vertical-edges" + page_ext;
+    // lo.write_with_filter(filter_path.c_str(), lo.get_vertical_edge_mask());
+
+    // filter_path = args.import_dir + "/" + args.basename + "_import-blurred-edges" + page_ext;
+    // lo.write_with_filter(filter_path.c_str(), lo.get_blurred_edge_mask());
+
+    // filter_path = args.import_dir + "/" + args.basename + "_origin-vertical-edges" + page_ext;
+    // base.write_with_filter(filter_path.c_str(), base.get_vertical_edge_mask());
+}
+
+// The arguments of a document, tab separated as in a batch file, identify it in the manifest
+std::string job_name(const ParsedArguments &args)
+{
+    std::string job;
+    for (const std::string &argument : args.arguments)
+        job += (job.empty() ? "" : "\t") + argument;
+    return job;
+}
+
+// Everything the outputs of a document depend on: the pixelbasher binary, the options that change what is
+// written, the arguments and the contents of every page and stamp it reads
+std::uint64_t hash_inputs(const ParsedArguments &args, const RunOptions &options, std::uint64_t binary_hash)
+{
+    Hasher hasher;
+    hasher.add(&binary_hash, sizeof(binary_hash));
+    hasher.add(std::to_string(options.stats_formats) + " " + std::to_string(options.max_regions) + " " +
+               std::to_string(options.region_crops) + " " + std::to_string(options.preview_scale) + " " +
+               std::to_string(options.preview_only) + " " + std::to_string(options.indexed_output) + " " +
+               std::to_string(options.pdf_dpi) + " " + std::to_string(options.pdf_max_pages) + " " +
+               options.history_dir + " " + options.history_label + " " + std::to_string(options.history_runs) + " " +
+               std::to_string(options.statistics_only) + " " + std::to_string(options.max_red));
+    hasher.add(job_name(args));
+
+    for (const auto *images : {&args.ms_orig_images, &args.lo_images, &args.ms_conv_images, &args.lo_previous_images, &args.ms_conv_previous_images})
+    {
+        for (const std::string &image : *images)
+            hasher.add_file(image);
+    }
+    if (args.image_dump)
+    {
+        for (const char *stamp : {"/diff.bmp", "/ms-office.bmp", "/cool.bmp"})
+            hasher.add_file(args.stamp_dir + stamp);
+    }
+    return hasher.digest();
+}
+
+// Hashes the inputs of every document on all threads, reading the pages is most of the cost of a replayed run
+void hash_documents(std::vector<std::unique_ptr<DocumentState>> &documents, const RunOptions &options, unsigned threads)
+{
+    const std::uint64_t binary_hash = Manifest::binary_hash();
+    std::atomic<std::size_t> next{0};
+    auto hash_next = [&]
+    {
+        for (std::size_t i = next++; i < documents.size(); i = next++)
+        {
+            try
+            {
+                documents[i]->inputs_hash = hash_inputs(documents[i]->args, options, binary_hash);
+                documents[i]->memoised = true;
+            }
+            catch (const std::exception &)
             {
-                std::string output_path = args.import_dir + "/" + args.basename + "_import-" + page_ext;
-                lo_diff.write(output_path.c_str());
+                // an unreadable input is reported when the document is processed, and it is never replayed
+            }
+        }
+    };
 
-                if (args.lo_previous)
-                {
-                    output_path = args.import_dir + "/" + args.basename + "_prev-import-" + page_ext;
-                    lo_previous_diff.write(output_path.c_str());
+    std::vector<std::thread> workers;
+    for (unsigned i = 1; i < threads && i < documents.size(); i++)
+        workers.emplace_back(hash_next);
+    hash_next();
+    for (auto &worker : workers)
+        worker.join();
+}
 
-                    output_path = args.import_compare_dir + "/" + args.basename + "_import-compare-" + page_ext;
-                    lo_compare.write(output_path.c_str());
+// The shard of a document, from 0. It only depends on the document's name, so every runner of a sharded
+// batch picks the same documents out of the batch file and the history of a page stays with one shard.
+unsigned shard_of(const ParsedArguments &args, unsigned shard_count)
+{
+    Hasher hasher;
+    hasher.add(args.basename);
+    return static_cast<unsigned>(hasher.digest() % shard_count);
+}
 
-                    if (args.image_dump)
-                    {
-                        output_path = args.image_dump_dir + "/" + args.basename + "_import-compare-" + page_ext;
-                        lo_compare.write(output_path.c_str());
-                    }
-                }
+// pixelbasher merge --batch=jobs.tsv [--manifest=merged.tsv] shard-1.tsv ... shard-N.tsv
+// Puts the results of a batch run as --shard=1/N to N/N with --manifest back together, as one run of the whole
+// batch would have left them: the statistics rows of every document in the order of the batch file, appended
+// to the statistics files, and one manifest with the entries of every document. The shard manifests are given
+// in shard order.
+int merge_shards(const std::vector<std::string> &arguments, const RunOptions &options)
+{
+    if (options.batch_file.empty() || arguments.size() < 3)
+    {
+        throw std::runtime_error("Incorrect usage: " + arguments[0] + " merge --batch=jobs.tsv [--manifest=merged.tsv] shard-1.tsv ... shard-N.tsv");
+    }
+
+    std::vector<Manifest> shards(arguments.size() - 2);
+    for (std::size_t shard = 0; shard < shards.size(); shard++)
+    {
+        const std::string &filename = arguments[shard + 2];
+        if (!std::filesystem::exists(filename))
+        {
+            throw std::runtime_error("Cannot open the shard manifest: " + filename);
+        }
+        shards[shard].load(filename);
+    }
+
+    Manifest merged;
+    if (!options.manifest_file.empty())
+        merged.load(options.manifest_file);
+
+    // a document without an entry failed in its shard, or its shard did not run, and it has no rows as in an unsharded run
+    StatisticsSink &stats_sink = StatisticsSink::instance();
+    bool any_missing = false;
+    bool any_over_budget = false;
+    for (const ParsedArguments &args : parse_batch_file(arguments[0], options.batch_file))
+    {
+        unsigned shard = shard_of(args, static_cast<unsigned>(shards.size()));
+        const std::string job = job_name(args);
+        const ManifestEntry *entry = shards[shard].get(job);
+        if (!entry)
+        {
+            std::cerr << "Error: " << args.basename << ": no results in the manifest of shard " << shard + 1 << "/" << shards.size()
+                      << " (" << arguments[shard + 2] << ")" << std::endl;
+            any_missing = true;
+            continue;
+        }
+
+        for (const auto &[filename, row] : entry->stats_rows)
+            stats_sink.add_row(filename, row);
+        any_over_budget = any_over_budget || entry->pages_over_budget;
+        merged.record(job, *entry);
+    }
+    stats_sink.flush();
+
+    if (!options.manifest_file.empty())
+        merged.save();
+    return any_missing ? 1 : any_over_budget ? 2 : 0;
+}
+
+int main(int argc, char *argv[])
+{
+    try
+    {
+        std::vector<std::string> arguments(argv, argv + argc);
+        RunOptions options;
+        parse_options(arguments, options);
+        if (arguments.size() > 1 && arguments[1] == "merge")
+            return merge_shards(arguments, options);
+
+        std::vector<std::unique_ptr<DocumentState>> documents;
+        if (!options.batch_file.empty())
+        {
+            for (ParsedArguments &args : parse_batch_file(arguments[0], options.batch_file))
+            {
+                documents.push_back(std::make_unique<DocumentState>());
+                documents.back()->args = std::move(args);
             }
+        }
+        else
+        {
+            documents.push_back(std::make_unique<DocumentState>());
+            documents.back()->args = parse_arguments(arguments);
+        }
+        const bool batch = documents.size() > 1;
+        if (options.shard_count)
+        {
+            std::erase_if(documents, [&](const std::unique_ptr<DocumentState> &document)
+                          { return shard_of(document->args, options.shard_count) != options.shard_index - 1; });
+        }
+        if (options.region_crops && !options.max_regions)
+        {
+            throw std::runtime_error("Incorrect usage for --region-crops: it needs --regions=N");
+        }
+        if (options.preview_only && !options.preview_scale)
+        {
+            throw std::runtime_error("Incorrect usage for --preview-only: it needs --preview=N");
+        }
+        if (options.statistics_only && (options.max_regions || !options.history_dir.empty()))
+        {
+            throw std::runtime_error("Incorrect usage for --statistics-only: --regions and --history need the diff images");
+        }
+        if (!options.history_dir.empty())
+        {
+            std::filesystem::create_directories(options.history_dir);
+        }
+        if (!options.store_dir.empty())
+        {
+            std::filesystem::create_directories(options.store_dir);
+        }
+        if (!options.spill_dir.empty())
+        {
+            std::filesystem::create_directories(options.spill_dir);
+            set_image_spill(options.spill_dir, options.spill_mb << 20);
+        }
 
-            if (!args.no_save_overlay || force_save_export)
+        std::atomic<bool> any_failed{false};
+        std::atomic<bool> any_over_budget{false}; // --max-red
+
+        for (auto &document : documents)
+        {
+            document->options = &options;
+            const ParsedArguments &args = document->args;
+            size_t num_pages = args.ms_orig_images.size();
+            if (num_pages != args.lo_images.size() || num_pages != args.ms_conv_images.size())
             {
-                std::string output_path = args.export_dir + "/" + args.basename + "_export-" + page_ext;
-                ms_conv_diff.write(output_path.c_str());
+                throw std::runtime_error("Error: mismatched number of pages (" + std::to_string(num_pages) + ") between MS_ORIG, LO, MS_CONV and/or LO_PREVIOUS, MS_CONV_PREVIOUS");
+            }
 
-                if (args.ms_previous)
+            if (options.pdf_dpi)
+            {
+                if (num_pages != 1)
                 {
-                    output_path = args.export_dir + "/" + args.basename + "_prev-export-" + page_ext;
-                    ms_conv_previous_diff.write(output_path.c_str());
-
-                    output_path = args.export_compare_dir + "/" + args.basename + "_export-compare-" + page_ext;
-                    ms_conv_compare.write(output_path.c_str());
+                    throw std::runtime_error("Incorrect usage for --pdf-dpi: give one PDF file per group, not " + std::to_string(num_pages));
+                }
 
-                    if (args.image_dump)
+                // as the conversion script does, the pages that all the PDF files have are compared
+                try
+                {
+                    num_pages = pdf_page_count(args.ms_orig_images[0]);
+                    for (const auto *pdf : {&args.lo_images, &args.ms_conv_images, &args.lo_previous_images, &args.ms_conv_previous_images})
                     {
-                        std::string output_path = args.image_dump_dir + "/" + args.basename + "_export-compare-" + page_ext;
-                        ms_conv_compare.write(output_path.c_str());
+                        if (!pdf->empty())
+                            num_pages = std::min<std::size_t>(num_pages, pdf_page_count((*pdf)[0]));
                     }
+                    if (options.pdf_max_pages)
+                        num_pages = std::min(num_pages, options.pdf_max_pages);
+                }
+                catch (const std::exception &e)
+                {
+                    std::cerr << "Error: " << (batch ? args.basename + ": " : "") << e.what() << std::endl;
+                    document->failed = true;
+                    any_failed = true;
+                    num_pages = 0;
                 }
             }
 
-            if (args.image_dump)
-            {
-                std::string output_path = args.image_dump_dir + "/" + args.basename + "_authoritative_original-" + page_ext;
-                base.write(output_path.c_str());
+            document->page_count = num_pages;
+            document->import_stats.resize(num_pages);
+            document->export_stats.resize(num_pages);
+            document->outputs.resize(num_pages);
+            document->pages_remaining = num_pages;
+        }
 
-                output_path = args.image_dump_dir + "/" + args.basename + "_import-grayscale-" + page_ext;
-                lo.write(output_path.c_str());
+        StatisticsSink &stats_sink = StatisticsSink::instance();
+        stats_sink.set_formats(options.stats_formats);
 
-                output_path = args.image_dump_dir + "/" + args.basename + "_export-grayscale-" + page_ext;
-                ms_conv.write(output_path.c_str());
+        unsigned threads = options.threads ? options.threads : std::max(1u, std::thread::hardware_concurrency());
+        std::size_t queue_depth = options.queue_depth ? options.queue_depth : std::min<std::size_t>(2 * threads, max_default_queue_depth);
 
-                output_path = args.image_dump_dir + "/" + args.basename + "_import-overlay-" + page_ext;
-                lo_diff.write(output_path.c_str());
+        Manifest manifest;
+        if (!options.manifest_file.empty())
+        {
+            manifest.load(options.manifest_file);
+            hash_documents(documents, options, threads);
 
-                output_path = args.image_dump_dir + "/" + args.basename + "_export-overlay-" + page_ext;
-                ms_conv_diff.write(output_path.c_str());
+            // an unchanged document gets its statistics rows again, its images are still there from last time
+            for (auto &document : documents)
+            {
+                const ManifestEntry *entry = document->memoised ? manifest.find(job_name(document->args), document->inputs_hash) : nullptr;
+                if (!entry)
+                    continue;
+                document->stats_rows = entry->stats_rows;
+                document->replayed = true;
+                if (entry->pages_over_budget)
+                    any_over_budget = true;
+            }
+        }
 
-                output_path = args.image_dump_dir + "/" + args.basename + "_import-side-by-side-" + page_ext;
-                BMP::write_side_by_side(lo_diff, base, lo, args.stamp_dir, output_path.c_str());
+        // the rows of every document are written in the order of the batch, whatever order the documents finish in,
+        // so a run gives the same statistics files with any number of threads (and merged shards too)
+        std::size_t next_to_write = 0;
+        auto write_done_documents = [&]
+        {
+            for (; next_to_write < documents.size(); next_to_write++)
+            {
+                DocumentState &document = *documents[next_to_write];
+                if (!document.replayed && document.pages_remaining != 0)
+                    break;
+                for (const auto &[filename, row] : document.stats_rows)
+                    stats_sink.add_row(filename, row);
+                document.stats_rows.clear();
+            }
+            try
+            {
+                stats_sink.flush();
+            }
+            catch (const std::exception &e)
+            {
+                any_failed = true;
+                std::cerr << "Error: " << e.what() << std::endl;
+            }
+        };
+        write_done_documents();
 
-                output_path = args.image_dump_dir + "/" + args.basename + "_export-side-by-side-" + page_ext;
-                BMP::write_side_by_side(ms_conv_diff, base, ms_conv, args.stamp_dir, output_path.c_str());
+        std::mutex completion_mutex;
+        std::vector<std::string> timings; // --timings, one line per page in the order they finished
 
-                if (args.lo_previous)
+        auto finish_page = [&](PageTask &task, std::exception_ptr error)
+        {
+            DocumentState &document = *task.document;
+            std::lock_guard<std::mutex> lock(completion_mutex);
+            if (error && !document.failed)
+            {
+                document.failed = true;
+                any_failed = true;
+                try
                 {
-                    output_path = args.image_dump_dir + "/" + args.basename + "_prev-import-grayscale-" + page_ext;
-                    lo_previous.write(output_path.c_str());
-
-                    output_path = args.image_dump_dir + "/" + args.basename + "_prev-import-overlay-" + page_ext;
-                    lo_previous_diff.write(output_path.c_str());
+                    std::rethrow_exception(error);
                 }
-                if (args.ms_previous)
+                catch (const std::exception &e)
                 {
-                    output_path = args.image_dump_dir + "/" + args.basename + "_prev-export-grayscale-" + page_ext;
-                    ms_conv_previous.write(output_path.c_str());
+                    std::cerr << "Error: " << (batch ? document.args.basename + ": " : "") << e.what() << std::endl;
+                }
+            }
+            if (!options.timings_file.empty() && !document.failed)
+            {
+                std::chrono::duration<double> seconds = std::chrono::steady_clock::now() - task.started;
+                timings.push_back(document.args.basename + "\t" + std::to_string(task.page + 1) + "\t" + std::to_string(seconds.count()));
+            }
 
-                    output_path = args.image_dump_dir + "/" + args.basename + "_prev-export-overlay-" + page_ext;
-                    ms_conv_previous_diff.write(output_path.c_str());
+            if (--document.pages_remaining != 0)
+                return;
+            if (!document.failed)
+            {
+                // all pages of the document are appended together, a failed document leaves no partial rows
+                ManifestEntry entry;
+                entry.inputs_hash = document.inputs_hash;
+                entry.pages_over_budget = document.pages_over_budget;
+                if (document.pages_over_budget)
+                    any_over_budget = true;
+                const std::string stats_stem = "diff-pdf-" + document.args.extension;
+                for (const auto *page_stats : {&document.import_stats, &document.export_stats})
+                {
+                    const std::string stem = stats_stem + (page_stats == &document.import_stats ? "-import-statistics" : "-export-statistics");
+                    for (const PageStatistics &stats : *page_stats)
+                    {
+                        for (auto &row : stats_sink.format_rows(stem, stats))
+                            document.stats_rows.push_back(std::move(row));
+                    }
+                }
+                if (document.memoised)
+                {
+                    entry.stats_rows = document.stats_rows;
+                    for (const auto &page_outputs : document.outputs)
+                    {
+                        for (const std::string &path : page_outputs)
+                        {
+                            std::error_code error; // a missing image only means the document is not replayed next time
+                            entry.outputs.emplace_back(path, std::filesystem::file_size(path, error));
+                        }
+                    }
+                    manifest.record(job_name(document.args), std::move(entry));
                 }
             }
+            write_done_documents();
+        };
+
+        std::size_t next_document = 0;
+        std::size_t next_page = 0;
+        auto next_page_set = [&](PageTask &task)
+        {
+            while (next_document < documents.size() &&
+                   (documents[next_document]->replayed || next_page >= documents[next_document]->page_count))
+            {
+                next_document++;
+                next_page = 0;
+            }
+            if (next_document == documents.size())
+                return false;
 
-            write_stats_to_csv(base, lo, lo_diff, lo_previous_diff, i + 1, args.basename, (csv_filename + "-import-statistics.csv"), args.lo_previous);
-            write_stats_to_csv(base, ms_conv, ms_conv_diff, ms_conv_previous_diff, i + 1, args.basename, (csv_filename + "-export-statistics.csv"), args.ms_previous);
+            task.document = documents[next_document].get();
+            task.page = next_page++;
+            return true;
+        };
 
-            // for debugging
-            // std::string filter_path = args.import_dir + "/" + args.basename + "_import-vertical-edges" + page_ext;
-            // lo.write_with_filter(filter_path.c_str(), lo.get_vertical_edge_mask());
+        Pipeline<PageTask> pipeline({decode_pages, compare_pages, write_pages}, finish_page, threads, queue_depth);
+        pipeline.run(next_page_set);
 
-            // filter_path = args.import_dir + "/" + args.basename + "_import-blurred-edges" + page_ext;
-            // lo.write_with_filter(filter_path.c_str(), lo.get_blurred_edge_mask());
+        if (!options.manifest_file.empty())
+        {
+            // a document that failed this time has no results, not the ones of an earlier run
+            for (const auto &document : documents)
+            {
+                if (document->failed)
+                    manifest.erase(job_name(document->args));
+            }
+            manifest.save();
+        }
 
-            // filter_path = args.import_dir + "/" + args.basename + "_origin-vertical-edges" + page_ext;
-            // base.write_with_filter(filter_path.c_str(), base.get_vertical_edge_mask());
+        if (!options.timings_file.empty())
+        {
+            std::ofstream output(options.timings_file, std::ios_base::trunc);
+            for (const std::string &line : timings)
+                output << line << '\n';
+            if (!output.flush())
+            {
+                throw std::runtime_error("Cannot write the page timings: " + options.timings_file);
+            }
         }
+
+        if (any_failed)
+            return 1;
+        if (any_over_budget)
+            return 2; // the run went fine, the gate failed
     }
     catch (const std::exception &e)
     {
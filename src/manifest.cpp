@@ -0,0 +1,236 @@
+//
+//
+// Copyright the mso-test contributors
+//
+// SPDX-License-Identifier: MPL-2.0
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#include <bit>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <stdexcept>
+
+#include "manifest.hpp"
+
+namespace
+{
+constexpr std::uint64_t multiplier_1 = 0x87c37b91114253d5ull;
+constexpr std::uint64_t multiplier_2 = 0x4cf5ad432745937full;
+
+std::uint64_t mix(std::uint64_t state, std::uint64_t word)
+{
+    return std::rotl(state ^ (word * multiplier_1), 31) * multiplier_2 + 0x52dce729ull;
+}
+
+std::string to_hex(std::uint64_t value)
+{
+    char buffer[17];
+    std::snprintf(buffer, sizeof(buffer), "%016llx", static_cast<unsigned long long>(value));
+    return buffer;
+}
+} // namespace
+
+void Hasher::add(const void *data, std::size_t size)
+{
+    const std::uint8_t *bytes = static_cast<const std::uint8_t *>(data);
+    m_length += size;
+
+    // whole 8-byte words straight from the data when nothing is pending, the rest goes through m_pending
+    while (size > 0)
+    {
+        if (m_pending_size == 0 && size >= sizeof(std::uint64_t))
+        {
+            std::uint64_t word;
+            std::memcpy(&word, bytes, sizeof(word));
+            m_state = mix(m_state, word);
+            bytes += sizeof(word);
+            size -= sizeof(word);
+            continue;
+        }
+
+        m_pending[m_pending_size++] = *bytes++;
+        size--;
+        if (m_pending_size == sizeof(std::uint64_t))
+        {
+            std::uint64_t word;
+            std::memcpy(&word, m_pending, sizeof(word));
+            m_state = mix(m_state, word);
+            m_pending_size = 0;
+        }
+    }
+}
+
+void Hasher::add(const std::string &value)
+{
+    std::uint64_t length = value.size();
+    add(&length, sizeof(length));
+    add(value.data(), value.size());
+}
+
+void Hasher::add_file(const std::string &filename)
+{
+    std::ifstream input{filename, std::ios_base::binary};
+    if (!input)
+    {
+        throw std::runtime_error("Can't open the file to hash: " + filename);
+    }
+
+    std::vector<char> buffer(1 << 16);
+    while (input)
+    {
+        input.read(buffer.data(), buffer.size());
+        add(buffer.data(), static_cast<std::size_t>(input.gcount()));
+    }
+    if (!input.eof())
+    {
+        throw std::runtime_error("Error reading the file to hash: " + filename);
+    }
+}
+
+std::uint64_t Hasher::digest() const
+{
+    std::uint64_t word = 0;
+    std::memcpy(&word, m_pending, m_pending_size);
+    std::uint64_t state = mix(mix(m_state, word), m_length);
+
+    // final avalanche (MurmurHash3 fmix64)
+    state ^= state >> 33;
+    state *= 0xff51afd7ed558ccdull;
+    state ^= state >> 33;
+    state *= 0xc4ceb9fe1a85ec53ull;
+    state ^= state >> 33;
+    return state;
+}
+
+// One record per line, fields separated by tabs, the last field takes the rest of the line:
+//   job <inputs hash> <job arguments>
+//   output <size> <path>
+//   stats <file name> <row>
+void Manifest::load(const std::string &filename)
+{
+    m_filename = filename;
+    m_entries.clear();
+
+    std::ifstream input(filename);
+    if (!input)
+        return; // the first run
+
+    std::string line;
+    ManifestEntry *entry = nullptr;
+    int line_number = 0;
+    while (std::getline(input, line))
+    {
+        line_number++;
+        std::size_t first = line.find('\t');
+        std::size_t second = first == std::string::npos ? std::string::npos : line.find('\t', first + 1);
+        if (second == std::string::npos)
+        {
+            throw std::runtime_error(filename + ":" + std::to_string(line_number) + ": malformed manifest line");
+        }
+
+        std::string kind = line.substr(0, first);
+        std::string field = line.substr(first + 1, second - first - 1);
+        std::string rest = line.substr(second + 1);
+        if (kind == "job")
+        {
+            entry = &m_entries[rest];
+            *entry = ManifestEntry();
+            entry->inputs_hash = std::stoull(field, nullptr, 16);
+        }
+        else if (kind == "output" && entry)
+        {
+            entry->outputs.emplace_back(rest, std::stoull(field));
+        }
+        else if (kind == "stats" && entry)
+        {
+            entry->stats_rows.emplace_back(field, rest + "\n");
+        }
+        else if (kind == "over" && entry)
+        {
+            entry->pages_over_budget = std::stoull(field);
+        }
+        else
+        {
+            throw std::runtime_error(filename + ":" + std::to_string(line_number) + ": malformed manifest line");
+        }
+    }
+}
+
+void Manifest::save() const
+{
+    // written next to the old one and renamed over it, so an interrupted run leaves the old manifest intact
+    std::string temporary = m_filename + ".tmp";
+    {
+        std::ofstream output(temporary, std::ios_base::trunc);
+        if (!output)
+        {
+            throw std::runtime_error("Cannot write the manifest: " + temporary);
+        }
+
+        for (const auto &[job, entry] : m_entries)
+        {
+            output << "job\t" << to_hex(entry.inputs_hash) << '\t' << job << '\n';
+            for (const auto &[path, size] : entry.outputs)
+                output << "output\t" << size << '\t' << path << '\n';
+            for (const auto &[filename, row] : entry.stats_rows)
+                output << "stats\t" << filename << '\t' << row.substr(0, row.find('\n')) << '\n';
+            if (entry.pages_over_budget)
+                output << "over\t" << entry.pages_over_budget << "\t\n";
+        }
+        if (!output.flush())
+        {
+            throw std::runtime_error("Cannot write the manifest: " + temporary);
+        }
+    }
+    std::filesystem::rename(temporary, m_filename);
+}
+
+const ManifestEntry *Manifest::find(const std::string &job, std::uint64_t inputs_hash) const
+{
+    auto found = m_entries.find(job);
+    if (found == m_entries.end() || found->second.inputs_hash != inputs_hash)
+        return nullptr;
+
+    for (const auto &[path, size] : found->second.outputs)
+    {
+        std::error_code error;
+        if (std::filesystem::file_size(path, error) != size || error)
+            return nullptr;
+    }
+    return &found->second;
+}
+
+const ManifestEntry *Manifest::get(const std::string &job) const
+{
+    auto found = m_entries.find(job);
+    return found == m_entries.end() ? nullptr : &found->second;
+}
+
+void Manifest::record(const std::string &job, ManifestEntry entry)
+{
+    m_entries[job] = std::move(entry);
+}
+
+void Manifest::erase(const std::string &job)
+{
+    m_entries.erase(job);
+}
+
+std::uint64_t Manifest::binary_hash()
+{
+    Hasher hasher;
+    try
+    {
+        hasher.add_file("/proc/self/exe");
+    }
+    catch (const std::exception &)
+    {
+        hasher.add(std::string(__DATE__ " " __TIME__)); // no procfs, fall back to when this file was built
+    }
+    return hasher.digest();
+}
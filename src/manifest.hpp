@@ -0,0 +1,70 @@
+//
+//
+// Copyright the mso-test contributors
+//
+// SPDX-License-Identifier: MPL-2.0
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#ifndef MANIFEST_HPP
+#define MANIFEST_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+// 64-bit hash of a stream of bytes, for telling whether a job's inputs have changed (not cryptographic)
+class Hasher
+{
+public:
+    Hasher() = default;
+    explicit Hasher(std::uint64_t seed) : m_state(seed) {} // a differently seeded hash of the same bytes
+    void add(const void *data, std::size_t size);
+    void add(const std::string &value); // length prefixed, so consecutive strings cannot run into each other
+    void add_file(const std::string &filename);
+    std::uint64_t digest() const;
+
+private:
+    std::uint64_t m_state = 0x9e3779b97f4a7c15ull;
+    std::uint64_t m_length = 0;
+    std::uint8_t m_pending[8] = {};
+    std::size_t m_pending_size = 0;
+};
+
+// What a job produced, enough to replay it without decoding or comparing anything
+struct ManifestEntry
+{
+    std::uint64_t inputs_hash = 0;                               // page pixels, arguments, options and binary
+    std::vector<std::pair<std::string, std::uint64_t>> outputs;  // image path and its size
+    std::vector<std::pair<std::string, std::string>> stats_rows; // statistics file name and row, in order
+    std::size_t pages_over_budget = 0;                           // diffs with more than --max-red red pixels
+};
+
+// Results of earlier runs, keyed by the job (its arguments). Loaded at the start of a run and saved
+// at the end, a job that ran again replaces its entry, a job that failed loses it and the entries of
+// other jobs are kept.
+class Manifest
+{
+public:
+    void load(const std::string &filename);
+    void save() const;
+
+    // the entry of the job if its inputs are unchanged and all its images are still there
+    const ManifestEntry *find(const std::string &job, std::uint64_t inputs_hash) const;
+    const ManifestEntry *get(const std::string &job) const; // the entry as recorded, nullptr when there is none
+    void record(const std::string &job, ManifestEntry entry);
+    void erase(const std::string &job); // a job that failed, so that no older results of it are merged or replayed
+
+    // hash of the running executable, so a rebuilt pixelbasher does not replay results of an older one
+    static std::uint64_t binary_hash();
+
+private:
+    std::string m_filename;
+    std::map<std::string, ManifestEntry> m_entries;
+};
+#endif
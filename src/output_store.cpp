@@ -0,0 +1,101 @@
+//
+//
+// Copyright the mso-test contributors
+//
+// SPDX-License-Identifier: MPL-2.0
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#include <atomic>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <stdexcept>
+
+#include <unistd.h>
+
+#include "manifest.hpp"
+#include "output_store.hpp"
+
+namespace
+{
+constexpr std::uint64_t second_seed = 0x6a09e667f3bcc909ull;
+
+// a file of the store is never written to once it has its name, so every link to it keeps its bytes
+void write_new_file(const std::string &path, const std::string &bytes)
+{
+    std::ofstream output{path, std::ios_base::binary | std::ios_base::trunc};
+    if (!output)
+    {
+        throw std::runtime_error("Cannot open/create the file to write: " + path);
+    }
+    output.write(bytes.data(), static_cast<std::streamsize>(bytes.size()));
+    if (!output.flush())
+    {
+        throw std::runtime_error("Cannot write the file: " + path);
+    }
+}
+
+// <store>/<first two hex digits>/<32 hex digits>.<extension of path>
+std::filesystem::path object_path(const std::string &store_dir, const std::string &path, const std::string &bytes)
+{
+    Hasher first;
+    Hasher second(second_seed);
+    first.add(bytes.data(), bytes.size());
+    second.add(bytes.data(), bytes.size());
+
+    char name[33];
+    std::snprintf(name, sizeof(name), "%016llx%016llx", static_cast<unsigned long long>(first.digest()),
+                  static_cast<unsigned long long>(second.digest()));
+    return std::filesystem::path(store_dir) / std::string(name, 2) / (name + std::filesystem::path(path).extension().string());
+}
+} // namespace
+
+void write_output_file(const std::string &path, const std::string &bytes)
+{
+    std::error_code error;
+    if (std::filesystem::hard_link_count(path, error) > 1 && !error) // hard_link_count() is -1 on an error
+        std::filesystem::remove(path);
+    write_new_file(path, bytes);
+}
+
+std::ofstream open_output_file(const std::string &path)
+{
+    std::error_code error;
+    if (std::filesystem::hard_link_count(path, error) > 1 && !error)
+        std::filesystem::remove(path);
+    std::ofstream output{path, std::ios_base::binary | std::ios_base::trunc};
+    if (!output)
+    {
+        throw std::runtime_error("Cannot open/create the file to write: " + path);
+    }
+    return output;
+}
+
+void store_output_file(const std::string &store_dir, const std::string &path, const std::string &bytes)
+{
+    static std::atomic<unsigned> temporary_count{0};
+
+    const std::filesystem::path object = object_path(store_dir, path, bytes);
+    std::error_code error;
+    if (!std::filesystem::exists(object, error))
+    {
+        // written under a name of its own and then linked, not renamed, to its name: no process ever links to
+        // half an image, and when another thread or process stored the same bytes first its file is kept
+        std::filesystem::create_directories(object.parent_path());
+        std::string temporary = object.string() + ".tmp." + std::to_string(::getpid()) + "." + std::to_string(temporary_count++);
+        write_new_file(temporary, bytes);
+        std::filesystem::create_hard_link(temporary, object, error);
+        if (error && !std::filesystem::exists(object))
+            std::filesystem::rename(temporary, object); // a file system without hard links
+        else
+            std::filesystem::remove(temporary);
+    }
+
+    std::filesystem::remove(path, error);
+    std::filesystem::create_hard_link(object, path, error);
+    if (error)
+        write_new_file(path, bytes);
+}
@@ -0,0 +1,28 @@
+//
+//
+// Copyright the mso-test contributors
+//
+// SPDX-License-Identifier: MPL-2.0
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#ifndef OUTPUT_STORE_HPP
+#define OUTPUT_STORE_HPP
+
+#include <fstream>
+#include <string>
+
+// Writes bytes to path. A path that is a hard link into an output store is replaced, never written through.
+void write_output_file(const std::string &path, const std::string &bytes);
+// The same for a file written a piece at a time, the caller checks the stream once it is written
+std::ofstream open_output_file(const std::string &path);
+
+// Content-addressed store of the written images (--store=dir): the bytes are kept once in store_dir, named by
+// their 128-bit hash, and path becomes a hard link to them. Bytes that are already in the store, from an
+// earlier page, document or run, are not written again. When the store cannot be linked to (another file
+// system), path is written as a plain file. Several threads and processes may share a store.
+void store_output_file(const std::string &store_dir, const std::string &path, const std::string &bytes);
+
+#endif
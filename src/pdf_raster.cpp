@@ -0,0 +1,122 @@
+//
+//
+// Copyright the mso-test contributors
+//
+// SPDX-License-Identifier: MPL-2.0
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#include <stdexcept>
+
+#include "pdf_raster.hpp"
+
+#ifdef HAVE_POPPLER
+
+#include <map>
+#include <memory>
+
+#include <poppler-document.h>
+#include <poppler-image.h>
+#include <poppler-page-renderer.h>
+#include <poppler-page.h>
+
+namespace
+{
+constexpr std::size_t open_documents_per_thread = 8;
+
+std::unique_ptr<poppler::document> open_document(const std::string &filename)
+{
+    std::unique_ptr<poppler::document> document(poppler::document::load_from_file(filename));
+    if (!document)
+    {
+        throw std::runtime_error("Can't open the PDF file: " + filename);
+    }
+    if (document->is_locked())
+    {
+        throw std::runtime_error("The PDF file is password protected: " + filename);
+    }
+    return document;
+}
+
+// poppler documents must not be shared between threads, so every worker opens its own
+poppler::document &cached_document(const std::string &filename)
+{
+    thread_local std::map<std::string, std::unique_ptr<poppler::document>> documents;
+    auto found = documents.find(filename);
+    if (found != documents.end())
+        return *found->second;
+
+    if (documents.size() >= open_documents_per_thread)
+        documents.clear();
+    return *documents.emplace(filename, open_document(filename)).first->second;
+}
+} // namespace
+
+int pdf_page_count(const std::string &filename)
+{
+    return open_document(filename)->pages();
+}
+
+void render_pdf_page(const std::string &filename, int page_number, int dpi, BMP &bmp)
+{
+    poppler::document &document = cached_document(filename);
+    std::unique_ptr<poppler::page> page(document.create_page(page_number));
+    if (!page)
+    {
+        throw std::runtime_error("No page " + std::to_string(page_number + 1) + " in the PDF file: " + filename);
+    }
+
+    // the same as magick -density dpi -colorspace Gray -alpha remove: antialiased, on white
+    poppler::page_renderer renderer;
+    renderer.set_render_hint(poppler::page_renderer::antialiasing, true);
+    renderer.set_render_hint(poppler::page_renderer::text_antialiasing, true);
+    renderer.set_paper_color(0xffffffff);
+    renderer.set_image_format(poppler::image::format_gray8);
+
+    poppler::image image = renderer.render_page(page.get(), dpi, dpi);
+    if (!image.is_valid())
+    {
+        throw std::runtime_error("Can't render page " + std::to_string(page_number + 1) + " of the PDF file: " + filename);
+    }
+
+    // poppler's rows run top down, a BMP's bottom up
+    const int width = image.width();
+    const int height = image.height();
+    PixelBuffer data(static_cast<std::size_t>(width) * height * pixel_stride);
+    for (int y = 0; y < height; y++)
+    {
+        const std::uint8_t *gray_row = reinterpret_cast<const std::uint8_t *>(image.const_data()) + static_cast<std::size_t>(height - 1 - y) * image.bytes_per_row();
+        std::uint8_t *row = data.data() + static_cast<std::size_t>(y) * width * pixel_stride;
+        for (int x = 0; x < width; x++)
+        {
+            std::uint8_t *pixel = row + x * pixel_stride;
+            pixel[0] = pixel[1] = pixel[2] = gray_row[x];
+            pixel[3] = 255;
+        }
+    }
+    bmp = BMP(width, height, std::move(data));
+}
+
+#else
+
+namespace
+{
+[[noreturn]] void no_pdf_support()
+{
+    throw std::runtime_error("pixelbasher was built without PDF support, rebuild it with make POPPLER=1");
+}
+} // namespace
+
+int pdf_page_count(const std::string &)
+{
+    no_pdf_support();
+}
+
+void render_pdf_page(const std::string &, int, int, BMP &)
+{
+    no_pdf_support();
+}
+
+#endif
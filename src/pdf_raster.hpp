@@ -0,0 +1,26 @@
+//
+//
+// Copyright the mso-test contributors
+//
+// SPDX-License-Identifier: MPL-2.0
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#ifndef PDF_RASTER_HPP
+#define PDF_RASTER_HPP
+
+#include <string>
+
+#include "bmp.hpp"
+
+// Renders PDF pages in process with poppler-cpp, instead of converting them to BMP files first. Only
+// available when built with `make POPPLER=1`, otherwise these throw.
+
+int pdf_page_count(const std::string &filename);
+
+// Renders page (from 0) in gray at dpi into bmp, as if the page had been converted and read from a BMP.
+// Each thread keeps the last few documents it rendered from open.
+void render_pdf_page(const std::string &filename, int page, int dpi, BMP &bmp);
+#endif
@@ -0,0 +1,352 @@
+//
+//
+// Copyright the mso-test contributors
+//
+// SPDX-License-Identifier: MPL-2.0
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#ifndef PIPELINE_HPP
+#define PIPELINE_HPP
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+// Bounded multi-producer multi-consumer queue (Vyukov). Lock-free, the capacity is rounded up to a power of two.
+template <typename T>
+class BoundedQueue
+{
+public:
+    explicit BoundedQueue(std::size_t capacity)
+    {
+        std::size_t size = 2;
+        while (size < capacity)
+            size <<= 1;
+        m_cells = std::vector<Cell>(size);
+        m_mask = size - 1;
+        for (std::size_t i = 0; i < size; i++)
+            m_cells[i].sequence.store(i, std::memory_order_relaxed);
+    }
+
+    bool try_push(T value)
+    {
+        std::size_t position = m_enqueue.load(std::memory_order_relaxed);
+        for (;;)
+        {
+            Cell &cell = m_cells[position & m_mask];
+            std::size_t sequence = cell.sequence.load(std::memory_order_acquire);
+            std::intptr_t difference = static_cast<std::intptr_t>(sequence) - static_cast<std::intptr_t>(position);
+            if (difference == 0)
+            {
+                if (m_enqueue.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+                {
+                    cell.value = std::move(value);
+                    cell.sequence.store(position + 1, std::memory_order_release);
+                    return true;
+                }
+            }
+            else if (difference < 0)
+            {
+                return false; // full
+            }
+            else
+            {
+                position = m_enqueue.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    bool try_pop(T &value)
+    {
+        std::size_t position = m_dequeue.load(std::memory_order_relaxed);
+        for (;;)
+        {
+            Cell &cell = m_cells[position & m_mask];
+            std::size_t sequence = cell.sequence.load(std::memory_order_acquire);
+            std::intptr_t difference = static_cast<std::intptr_t>(sequence) - static_cast<std::intptr_t>(position + 1);
+            if (difference == 0)
+            {
+                if (m_dequeue.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+                {
+                    value = std::move(cell.value);
+                    cell.sequence.store(position + m_mask + 1, std::memory_order_release);
+                    return true;
+                }
+            }
+            else if (difference < 0)
+            {
+                return false; // empty
+            }
+            else
+            {
+                position = m_dequeue.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+private:
+    struct Cell
+    {
+        std::atomic<std::size_t> sequence{0};
+        T value{};
+    };
+
+    std::vector<Cell> m_cells;
+    std::size_t m_mask = 0;
+    alignas(64) std::atomic<std::size_t> m_enqueue{0};
+    alignas(64) std::atomic<std::size_t> m_dequeue{0};
+};
+
+// Bounded work-stealing deque (Chase-Lev). The owning worker pushes and pops at the bottom,
+// any other worker may steal from the top.
+template <typename T>
+class WorkStealingDeque
+{
+public:
+    explicit WorkStealingDeque(std::size_t capacity)
+    {
+        std::size_t size = 2;
+        while (size < capacity)
+            size <<= 1;
+        m_items = std::vector<std::atomic<T *>>(size);
+        m_mask = size - 1;
+    }
+
+    // owner only
+    bool push(T *item)
+    {
+        std::int64_t bottom = m_bottom.load(std::memory_order_relaxed);
+        std::int64_t top = m_top.load(std::memory_order_acquire);
+        if (bottom - top > static_cast<std::int64_t>(m_mask))
+            return false;
+
+        m_items[bottom & m_mask].store(item, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        m_bottom.store(bottom + 1, std::memory_order_relaxed);
+        return true;
+    }
+
+    // owner only
+    T *pop()
+    {
+        std::int64_t bottom = m_bottom.load(std::memory_order_relaxed) - 1;
+        m_bottom.store(bottom, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        std::int64_t top = m_top.load(std::memory_order_relaxed);
+
+        if (top > bottom)
+        {
+            m_bottom.store(bottom + 1, std::memory_order_relaxed);
+            return nullptr;
+        }
+
+        T *item = m_items[bottom & m_mask].load(std::memory_order_relaxed);
+        if (top == bottom)
+        {
+            // last item, race any thief for it
+            if (!m_top.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+                item = nullptr;
+            m_bottom.store(bottom + 1, std::memory_order_relaxed);
+        }
+        return item;
+    }
+
+    T *steal()
+    {
+        std::int64_t top = m_top.load(std::memory_order_acquire);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        std::int64_t bottom = m_bottom.load(std::memory_order_acquire);
+        if (top >= bottom)
+            return nullptr;
+
+        T *item = m_items[top & m_mask].load(std::memory_order_relaxed);
+        if (!m_top.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+            return nullptr;
+        return item;
+    }
+
+private:
+    std::vector<std::atomic<T *>> m_items;
+    std::size_t m_mask = 0;
+    alignas(64) std::atomic<std::int64_t> m_top{0};
+    alignas(64) std::atomic<std::int64_t> m_bottom{0};
+};
+
+// Runs items through a fixed sequence of stages on a pool of workers.
+//
+// At most max_in_flight items exist at once: they are recycled through a free queue, and a new item is
+// only taken from the source when one is free, which keeps memory bounded however long the input is.
+// A worker carries on with the item it just advanced (so its data is still in cache) and, when it has
+// nothing of its own, steals from the other workers before admitting new work. Different items are in
+// different stages at the same time, so decoding and writing overlap with the comparisons.
+template <typename Item>
+class Pipeline
+{
+public:
+    using Source = std::function<bool(Item &)>; // fills the next item, false once the input is exhausted
+    using Stage = std::function<void(Item &)>;
+    using Finish = std::function<void(Item &, std::exception_ptr)>; // called once per item, with the error if a stage threw
+
+    Pipeline(std::vector<Stage> stages, Finish finish, unsigned threads, std::size_t max_in_flight)
+        : m_stages(std::move(stages)), m_finish(std::move(finish)), m_threads(threads == 0 ? 1 : threads),
+          m_free(max_in_flight == 0 ? 1 : max_in_flight)
+    {
+        std::size_t slots = max_in_flight == 0 ? 1 : max_in_flight;
+        for (std::size_t i = 0; i < slots; i++)
+        {
+            m_slots.push_back(std::make_unique<Slot>());
+            m_free.try_push(m_slots.back().get());
+        }
+    }
+
+    void run(Source source)
+    {
+        m_source = std::move(source);
+        m_source_done = false;
+        m_in_flight = 0;
+
+        for (unsigned i = 0; i < m_threads; i++)
+            m_deques.push_back(std::make_unique<WorkStealingDeque<Slot>>(m_slots.size()));
+
+        std::vector<std::thread> workers;
+        for (unsigned i = 1; i < m_threads; i++)
+            workers.emplace_back(&Pipeline::work, this, i);
+        work(0);
+
+        for (auto &worker : workers)
+            worker.join();
+        m_deques.clear();
+    }
+
+private:
+    struct Slot
+    {
+        Item item;
+        std::size_t stage = 0;
+        std::exception_ptr error;
+    };
+
+    Slot *steal(unsigned self)
+    {
+        for (unsigned i = 1; i < m_threads; i++)
+        {
+            if (Slot *slot = m_deques[(self + i) % m_threads]->steal())
+                return slot;
+        }
+        return nullptr;
+    }
+
+    Slot *admit()
+    {
+        if (m_source_done)
+            return nullptr;
+
+        std::unique_lock<std::mutex> lock(m_source_mutex, std::try_to_lock);
+        if (!lock.owns_lock() || m_source_done)
+            return nullptr;
+
+        Slot *slot = nullptr;
+        if (!m_free.try_pop(slot))
+            return nullptr; // every slot is in flight, back pressure
+
+        slot->stage = 0;
+        slot->error = nullptr;
+        bool more = false;
+        try
+        {
+            more = m_source(slot->item);
+        }
+        catch (...)
+        {
+            slot->error = std::current_exception();
+            more = true;
+            m_source_done = true; // an unreadable input list ends the run, the item still gets finished
+        }
+
+        if (!more)
+        {
+            m_free.try_push(slot);
+            m_source_done = true;
+            return nullptr;
+        }
+        m_in_flight++;
+        return slot;
+    }
+
+    void work(unsigned self)
+    {
+        WorkStealingDeque<Slot> &own = *m_deques[self];
+        int idle_rounds = 0;
+
+        for (;;)
+        {
+            Slot *slot = own.pop();
+            if (!slot)
+                slot = steal(self);
+            if (!slot)
+                slot = admit();
+
+            if (!slot)
+            {
+                if (m_source_done && m_in_flight == 0)
+                    return;
+                if (++idle_rounds < 64)
+                    std::this_thread::yield();
+                else
+                    std::this_thread::sleep_for(std::chrono::microseconds(200));
+                continue;
+            }
+            idle_rounds = 0;
+
+            if (!slot->error)
+            {
+                try
+                {
+                    m_stages[slot->stage](slot->item);
+                }
+                catch (...)
+                {
+                    slot->error = std::current_exception();
+                }
+            }
+            slot->stage++;
+
+            if (slot->error || slot->stage == m_stages.size())
+            {
+                m_finish(slot->item, slot->error);
+                m_free.try_push(slot);
+                m_in_flight--;
+            }
+            else if (!own.push(slot))
+            {
+                // cannot happen, the deque holds every slot
+                throw std::logic_error("pipeline deque overflow");
+            }
+        }
+    }
+
+    std::vector<Stage> m_stages;
+    Finish m_finish;
+    unsigned m_threads;
+
+    std::vector<std::unique_ptr<Slot>> m_slots;
+    BoundedQueue<Slot *> m_free;
+    std::vector<std::unique_ptr<WorkStealingDeque<Slot>>> m_deques;
+
+    Source m_source;
+    std::mutex m_source_mutex;
+    std::atomic<bool> m_source_done{false};
+    std::atomic<std::size_t> m_in_flight{0};
+};
+#endif
@@ -17,7 +17,6 @@
 #include <vector>
 
 #include "bmp.hpp"
-using PixelValues = std::array<std::uint8_t, pixel_stride>;
 struct Pixel
 {
     std::uint8_t blue{0};
@@ -11,86 +11,141 @@
 #include <algorithm>
 #include <cassert>
 #include <cmath>
+#include <cstring>
+#include <initializer_list>
+#include <type_traits>
 
+#include "kernels.hpp"
 #include "pixel.hpp"
 #include "pixelbasher.hpp"
 
-BMP PixelBasher::compare_bmps(const BMP &original, const BMP &target, bool enable_minor_differences)
+namespace
 {
-    int min_width = std::min(original.get_width(), target.get_width());
-    int min_height = std::min(original.get_height(), target.get_height());
-
-    BMP diff(original);
-
-    std::vector<bool> intersection_mask = get_intersection_mask(original, target, min_width, min_height);
-    std::vector<bool> original_filtered_vertical_edges = original.get_vertical_edge_mask();
-    std::vector<bool> target_filtered_vertical_edges = target.get_vertical_edge_mask();
-
-    // The diff data is based on the base image, so we create a new data vector to hold the modified pixels
-    auto &original_data = original.get_data();
-    auto &target_data = target.get_data();
-    std::vector<std::uint8_t> diff_data = original.get_data();
+// the values double as the RegionLabeler pixel classes
+enum class PixelClass : std::uint8_t
+{
+    UNCHANGED = RegionLabeler::NONE,
+    DIFFERENT = RegionLabeler::RED,        // red
+    MINOR = RegionLabeler::MINOR,          // yellow, only reported with minor_differences
+    VERTICAL_EDGE = RegionLabeler::VERTICAL_EDGE // dark yellow
+};
+
+// The thresholds of Config for the kernels, page_edge_allowance is edge_allowance unless the background is black
+template <CompareConfig Config>
+ClassifyParameters classify_parameters(int background_value)
+{
+    ClassifyParameters parameters;
+    parameters.threshold = Config.threshold;
+    parameters.noise_distance = Config.noise_distance;
+    parameters.noise_allowance = Config.noise_allowance;
+    parameters.page_edge_allowance = background_value != 0 ? Config.edge_allowance : 0;
+    parameters.background_value = background_value;
+    parameters.minor_differences = Config.minor_differences;
+    return parameters;
+}
 
-    int original_width = original.get_width();
-    int target_width = target.get_width();
-    // Loops through the min width and height, if size of images differ slightly.
-    for (int y = 0; y < min_height; y++)
+// skips unchanged pixels (most of a page) 8 classes at a time, from x to the first 8 with a change or the last few
+inline int skip_unchanged(const std::uint8_t *classes, int x, int last)
+{
+    std::uint64_t word;
+    while (x + 7 <= last)
     {
-        for (int x = 0; x < min_width; x++)
-        {
-            // The intersection mask is based on height and width not stride, so we calculate it separately
-            int original_index = (y * original_width + x) * pixel_stride;
-            int target_index = (y * target_width + x) * pixel_stride;
-            int mask_index = y * min_width + x;
+        std::memcpy(&word, classes + x, sizeof(word));
+        if (word != 0)
+            break;
+        x += 8;
+    }
+    return x;
+}
 
-            const std::uint8_t *original_row = &original_data[original_index];
-            const std::uint8_t *target_row = &target_data[target_index];
+inline void store_pixel(std::uint8_t *destination, const PixelValues &bgra)
+{
+    std::memcpy(destination, bgra.data(), pixel_stride);
+}
 
-            PixelValues original_pixel = Pixel::get_bgra(original_row);
-            PixelValues target_pixel = Pixel::get_bgra(target_row);
+// Columns first to last of row y of the edge masks of a pair of pages, whose masks are both indexed over the
+// overlapping width, not the width of either page
+void build_edge_mask_row(const EdgeMaskRows &original, const EdgeMaskRows &target, int y, int first, int last, int width, EdgeMasks &masks)
+{
+    const std::uint8_t *original_edges = original.blurred + static_cast<std::size_t>(y % original.window) * width;
+    const std::uint8_t *target_edges = target.blurred + static_cast<std::size_t>(y % target.window) * width;
+    const std::uint8_t *original_vertical = original.vertical + static_cast<std::size_t>(y % original.window) * width;
+    const std::uint8_t *target_vertical = target.vertical + static_cast<std::size_t>(y % target.window) * width;
+    std::uint8_t *near_edge = masks.near_edge.data();
+    std::uint8_t *vertical_edge = masks.vertical_edge.data();
+    for (int x = first; x <= last; x++)
+    {
+        near_edge[x] = original_edges[x] & target_edges[x];
+        vertical_edge[x] = original_vertical[x] | target_vertical[x];
+    }
+}
 
-            bool near_edge = intersection_mask[mask_index];
-            bool vertical_edge = false;
+// Classifies the pixels of row y of a target within its overlap with the base (target_width x target_height),
+// the rest of the span is unchanged. The edge masks of the row are built first, while the row is in cache.
+void classify_target_row(const Kernels &k, const ClassifyParameters &parameters, int y, const RowSpan &span, const BMP &original,
+                         const EdgeMaskRows &original_masks, const BMP &target, const EdgeMaskRows &target_masks, int target_width,
+                         int target_height, EdgeMasks &masks, std::uint8_t *classes)
+{
+    if (span.empty())
+        return;
+    const int last = y < target_height ? std::min(span.last, target_width - 1) : span.first - 1;
+    if (last >= span.first)
+    {
+        build_edge_mask_row(original_masks, target_masks, y, span.first, last, target_width, masks);
+        const std::uint8_t *original_row = original.get_data().data() + static_cast<std::size_t>(y) * original.get_width() * pixel_stride;
+        const std::uint8_t *target_row = target.get_data().data() + static_cast<std::size_t>(y) * target.get_width() * pixel_stride;
+        k.classify_row(original_row, target_row, masks.near_edge.data(), masks.vertical_edge.data(), span.first, last, parameters, classes);
+    }
+    if (last < span.last)
+        std::fill(classes + std::max(last + 1, span.first), classes + span.last + 1, RegionLabeler::NONE);
+}
+} // namespace
 
-            if (original_filtered_vertical_edges[mask_index] || target_filtered_vertical_edges[mask_index])
-            {
-                vertical_edge = true;
-            }
+BMP PixelBasher::compare_bmps(const BMP &original, const BMP &target, bool enable_minor_differences)
+{
+    BMP diff;
+    CompareWorkspace workspace;
+    compare_bmps(original, target, enable_minor_differences, diff, workspace);
+    return diff;
+}
 
-            PixelValues bgra = compare_pixels(original_pixel, target_pixel, diff, near_edge, vertical_edge, enable_minor_differences);
+void PixelBasher::compare_bmps(const BMP &original, const BMP &target, bool enable_minor_differences, BMP &diff, CompareWorkspace &workspace)
+{
+    PageComparison comparison;
+    comparison.begin(original, target, enable_minor_differences, diff, workspace);
+    comparison.compare_all_rows();
+    comparison.finish();
+}
 
-            for (int i = 0; i < pixel_stride; i++)
-            {
-                diff_data[original_index + i] = bgra[i];
-            }
-        }
-    }
-    diff.set_data(diff_data);
+BMP PixelBasher::compare_regressions(const BMP &original, const BMP &current, const BMP &previous)
+{
+    BMP diff;
+    compare_regressions(original, current, previous, diff);
     return diff;
 }
 
-BMP PixelBasher::compare_regressions(const BMP &original, const BMP &current, BMP &previous)
+void PixelBasher::compare_regressions(const BMP &original, const BMP &current, const BMP &previous, BMP &diff)
 {
     std::int32_t min_width = std::min(original.get_width(), current.get_width());
     std::int32_t min_height = std::min(original.get_height(), current.get_height());
 
-    BMP diff(original);
+    // The diff data is based on the base image, the compared pixels are overwritten in place
+    diff.assign_pixels(original);
 
-    // The diff data is based on the base image, so we create a new data vector to hold the modified pixels
-    std::vector<std::uint8_t> diff_data = original.get_data();
+    auto &diff_data = diff.get_mutable_data();
     auto &current_data = current.get_data();
     auto &previous_data = previous.get_data();
 
-    std::int32_t original_width = original.get_width();
-    std::int32_t current_width = current.get_width();
-    std::int32_t previous_width = previous.get_width();
+    const std::size_t original_width = original.get_width();
+    const std::size_t current_width = current.get_width();
+    const std::size_t previous_width = previous.get_width();
     for (int y = 0; y < min_height; y++)
     {
         for (int x = 0; x < min_width; x++)
         {
-            int original_index = (y * original_width + x) * pixel_stride;
-            int current_index = (y * current_width + x) * pixel_stride;
-            int previous_index = (y * previous_width + x) * pixel_stride;
+            std::size_t original_index = (y * original_width + x) * pixel_stride;
+            std::size_t current_index = (y * current_width + x) * pixel_stride;
+            std::size_t previous_index = (y * previous_width + x) * pixel_stride;
 
             const std::uint8_t *original_row = &diff_data[original_index];
             const std::uint8_t *current_row = &current_data[current_index];
@@ -108,50 +163,36 @@ BMP PixelBasher::compare_regressions(const BMP &original, const BMP &current, BM
             }
         }
     }
-    diff.set_data(diff_data);
-    return diff;
 }
 
-std::vector<bool> PixelBasher::get_intersection_mask(const BMP &original, const BMP &target, int width, int height)
+RegressionCounts PixelBasher::compare_three_way(const BMP &original, const BMP &current, const BMP &previous, bool enable_minor_differences,
+                                                BMP &current_diff, BMP &previous_diff, BMP &regressions, CompareWorkspace &workspace)
 {
-
-    std::vector<bool> original_edge_map = original.get_blurred_edge_mask();
-    std::vector<bool> target_edge_map = target.get_blurred_edge_mask();
-
-    std::vector<bool> intersection_mask(width * height, false);
-    for (int i = 0; i < width * height; i++)
-    {
-        intersection_mask[i] = original_edge_map[i] && target_edge_map[i];
-    }
-    return intersection_mask;
+    PageComparison comparison;
+    comparison.begin(original, current, previous, enable_minor_differences, current_diff, previous_diff, regressions, workspace);
+    comparison.compare_all_rows();
+    comparison.finish();
+    return comparison.get_regressions();
 }
 
-PixelValues PixelBasher::compare_pixels(PixelValues original, PixelValues target, BMP &diff, bool near_edge, bool vertical_edge, bool minor_differences)
+DiffCounts PixelBasher::count_differences(const BMP &original, const BMP &target, bool enable_minor_differences, CompareWorkspace &workspace,
+                                          int max_red)
 {
-    const bool differs = Pixel::differs_from(original, target, near_edge, diff.get_background_value());
-
-    if (!differs)
-    {
-        if (minor_differences && near_edge && Pixel::differs_from(original, target, diff.get_background_value(), false))
-        {
-            diff.increment_red_count(1);
-            return colour_pixel(Colour::YELLOW);
-        }
-        return original;
-    }
-
-    if (vertical_edge)
-    {
-        diff.increment_yellow_count(1);
-        return colour_pixel(Colour::DARK_YELLOW);
-    }
-
-    if (near_edge) {
-        return original;
-    }
+    PageComparison comparison;
+    comparison.begin_counting(original, target, nullptr, enable_minor_differences, workspace, max_red);
+    comparison.compare_all_rows();
+    comparison.finish();
+    return comparison.get_counts().current;
+}
 
-    diff.increment_red_count(1);
-    return colour_pixel(Colour::RED);
+ThreeWayCounts PixelBasher::count_three_way(const BMP &original, const BMP &current, const BMP &previous, bool enable_minor_differences,
+                                            CompareWorkspace &workspace, int max_red)
+{
+    PageComparison comparison;
+    comparison.begin_counting(original, current, &previous, enable_minor_differences, workspace, max_red);
+    comparison.compare_all_rows();
+    comparison.finish();
+    return comparison.get_counts();
 }
 
 PixelValues PixelBasher::compare_pixel_regression(PixelValues original, PixelValues current, PixelValues previous)
@@ -174,6 +215,12 @@ PixelValues PixelBasher::compare_pixel_regression(PixelValues original, PixelVal
     return original;
 }
 
+std::vector<PixelValues> PixelBasher::diff_colours()
+{
+    return {colour_pixel(Colour::RED), colour_pixel(Colour::YELLOW), colour_pixel(Colour::DARK_YELLOW),
+            colour_pixel(Colour::BLUE), colour_pixel(Colour::GREEN)};
+}
+
 PixelValues PixelBasher::colour_pixel(Colour colour)
 {
     switch (colour)
@@ -190,4 +237,439 @@ PixelValues PixelBasher::colour_pixel(Colour colour)
         return {0, 255, 0, 255};
     }
     assert(false);
-}
\ No newline at end of file
+}
+
+// The pages and their overlaps; where in them the pages can differ is worked out a row at a time, see area_row()
+void PageComparison::begin_pages(const BMP &original, const BMP &current, const BMP *previous, CompareWorkspace &workspace)
+{
+    m_pages[0] = &original;
+    m_pages[1] = &current;
+    m_pages[2] = previous;
+    for (int index = 0; index < 3; index++)
+    {
+        if (m_pages[index])
+            m_masks[index] = EdgeMaskRows::of(*m_pages[index]);
+        m_diffs[index] = nullptr;
+    }
+    m_workspace = &workspace;
+
+    m_current_width = std::min(original.get_width(), current.get_width());
+    m_current_height = std::min(original.get_height(), current.get_height());
+    m_width = m_current_width;
+    m_rows = m_current_height;
+    if (previous)
+    {
+        m_previous_width = std::min(original.get_width(), previous->get_width());
+        m_previous_height = std::min(original.get_height(), previous->get_height());
+        m_width = original.get_width();
+        m_rows = original.get_height();
+    }
+
+    // Outside its content a page has its margin pixel, so where no page has content each has its margin there,
+    // and margins of the same gray compare as unchanged. A red base margin would still show in the regression
+    // map, so it is compared in full.
+    m_trim = !Pixel::is_red(original.get_margin_pixel()) && current.get_margin_pixel()[0] == original.get_margin_pixel()[0] &&
+             (!previous || previous->get_margin_pixel()[0] == original.get_margin_pixel()[0]);
+    workspace.area_rows.resize(m_rows);
+    workspace.region_span = RowSpan();
+    workspace.current.resize(m_current_width);
+    if (previous)
+        workspace.previous.resize(m_previous_width);
+
+    m_next_row = 0;
+    m_max_red = PixelBasher::no_red_budget;
+    m_stop_row = -1;
+    m_counts = ThreeWayCounts();
+}
+
+void PageComparison::begin(const BMP &original, const BMP &target, bool enable_minor_differences, BMP &diff, CompareWorkspace &workspace)
+{
+    begin_pages(original, target, nullptr, workspace);
+
+    // The diff data is based on the base image, only the pixels that differ are overwritten
+    diff.assign_headers(original);
+    m_diffs[0] = &diff;
+
+    const bool find_regions = workspace.max_regions > 0;
+    if (find_regions)
+        workspace.current_regions.begin(m_width);
+    else
+        workspace.current_classes.resize(m_width);
+
+    if (enable_minor_differences)
+        m_compare = find_regions ? &PageComparison::compare_two_way<minor_differences_compare_config, true>
+                                 : &PageComparison::compare_two_way<minor_differences_compare_config, false>;
+    else
+        m_compare = find_regions ? &PageComparison::compare_two_way<default_compare_config, true>
+                                 : &PageComparison::compare_two_way<default_compare_config, false>;
+}
+
+void PageComparison::begin(const BMP &original, const BMP &current, const BMP &previous, bool enable_minor_differences, BMP &current_diff,
+                           BMP &previous_diff, BMP &regressions, CompareWorkspace &workspace)
+{
+    begin_pages(original, current, &previous, workspace);
+
+    // each target is compared over its own overlap with the base, the rest of the diff stays the base image
+    current_diff.assign_headers(original);
+    previous_diff.assign_headers(original);
+    regressions.assign_headers(original);
+    m_diffs[0] = &current_diff;
+    m_diffs[1] = &previous_diff;
+    m_diffs[2] = &regressions;
+
+    const bool find_regions = workspace.max_regions > 0;
+    if (find_regions)
+    {
+        workspace.current_regions.begin(m_width);
+        workspace.previous_regions.begin(m_width);
+    }
+    else
+    {
+        workspace.current_classes.resize(m_width);
+        workspace.previous_classes.resize(m_width);
+    }
+
+    if (enable_minor_differences)
+        m_compare = find_regions ? &PageComparison::compare_three_way<minor_differences_compare_config, true>
+                                 : &PageComparison::compare_three_way<minor_differences_compare_config, false>;
+    else
+        m_compare = find_regions ? &PageComparison::compare_three_way<default_compare_config, true>
+                                 : &PageComparison::compare_three_way<default_compare_config, false>;
+}
+
+void PageComparison::begin_counting(const BMP &original, const BMP &current, const BMP *previous, bool enable_minor_differences,
+                                    CompareWorkspace &workspace, int max_red)
+{
+    // the same areas and masks as the drawn diffs
+    begin_pages(original, current, previous, workspace);
+    m_max_red = max_red;
+
+    workspace.current_classes.resize(m_width);
+    if (previous)
+    {
+        workspace.previous_classes.resize(m_width);
+        m_compare = enable_minor_differences ? &PageComparison::count_three_way<minor_differences_compare_config>
+                                             : &PageComparison::count_three_way<default_compare_config>;
+    }
+    else
+    {
+        m_compare = enable_minor_differences ? &PageComparison::count_two_way<minor_differences_compare_config>
+                                             : &PageComparison::count_two_way<default_compare_config>;
+    }
+}
+
+void PageComparison::compare_rows(int end)
+{
+    end = std::min(end, m_rows);
+    if (done() || end <= m_next_row)
+        return;
+
+    for (int y = m_next_row; y < end; y++)
+        m_workspace->area_rows[y] = area_row(y);
+    // the differences are drawn over a copy of the base, made a strip at a time while it is in cache
+    for (BMP *diff : m_diffs)
+    {
+        if (diff)
+            diff->copy_rows(*m_pages[0], m_next_row, end);
+    }
+    (this->*m_compare)(m_next_row, end);
+    m_next_row = end;
+}
+
+void PageComparison::finish()
+{
+    CompareWorkspace &workspace = *m_workspace;
+    for (BMP *diff : m_diffs)
+    {
+        if (diff)
+            diff->copy_rows(*m_pages[0], m_rows, m_pages[0]->get_height()); // above the overlap of a single target
+    }
+
+    if (m_diffs[0] && workspace.max_regions > 0)
+    {
+        m_diffs[0]->set_region_count(workspace.current_regions.finish(m_diffs[0]->get_mutable_regions(), workspace.max_regions));
+        if (m_pages[2])
+            m_diffs[1]->set_region_count(workspace.previous_regions.finish(m_diffs[1]->get_mutable_regions(), workspace.max_regions));
+    }
+
+    // counts that stopped at the budget are lower bounds when rows where the pages can differ were left
+    if (m_stop_row >= 0)
+    {
+        bool rows_left = false;
+        for (int y = m_stop_row + 1; y < m_rows && !rows_left; y++)
+            rows_left = !area_row(y).empty();
+        m_counts.current.partial = rows_left;
+        if (m_pages[2])
+            m_counts.previous.partial = rows_left;
+    }
+}
+
+// The columns of row y where the pages can differ, within the compared width
+RowSpan PageComparison::area_row(int y) const
+{
+    if (!m_trim)
+        return {0, m_width - 1};
+
+    RowSpan span = m_pages[0]->get_content_rows()[y];
+    for (int index = 1; index < 3 && m_pages[index]; index++)
+    {
+        if (y < m_pages[index]->get_height())
+            span = span.united(m_pages[index]->get_content_rows()[y]);
+    }
+    return span.intersected(0, m_width - 1);
+}
+
+template <CompareConfig Config, bool FindRegions>
+void PageComparison::compare_two_way(int first, int end)
+{
+    CompareWorkspace &workspace = *m_workspace;
+    const BMP &original = *m_pages[0];
+    const BMP &target = *m_pages[1];
+    BMP &diff = *m_diffs[0];
+    std::uint8_t *diff_data = diff.get_mutable_data().data();
+
+    const PixelValues red = PixelBasher::colour_pixel(PixelBasher::Colour::RED);
+    const PixelValues yellow = PixelBasher::colour_pixel(PixelBasher::Colour::YELLOW);
+    const PixelValues dark_yellow = PixelBasher::colour_pixel(PixelBasher::Colour::DARK_YELLOW);
+
+    const Kernels &k = kernels();
+    const ClassifyParameters parameters = classify_parameters<Config>(original.get_background_value());
+    const int original_width = original.get_width();
+
+    std::int64_t red_count = 0;
+    std::int64_t yellow_count = 0;
+    // Loops through the rows of the min width and height, only the columns where the pages can differ
+    for (int y = first; y < end; y++)
+    {
+        const RowSpan span = workspace.area_rows[y];
+        std::uint8_t *diff_row = diff_data + static_cast<std::size_t>(y) * original_width * pixel_stride;
+        // with regions the classes go straight into the region row
+        std::uint8_t *class_row = FindRegions ? workspace.current_regions.row() : workspace.current_classes.data();
+        if constexpr (FindRegions)
+        {
+            if (span.empty() && workspace.region_span.empty())
+                continue; // no labels were left by the row before
+            if (!workspace.region_span.empty())
+                std::fill(class_row + workspace.region_span.first, class_row + workspace.region_span.last + 1, RegionLabeler::NONE);
+            workspace.region_span = span;
+        }
+        classify_target_row(k, parameters, y, span, original, m_masks[0], target, m_masks[1], m_current_width, m_current_height, workspace.current,
+                            class_row);
+
+        for (int x = skip_unchanged(class_row, span.first, span.last); x <= span.last; x = skip_unchanged(class_row, x + 1, span.last))
+        {
+            switch (static_cast<PixelClass>(class_row[x]))
+            {
+            case PixelClass::UNCHANGED:
+                break;
+            case PixelClass::DIFFERENT:
+                red_count++;
+                store_pixel(diff_row + x * pixel_stride, red);
+                break;
+            case PixelClass::MINOR:
+                red_count++;
+                store_pixel(diff_row + x * pixel_stride, yellow);
+                break;
+            case PixelClass::VERTICAL_EDGE:
+                yellow_count++;
+                store_pixel(diff_row + x * pixel_stride, dark_yellow);
+                break;
+            }
+        }
+
+        if constexpr (FindRegions)
+            workspace.current_regions.add_row(y);
+    }
+    diff.increment_red_count(red_count);
+    diff.increment_yellow_count(yellow_count);
+}
+
+template <CompareConfig Config, bool FindRegions>
+void PageComparison::compare_three_way(int first, int end)
+{
+    CompareWorkspace &workspace = *m_workspace;
+    const BMP &original = *m_pages[0];
+    const BMP &current = *m_pages[1];
+    const BMP &previous = *m_pages[2];
+    const int width = original.get_width();
+
+    const std::uint8_t *original_data = original.get_data().data();
+    std::uint8_t *current_diff_data = m_diffs[0]->get_mutable_data().data();
+    std::uint8_t *previous_diff_data = m_diffs[1]->get_mutable_data().data();
+    std::uint8_t *regression_data = m_diffs[2]->get_mutable_data().data();
+
+    const PixelValues colours[] = {
+        {}, // PixelClass::UNCHANGED keeps the base pixel
+        PixelBasher::colour_pixel(PixelBasher::Colour::RED),
+        PixelBasher::colour_pixel(PixelBasher::Colour::YELLOW),
+        PixelBasher::colour_pixel(PixelBasher::Colour::DARK_YELLOW)};
+
+    const Kernels &k = kernels();
+    const ClassifyParameters parameters = classify_parameters<Config>(original.get_background_value());
+
+    std::int64_t counts[2][2] = {}; // [current is red][previous is red]
+    std::int64_t current_red = 0, current_yellow = 0;
+    std::int64_t previous_red = 0, previous_yellow = 0;
+
+    // writes the pixel of a target's class to its diff
+    auto draw = [&](PixelClass pixel_class, std::uint8_t *diff_pixel, std::int64_t &red_count, std::int64_t &yellow_count)
+    {
+        switch (pixel_class)
+        {
+        case PixelClass::UNCHANGED:
+            return;
+        case PixelClass::DIFFERENT:
+        case PixelClass::MINOR: // yellow is counted as red, as compare_bmps always has
+            red_count++;
+            break;
+        case PixelClass::VERTICAL_EDGE:
+            yellow_count++;
+            break;
+        }
+        store_pixel(diff_pixel, colours[static_cast<int>(pixel_class)]);
+    };
+
+    for (int y = first; y < end; y++)
+    {
+        const RowSpan span = workspace.area_rows[y];
+        const std::size_t row_offset = static_cast<std::size_t>(y) * width * pixel_stride;
+        const std::uint8_t *original_row = original_data + row_offset;
+        std::uint8_t *current_classes = workspace.current_classes.data();
+        std::uint8_t *previous_classes = workspace.previous_classes.data();
+        if constexpr (FindRegions)
+        {
+            if (span.empty() && workspace.region_span.empty())
+                continue; // no labels were left by the row before
+            // the classes go straight into the region rows
+            current_classes = workspace.current_regions.row();
+            previous_classes = workspace.previous_regions.row();
+            if (!workspace.region_span.empty())
+            {
+                std::fill(current_classes + workspace.region_span.first, current_classes + workspace.region_span.last + 1, RegionLabeler::NONE);
+                std::fill(previous_classes + workspace.region_span.first, previous_classes + workspace.region_span.last + 1, RegionLabeler::NONE);
+            }
+            workspace.region_span = span;
+        }
+        classify_target_row(k, parameters, y, span, original, m_masks[0], current, m_masks[1], m_current_width, m_current_height,
+                            workspace.current, current_classes);
+        classify_target_row(k, parameters, y, span, original, m_masks[0], previous, m_masks[2], m_previous_width, m_previous_height,
+                            workspace.previous, previous_classes);
+
+        for (int x = span.first; x <= span.last; x++)
+        {
+            const std::uint8_t *original_pixel = original_row + x * pixel_stride;
+            const PixelClass current_class = static_cast<PixelClass>(current_classes[x]);
+            const PixelClass previous_class = static_cast<PixelClass>(previous_classes[x]);
+            draw(current_class, current_diff_data + row_offset + x * pixel_stride, current_red, current_yellow);
+            draw(previous_class, previous_diff_data + row_offset + x * pixel_stride, previous_red, previous_yellow);
+
+            // an unchanged pixel keeps the base pixel, which is red on the rare page that has pure red in it
+            const bool original_is_red = Pixel::is_red(Pixel::get_bgra(original_pixel));
+            const bool current_is_red = current_class == PixelClass::DIFFERENT || (current_class == PixelClass::UNCHANGED && original_is_red);
+            const bool previous_is_red = previous_class == PixelClass::DIFFERENT || (previous_class == PixelClass::UNCHANGED && original_is_red);
+
+            counts[current_is_red][previous_is_red]++;
+            if (current_is_red || previous_is_red)
+            {
+                PixelValues regression = PixelBasher::compare_pixel_regression(
+                    Pixel::get_bgra(original_pixel), current_is_red ? PixelBasher::colour_pixel(PixelBasher::Colour::RED) : PixelValues{},
+                    previous_is_red ? PixelBasher::colour_pixel(PixelBasher::Colour::RED) : PixelValues{});
+                store_pixel(regression_data + row_offset + x * pixel_stride, regression);
+            }
+        }
+
+        if constexpr (FindRegions)
+        {
+            workspace.current_regions.add_row(y);
+            workspace.previous_regions.add_row(y);
+        }
+    }
+
+    m_diffs[0]->increment_red_count(current_red);
+    m_diffs[0]->increment_yellow_count(current_yellow);
+    m_diffs[1]->increment_red_count(previous_red);
+    m_diffs[1]->increment_yellow_count(previous_yellow);
+    m_counts.regressions.persisting += counts[1][1];
+    m_counts.regressions.regressed += counts[1][0];
+    m_counts.regressions.fixed += counts[0][1];
+}
+
+template <CompareConfig Config>
+void PageComparison::count_two_way(int first, int end)
+{
+    CompareWorkspace &workspace = *m_workspace;
+    const Kernels &k = kernels();
+    const ClassifyParameters parameters = classify_parameters<Config>(m_pages[0]->get_background_value());
+    std::uint8_t *classes = workspace.current_classes.data();
+
+    DiffCounts &counts = m_counts.current;
+    for (int y = first; y < end; y++)
+    {
+        const RowSpan span = workspace.area_rows[y];
+        classify_target_row(k, parameters, y, span, *m_pages[0], m_masks[0], *m_pages[1], m_masks[1], m_current_width, m_current_height,
+                            workspace.current, classes);
+
+        for (int x = skip_unchanged(classes, span.first, span.last); x <= span.last; x = skip_unchanged(classes, x + 1, span.last))
+        {
+            counts.red += classes[x] == RegionLabeler::RED || classes[x] == RegionLabeler::MINOR;
+            counts.yellow += classes[x] == RegionLabeler::VERTICAL_EDGE;
+        }
+        if (counts.red > m_max_red)
+        {
+            counts.over_budget = true;
+            m_stop_row = y;
+            return;
+        }
+    }
+}
+
+template <CompareConfig Config>
+void PageComparison::count_three_way(int first, int end)
+{
+    CompareWorkspace &workspace = *m_workspace;
+    const BMP &original = *m_pages[0];
+    const int width = original.get_width();
+    const std::uint8_t *original_data = original.get_data().data();
+    const Kernels &k = kernels();
+    const ClassifyParameters parameters = classify_parameters<Config>(original.get_background_value());
+    std::uint8_t *current_classes = workspace.current_classes.data();
+    std::uint8_t *previous_classes = workspace.previous_classes.data();
+
+    ThreeWayCounts &counts = m_counts;
+    std::int64_t regressions[2][2] = {}; // [current is red][previous is red]
+    for (int y = first; y < end; y++)
+    {
+        const RowSpan span = workspace.area_rows[y];
+        const std::uint8_t *original_row = original_data + static_cast<std::size_t>(y) * width * pixel_stride;
+        classify_target_row(k, parameters, y, span, original, m_masks[0], *m_pages[1], m_masks[1], m_current_width, m_current_height,
+                            workspace.current, current_classes);
+        classify_target_row(k, parameters, y, span, original, m_masks[0], *m_pages[2], m_masks[2], m_previous_width, m_previous_height,
+                            workspace.previous, previous_classes);
+
+        // as compare_three_way draws them
+        for (int x = span.first; x <= span.last; x++)
+        {
+            const std::uint8_t current_class = current_classes[x];
+            const std::uint8_t previous_class = previous_classes[x];
+            counts.current.red += current_class == RegionLabeler::RED || current_class == RegionLabeler::MINOR;
+            counts.current.yellow += current_class == RegionLabeler::VERTICAL_EDGE;
+            counts.previous.red += previous_class == RegionLabeler::RED || previous_class == RegionLabeler::MINOR;
+            counts.previous.yellow += previous_class == RegionLabeler::VERTICAL_EDGE;
+
+            const bool original_is_red = Pixel::is_red(Pixel::get_bgra(original_row + x * pixel_stride));
+            const bool current_is_red = current_class == RegionLabeler::RED || (current_class == RegionLabeler::NONE && original_is_red);
+            const bool previous_is_red = previous_class == RegionLabeler::RED || (previous_class == RegionLabeler::NONE && original_is_red);
+            regressions[current_is_red][previous_is_red]++;
+        }
+        if (counts.current.red > m_max_red)
+        {
+            counts.current.over_budget = true;
+            m_stop_row = y;
+            break;
+        }
+    }
+
+    counts.regressions.persisting += regressions[1][1];
+    counts.regressions.regressed += regressions[1][0];
+    counts.regressions.fixed += regressions[0][1];
+}
@@ -11,12 +11,88 @@
 #ifndef PIXELBASHER_HPP
 #define PIXELBASHER_HPP
 
+#include <algorithm>
 #include <array>
 #include <cstdint>
+#include <limits>
 #include <vector>
 
 #include "bmp.hpp"
+#include "compare_config.hpp"
+#include "image_buffer.hpp"
 #include "pixel.hpp"
+#include "regions.hpp"
+
+// A row of the edge masks of a pair of pages, built just before the row is compared
+struct EdgeMasks
+{
+    Mask near_edge;     // both pages have a (blurred) edge here
+    Mask vertical_edge; // either page has a long vertical edge run here
+
+    void resize(int width) // only allocates for a page wider than any seen before
+    {
+        near_edge.resize(width);
+        vertical_edge.resize(width);
+    }
+};
+
+// The rows of a page's edge masks that a comparison reads: row y is at y % window, so they are the page's own
+// masks or the rings of the band engine (band.hpp)
+struct EdgeMaskRows
+{
+    const std::uint8_t *blurred = nullptr;
+    const std::uint8_t *vertical = nullptr;
+    int window = 1;
+
+    static EdgeMaskRows of(const BMP &page)
+    {
+        return {page.get_blurred_edge_mask().data(), page.get_vertical_edge_mask().data(), std::max(page.get_height(), 1)};
+    }
+};
+
+// Scratch buffers reused from one page comparison to the next, keep one per comparison a worker thread runs at a time
+struct CompareWorkspace
+{
+    EdgeMasks current;
+    EdgeMasks previous; // only used by the three-way compare
+
+    // set to cluster the diff pixels into regions while comparing, the largest max_regions are kept per diff
+    std::size_t max_regions = 0;
+    RegionLabeler current_regions;
+    RegionLabeler previous_regions;
+    RowSpan region_span; // of the last row given to the labellers, cleared before the next row
+
+    std::vector<RowSpan> area_rows; // the columns compared in every row, the rest of the pages is margin on both
+
+    // a row of pixel classes, when they are not written to the region rows
+    Mask current_classes;
+    Mask previous_classes;
+};
+
+// Pixel counts of a regression map
+struct RegressionCounts
+{
+    std::int64_t persisting = 0; // blue, red in both runs
+    std::int64_t regressed = 0;  // red, only red in the current run
+    std::int64_t fixed = 0;      // green, only red in the previous run
+};
+
+// The counts of a diff that was not drawn
+struct DiffCounts
+{
+    std::int64_t red = 0;     // red and yellow pixels, as the diff's get_red_count()
+    std::int64_t yellow = 0;  // dark yellow pixels, as the diff's get_yellow_count()
+    bool over_budget = false; // more than max_red red pixels, counting stopped after the row that went over
+    bool partial = false;     // counting stopped at the budget (of the current target), red and yellow are lower bounds
+};
+
+// The counts of compare_three_way without its images
+struct ThreeWayCounts
+{
+    DiffCounts current;
+    DiffCounts previous;
+    RegressionCounts regressions;
+};
 
 // PixelBasher class to handle the comparison of BMP images and generate diff images
 class PixelBasher
@@ -32,12 +108,100 @@ public:
     };
     // Compares two BMP images and generates a diff image based on the differences (the diff is applied to the base image)
     static BMP compare_bmps(const BMP &original, const BMP &target, bool enable_minor_differences);
-    static BMP compare_regressions(const BMP &original, const BMP &current, BMP &previous);
+    static BMP compare_regressions(const BMP &original, const BMP &current, const BMP &previous);
+
+    // Same as above, but the result is written into diff and the workspace buffers are reused,
+    // so once diff and workspace have grown to the page size no further allocation happens
+    static void compare_bmps(const BMP &original, const BMP &target, bool enable_minor_differences, BMP &diff, CompareWorkspace &workspace);
+    static void compare_regressions(const BMP &original, const BMP &current, const BMP &previous, BMP &diff);
+
+    // compare_bmps(original, current), compare_bmps(original, previous) and compare_regressions of the two diffs
+    // fused into a single sweep over the base image, with identical results
+    static RegressionCounts compare_three_way(const BMP &original, const BMP &current, const BMP &previous, bool enable_minor_differences,
+                                              BMP &current_diff, BMP &previous_diff, BMP &regressions, CompareWorkspace &workspace);
+
+    // compare_bmps and compare_three_way counting only: no diff is drawn and, once the workspace has grown to the
+    // page size, nothing is allocated. The counts stop at the end of the row where the red count of the (current)
+    // target passes max_red, so a page over the budget has lower bounds.
+    static constexpr int no_red_budget = std::numeric_limits<int>::max();
+    static DiffCounts count_differences(const BMP &original, const BMP &target, bool enable_minor_differences, CompareWorkspace &workspace,
+                                        int max_red = no_red_budget);
+    static ThreeWayCounts count_three_way(const BMP &original, const BMP &current, const BMP &previous, bool enable_minor_differences,
+                                          CompareWorkspace &workspace, int max_red = no_red_budget);
+
+    // every colour the diffs and regression maps are drawn in, the palette of 8-bit output
+    static std::vector<PixelValues> diff_colours();
 
 private:
-    static std::vector<bool> get_intersection_mask(const BMP &original, const BMP &target, int min_width, int min_height);
+    friend class PageComparison;
+
     static PixelValues compare_pixel_regression(PixelValues original, PixelValues current, PixelValues previous);
-    static PixelValues compare_pixels(PixelValues original, PixelValues target, BMP &diff, bool near_edge, bool vertical_edge, bool minor_differences);
     static PixelValues colour_pixel(Colour colour);
 };
+
+// A comparison of a base page with a target, or with a current and a previous target, run a strip of rows at a time
+// bottom up, so the band engine (band.hpp) can compare the rows it has just analysed. The whole-page functions of
+// PixelBasher begin one, compare every row and finish it.
+class PageComparison
+{
+public:
+    // compare_bmps: the diff is drawn over the base
+    void begin(const BMP &original, const BMP &target, bool enable_minor_differences, BMP &diff, CompareWorkspace &workspace);
+    // compare_three_way: both diffs and the regression map
+    void begin(const BMP &original, const BMP &current, const BMP &previous, bool enable_minor_differences, BMP &current_diff,
+               BMP &previous_diff, BMP &regressions, CompareWorkspace &workspace);
+    // count_differences, or count_three_way with a previous target: nothing is drawn and the counting stops at the
+    // end of the row where the red count of the current target passes max_red
+    void begin_counting(const BMP &original, const BMP &current, const BMP *previous, bool enable_minor_differences, CompareWorkspace &workspace,
+                        int max_red);
+
+    // the pages compared, the base first and nullptr after the last; the edge masks of a page are its own unless set
+    const BMP *get_page(int index) const { return index < 3 ? m_pages[index] : nullptr; }
+    void set_edge_masks(int index, const EdgeMaskRows &masks) { m_masks[index] = masks; }
+
+    // compares the rows up to end (exclusive) that are not compared yet, the pages have to be analysed that far
+    void compare_rows(int end);
+    void compare_all_rows() { compare_rows(m_rows); }
+    bool done() const { return m_next_row == m_rows || m_stop_row >= 0; } // every row compared, or the budget passed
+    // once done: the rows of the diffs that are not compared, the regions, and whether the counts stopped short
+    void finish();
+
+    const RegressionCounts &get_regressions() const { return m_counts.regressions; }
+    const ThreeWayCounts &get_counts() const { return m_counts; } // counting only, a single target is the current one
+
+private:
+    void begin_pages(const BMP &original, const BMP &current, const BMP *previous, CompareWorkspace &workspace);
+    RowSpan area_row(int y) const;
+
+    // the comparison loops over rows first to end - 1, instantiated per CompareConfig preset and picked once per comparison
+    template <CompareConfig Config, bool FindRegions>
+    void compare_two_way(int first, int end);
+    template <CompareConfig Config, bool FindRegions>
+    void compare_three_way(int first, int end);
+    template <CompareConfig Config>
+    void count_two_way(int first, int end);
+    template <CompareConfig Config>
+    void count_three_way(int first, int end);
+
+    void (PageComparison::*m_compare)(int first, int end) = nullptr;
+    const BMP *m_pages[3] = {};
+    EdgeMaskRows m_masks[3];
+    BMP *m_diffs[3] = {}; // the current and previous diff and the regression map, none when counting
+    CompareWorkspace *m_workspace = nullptr;
+
+    // a single target is compared over its overlap with the base, a current and a previous target over the base, each
+    // within its own overlap
+    int m_width = 0;
+    int m_rows = 0;
+    int m_current_width = 0;
+    int m_current_height = 0;
+    int m_previous_width = 0;
+    int m_previous_height = 0;
+    bool m_trim = false; // only the content of the pages is compared, see area_row()
+
+    int m_next_row = 0;
+    int m_max_red = PixelBasher::no_red_budget;
+    int m_stop_row = -1; // where the counting passed the budget
+    ThreeWayCounts m_counts;
+};
 #endif
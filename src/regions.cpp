@@ -0,0 +1,137 @@
+//
+//
+// Copyright the mso-test contributors
+//
+// SPDX-License-Identifier: MPL-2.0
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#include <algorithm>
+
+#include "regions.hpp"
+
+void RegionLabeler::begin(int width)
+{
+    m_width = width;
+    m_row.assign(width, NONE);
+    m_previous_labels.assign(width, -1);
+    m_current_labels.assign(width, -1);
+    m_parent.clear();
+    m_stats.clear();
+}
+
+int RegionLabeler::find(int label)
+{
+    while (m_parent[label] != label)
+    {
+        m_parent[label] = m_parent[m_parent[label]]; // path halving
+        label = m_parent[label];
+    }
+    return label;
+}
+
+int RegionLabeler::unite(int a, int b)
+{
+    a = find(a);
+    b = find(b);
+    if (a == b)
+        return a;
+    if (b < a)
+        std::swap(a, b);
+
+    // the older label stays the root and takes over the statistics
+    DiffRegion &root = m_stats[a];
+    const DiffRegion &other = m_stats[b];
+    root.left = std::min(root.left, other.left);
+    root.bottom = std::min(root.bottom, other.bottom);
+    root.right = std::max(root.right, other.right);
+    root.top = std::max(root.top, other.top);
+    root.area += other.area;
+    root.red += other.red;
+    root.minor += other.minor;
+    root.vertical_edge += other.vertical_edge;
+    m_parent[b] = a;
+    return a;
+}
+
+void RegionLabeler::add_row(int y)
+{
+    for (int x = 0; x < m_width; x++)
+    {
+        const std::uint8_t pixel_class = m_row[x];
+        if (pixel_class == NONE)
+        {
+            m_current_labels[x] = -1;
+            continue;
+        }
+
+        // already visited 8-neighbours: left, and the three above
+        int label = -1;
+        const int neighbours[] = {
+            x > 0 ? m_current_labels[x - 1] : -1,
+            x > 0 ? m_previous_labels[x - 1] : -1,
+            m_previous_labels[x],
+            x + 1 < m_width ? m_previous_labels[x + 1] : -1};
+        for (int neighbour : neighbours)
+        {
+            if (neighbour < 0)
+                continue;
+            label = label < 0 ? find(neighbour) : unite(label, neighbour);
+        }
+
+        if (label < 0)
+        {
+            label = static_cast<int>(m_parent.size());
+            m_parent.push_back(label);
+            DiffRegion region;
+            region.left = region.right = x;
+            region.bottom = region.top = y;
+            m_stats.push_back(region);
+        }
+
+        DiffRegion &region = m_stats[label];
+        region.left = std::min(region.left, x);
+        region.right = std::max(region.right, x);
+        region.bottom = std::min(region.bottom, y);
+        region.top = std::max(region.top, y);
+        region.area++;
+        region.red += pixel_class == RED;
+        region.minor += pixel_class == MINOR;
+        region.vertical_edge += pixel_class == VERTICAL_EDGE;
+        m_current_labels[x] = label;
+    }
+    m_previous_labels.swap(m_current_labels);
+}
+
+int RegionLabeler::finish(std::vector<DiffRegion> &regions, std::size_t max_regions)
+{
+    regions.clear();
+    for (std::size_t label = 0; label < m_parent.size(); label++)
+    {
+        if (m_parent[label] == static_cast<int>(label))
+            regions.push_back(m_stats[label]);
+    }
+    int total = static_cast<int>(regions.size());
+
+    // largest first, position breaks ties so the order does not depend on the labelling
+    auto larger = [](const DiffRegion &a, const DiffRegion &b)
+    {
+        if (a.area != b.area)
+            return a.area > b.area;
+        if (a.top != b.top)
+            return a.top > b.top;
+        return a.left < b.left;
+    };
+    if (regions.size() > max_regions)
+    {
+        std::partial_sort(regions.begin(), regions.begin() + max_regions, regions.end(), larger);
+        regions.resize(max_regions);
+    }
+    else
+    {
+        std::sort(regions.begin(), regions.end(), larger);
+    }
+    return total;
+}
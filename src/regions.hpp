@@ -0,0 +1,69 @@
+//
+//
+// Copyright the mso-test contributors
+//
+// SPDX-License-Identifier: MPL-2.0
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#ifndef REGIONS_HPP
+#define REGIONS_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// A connected (8-neighbour) group of diff pixels. Coordinates are in BMP row order (row 0 is the
+// bottom row of the page), right and top are inclusive.
+struct DiffRegion
+{
+    int left = 0;
+    int bottom = 0;
+    int right = 0;
+    int top = 0;
+    std::int64_t area = 0;
+    std::int64_t red = 0;           // differences
+    std::int64_t minor = 0;         // yellow, minor differences near edges
+    std::int64_t vertical_edge = 0; // dark yellow, differences on long vertical edges
+
+    int width() const { return right - left + 1; }
+    int height() const { return top - bottom + 1; }
+};
+
+// Single-pass connected-component labelling with union-find. Rows are fed in order while they are
+// classified, only the labels of the previous row are kept, and the statistics of each component
+// are merged as its labels are united. The buffers are kept between pages.
+class RegionLabeler
+{
+public:
+    enum PixelClass : std::uint8_t
+    {
+        NONE = 0,
+        RED = 1,
+        MINOR = 2,
+        VERTICAL_EDGE = 3
+    };
+
+    void begin(int width);
+
+    // the class of every pixel of the next row is written here before add_row()
+    std::uint8_t *row() { return m_row.data(); }
+    void add_row(int y);
+
+    // the regions sorted by area (largest first), at most max_regions of them; returns how many there were in total
+    int finish(std::vector<DiffRegion> &regions, std::size_t max_regions);
+
+private:
+    int find(int label);
+    int unite(int a, int b);
+
+    int m_width = 0;
+    std::vector<std::uint8_t> m_row;
+    std::vector<int> m_previous_labels;
+    std::vector<int> m_current_labels;
+    std::vector<int> m_parent;
+    std::vector<DiffRegion> m_stats; // valid for root labels only
+};
+#endif
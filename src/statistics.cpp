@@ -0,0 +1,342 @@
+//
+//
+// Copyright the mso-test contributors
+//
+// SPDX-License-Identifier: MPL-2.0
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "statistics.hpp"
+
+namespace
+{
+double ratio(std::int64_t count, std::int64_t total)
+{
+    return total > 0 ? static_cast<double>(count) / static_cast<double>(total) : 0.0;
+}
+
+// same output as streaming a double with the default iostream precision
+void append_double(std::string &out, double value)
+{
+    char buffer[32];
+    int length = std::snprintf(buffer, sizeof(buffer), "%g", value);
+    out.append(buffer, length);
+}
+
+void append_json_string(std::string &out, const std::string &value)
+{
+    out += '"';
+    for (char c : value)
+    {
+        switch (c)
+        {
+        case '"':
+            out += "\\\"";
+            break;
+        case '\\':
+            out += "\\\\";
+            break;
+        case '\n':
+            out += "\\n";
+            break;
+        case '\t':
+            out += "\\t";
+            break;
+        default:
+            if (static_cast<unsigned char>(c) < 0x20)
+            {
+                char buffer[8];
+                std::snprintf(buffer, sizeof(buffer), "\\u%04x", c);
+                out += buffer;
+            }
+            else
+            {
+                out += c;
+            }
+        }
+    }
+    out += '"';
+}
+
+void append_json_field(std::string &out, const char *key, std::int64_t value)
+{
+    out += ",\"";
+    out += key;
+    out += "\":";
+    out += std::to_string(value);
+}
+
+void append_json_field(std::string &out, const char *key, double value)
+{
+    out += ",\"";
+    out += key;
+    out += "\":";
+    append_double(out, value);
+}
+} // namespace
+
+PageStatistics PageStatistics::from_pages(const std::string &basename, int page_number, const BMP &base, const BMP &current, const BMP &diff)
+{
+    return from_pages(basename, page_number, base, current, diff.get_red_count());
+}
+
+PageStatistics PageStatistics::from_pages(const std::string &basename, int page_number, const BMP &base, const BMP &current, std::int64_t red_count)
+{
+    PageStatistics stats;
+    stats.basename = basename;
+    stats.page_number = page_number;
+    stats.base_total_pixels = static_cast<std::int64_t>(base.get_width()) * base.get_height();
+    stats.base_non_background = base.get_non_background_count();
+    stats.current_total_pixels = static_cast<std::int64_t>(current.get_width()) * current.get_height();
+    stats.current_non_background = current.get_non_background_count();
+    stats.red_count = red_count;
+    return stats;
+}
+
+void PageStatistics::set_previous(const BMP &previous, const BMP &previous_diff, const RegressionCounts &regression_counts)
+{
+    set_previous(previous, previous_diff.get_red_count(), regression_counts);
+}
+
+void PageStatistics::set_previous(const BMP &previous, std::int64_t previous_red, const RegressionCounts &regression_counts)
+{
+    regressions = regression_counts;
+    previous_exists = true;
+    previous_total_pixels = static_cast<std::int64_t>(previous.get_width()) * previous.get_height();
+    previous_non_background = previous.get_non_background_count();
+    previous_red_count = previous_red;
+}
+
+void PageStatistics::set_regions(const BMP &diff)
+{
+    regions_found = true;
+    diff_height = diff.get_height();
+    region_count = diff.get_region_count();
+    regions = diff.get_regions();
+}
+
+void PageStatistics::set_history(const HistorySummary &summary)
+{
+    history_found = true;
+    history = summary;
+}
+
+StatisticsSink &StatisticsSink::instance()
+{
+    static StatisticsSink sink;
+    return sink;
+}
+
+void StatisticsSink::set_formats(unsigned formats)
+{
+    m_formats = formats;
+}
+
+unsigned StatisticsSink::parse_formats(const std::string &value)
+{
+    unsigned formats = 0;
+    std::size_t start = 0;
+    while (start <= value.size())
+    {
+        std::size_t end = value.find(',', start);
+        if (end == std::string::npos)
+            end = value.size();
+
+        std::string format = value.substr(start, end - start);
+        if (format == "csv")
+            formats |= CSV;
+        else if (format == "jsonl")
+            formats |= JSON_LINES;
+        else
+            throw std::runtime_error("Unknown statistics format: " + format + " (expected csv and/or jsonl)");
+
+        start = end + 1;
+    }
+    return formats;
+}
+
+std::string StatisticsSink::format_csv(const PageStatistics &stats)
+{
+    std::string row;
+    row += stats.basename;
+    row += ',' + std::to_string(stats.page_number);
+    row += ',' + std::to_string(stats.base_total_pixels);
+    row += ',' + std::to_string(stats.base_non_background);
+    row += ',';
+    append_double(row, ratio(stats.base_non_background, stats.base_total_pixels));
+    row += ',' + std::to_string(stats.current_total_pixels);
+    row += ',' + std::to_string(stats.current_non_background);
+    row += ',';
+    append_double(row, ratio(stats.current_non_background, stats.current_total_pixels));
+    // a count cut short at the --max-red budget is written as ">=count", so it cannot be taken for a total
+    const char *at_least = stats.counts_partial ? ">=" : "";
+    row += ',' + (at_least + std::to_string(stats.red_count));
+    row += std::string(",") + at_least;
+    append_double(row, ratio(stats.red_count, stats.current_total_pixels));
+
+    if (stats.previous_exists)
+    {
+        row += ',' + std::to_string(stats.previous_total_pixels);
+        row += ',' + std::to_string(stats.previous_non_background);
+        row += ',';
+        append_double(row, ratio(stats.previous_non_background, stats.previous_total_pixels));
+        row += ',' + (at_least + std::to_string(stats.previous_red_count));
+        row += std::string(",") + at_least;
+        append_double(row, ratio(stats.previous_red_count, stats.previous_total_pixels));
+    }
+    row += '\n';
+    return row;
+}
+
+std::string StatisticsSink::format_json(const PageStatistics &stats)
+{
+    std::string row = "{\"basename\":";
+    append_json_string(row, stats.basename);
+    append_json_field(row, "page", static_cast<std::int64_t>(stats.page_number));
+    append_json_field(row, "base_total_pixels", stats.base_total_pixels);
+    append_json_field(row, "base_non_background", stats.base_non_background);
+    append_json_field(row, "base_non_background_ratio", ratio(stats.base_non_background, stats.base_total_pixels));
+    append_json_field(row, "current_total_pixels", stats.current_total_pixels);
+    append_json_field(row, "current_non_background", stats.current_non_background);
+    append_json_field(row, "current_non_background_ratio", ratio(stats.current_non_background, stats.current_total_pixels));
+    append_json_field(row, "red_count", stats.red_count);
+    append_json_field(row, "red_ratio", ratio(stats.red_count, stats.current_total_pixels));
+    if (stats.over_max_red)
+        row += ",\"over_max_red\":true"; // with --statistics-only red_count is where the counting stopped
+    if (stats.counts_partial)
+        row += ",\"counts_partial\":true";
+
+    if (stats.previous_exists)
+    {
+        append_json_field(row, "previous_total_pixels", stats.previous_total_pixels);
+        append_json_field(row, "previous_non_background", stats.previous_non_background);
+        append_json_field(row, "previous_non_background_ratio", ratio(stats.previous_non_background, stats.previous_total_pixels));
+        append_json_field(row, "previous_red_count", stats.previous_red_count);
+        append_json_field(row, "previous_red_ratio", ratio(stats.previous_red_count, stats.previous_total_pixels));
+        append_json_field(row, "persisting_count", stats.regressions.persisting);
+        append_json_field(row, "regressed_count", stats.regressions.regressed);
+        append_json_field(row, "fixed_count", stats.regressions.fixed);
+    }
+
+    if (stats.regions_found)
+    {
+        // x and y are the top left corner counted from the top of the page, as in the rendered PDF
+        append_json_field(row, "region_count", static_cast<std::int64_t>(stats.region_count));
+        row += ",\"regions\":[";
+        for (const DiffRegion &region : stats.regions)
+        {
+            row += &region == stats.regions.data() ? "{" : ",{";
+            row += "\"x\":" + std::to_string(region.left);
+            append_json_field(row, "y", static_cast<std::int64_t>(stats.diff_height - 1 - region.top));
+            append_json_field(row, "width", static_cast<std::int64_t>(region.width()));
+            append_json_field(row, "height", static_cast<std::int64_t>(region.height()));
+            append_json_field(row, "area", region.area);
+            append_json_field(row, "red", region.red);
+            append_json_field(row, "minor", region.minor);
+            append_json_field(row, "vertical_edge", region.vertical_edge);
+            row += "}";
+        }
+        row += "]";
+    }
+
+    if (stats.history_found)
+    {
+        row += ",\"history\":{\"runs\":" + std::to_string(stats.history.runs);
+        append_json_field(row, "new_red", stats.history.new_red);
+        append_json_field(row, "persisting", stats.history.persisting);
+        append_json_field(row, "fixed", stats.history.fixed);
+        append_json_field(row, "flapping", stats.history.flapping);
+        row += ",\"first_seen\":[";
+        for (std::size_t run = 0; run < stats.history.first_seen.size(); run++)
+            row += (run ? "," : "") + std::to_string(stats.history.first_seen[run]);
+        row += "]}";
+    }
+    row += "}\n";
+    return row;
+}
+
+std::vector<std::pair<std::string, std::string>> StatisticsSink::format_rows(const std::string &stem, const PageStatistics &stats) const
+{
+    const unsigned formats = m_formats;
+    std::vector<std::pair<std::string, std::string>> rows;
+    if (formats & CSV)
+        rows.emplace_back(stem + ".csv", format_csv(stats));
+    if (formats & JSON_LINES)
+        rows.emplace_back(stem + ".jsonl", format_json(stats));
+    return rows;
+}
+
+void StatisticsSink::add(const std::string &stem, const PageStatistics &stats)
+{
+    // format outside the lock, only the append to the buffer is serialised
+    for (const auto &[filename, row] : format_rows(stem, stats))
+        add_row(filename, row);
+}
+
+void StatisticsSink::add_row(const std::string &filename, const std::string &row)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_buffers[filename] += row;
+}
+
+void StatisticsSink::flush()
+{
+    std::map<std::string, std::string> buffers;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        buffers.swap(m_buffers);
+    }
+
+    for (const auto &[filename, buffer] : buffers)
+    {
+        append_to_file(filename, buffer);
+    }
+}
+
+void StatisticsSink::discard()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_buffers.clear();
+}
+
+void StatisticsSink::append_to_file(const std::string &filename, const std::string &buffer)
+{
+    if (buffer.empty())
+        return;
+
+    // O_APPEND makes the kernel position every write at the end of the file, so rows from
+    // concurrent pixelbasher processes never overwrite or interleave within one write
+    int fd = ::open(filename.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (fd < 0)
+    {
+        throw std::runtime_error("Cannot open statistics file for appending: " + filename + " (" + std::strerror(errno) + ")");
+    }
+
+    const char *data = buffer.data();
+    std::size_t remaining = buffer.size();
+    while (remaining > 0)
+    {
+        ssize_t written = ::write(fd, data, remaining);
+        if (written < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            int error = errno;
+            ::close(fd);
+            throw std::runtime_error("Cannot write statistics file: " + filename + " (" + std::strerror(error) + ")");
+        }
+        data += written;
+        remaining -= written;
+    }
+    ::close(fd);
+}
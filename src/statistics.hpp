@@ -0,0 +1,101 @@
+//
+//
+// Copyright the mso-test contributors
+//
+// SPDX-License-Identifier: MPL-2.0
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#ifndef STATISTICS_HPP
+#define STATISTICS_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "bmp.hpp"
+#include "history.hpp"
+#include "pixelbasher.hpp"
+
+// One row of page statistics, the counts are taken from the loaded pages and their diffs
+struct PageStatistics
+{
+    std::string basename;
+    int page_number = 0;
+    std::int64_t base_total_pixels = 0;
+    std::int64_t base_non_background = 0;
+    std::int64_t current_total_pixels = 0;
+    std::int64_t current_non_background = 0;
+    std::int64_t red_count = 0;
+    bool over_max_red = false; // more red pixels than --max-red, only written to the JSON lines output
+    bool counts_partial = false; // --statistics-only stopped counting at --max-red, the red counts are lower bounds (">=" in the CSV)
+
+    bool previous_exists = false;
+    std::int64_t previous_total_pixels = 0;
+    std::int64_t previous_non_background = 0;
+    std::int64_t previous_red_count = 0;
+    RegressionCounts regressions; // only written to the JSON lines output
+
+    // the largest diff regions, only written to the JSON lines output and only when they were asked for
+    bool regions_found = false;
+    int diff_height = 0;
+    int region_count = 0;
+    std::vector<DiffRegion> regions;
+
+    // the red pixels over the runs kept in the page's history, only written to the JSON lines output
+    bool history_found = false;
+    HistorySummary history;
+
+    static PageStatistics from_pages(const std::string &basename, int page_number, const BMP &base, const BMP &current, const BMP &diff);
+    static PageStatistics from_pages(const std::string &basename, int page_number, const BMP &base, const BMP &current, std::int64_t red_count);
+    void set_previous(const BMP &previous, const BMP &previous_diff, const RegressionCounts &regression_counts);
+    void set_previous(const BMP &previous, std::int64_t previous_red, const RegressionCounts &regression_counts);
+    void set_regions(const BMP &diff);
+    void set_history(const HistorySummary &summary);
+};
+
+// Process-wide sink for page statistics. Rows are buffered in memory (producers may be on any thread)
+// and appended to the statistics files with a single write per file when flush() is called.
+class StatisticsSink
+{
+public:
+    enum Format : unsigned
+    {
+        CSV = 1 << 0,
+        JSON_LINES = 1 << 1
+    };
+
+    static StatisticsSink &instance();
+
+    void set_formats(unsigned formats);
+    unsigned get_formats() const { return m_formats; }
+
+    // stem is the file name without extension, e.g. "diff-pdf-doc-import-statistics"
+    void add(const std::string &stem, const PageStatistics &stats);
+    void add_row(const std::string &filename, const std::string &row); // an already formatted row, e.g. replayed from a manifest
+    void flush();
+    void discard();
+
+    // the rows of stats in every enabled format, as (file name, row) pairs
+    std::vector<std::pair<std::string, std::string>> format_rows(const std::string &stem, const PageStatistics &stats) const;
+
+    static unsigned parse_formats(const std::string &value);
+    static std::string format_csv(const PageStatistics &stats);
+    static std::string format_json(const PageStatistics &stats);
+
+private:
+    StatisticsSink() = default;
+
+    static void append_to_file(const std::string &filename, const std::string &buffer);
+
+    std::mutex m_mutex;
+    std::map<std::string, std::string> m_buffers; // filename -> rows waiting to be appended
+    std::atomic<unsigned> m_formats = CSV;
+};
+#endif
@@ -0,0 +1,637 @@
+//
+//
+// Copyright the mso-test contributors
+//
+// SPDX-License-Identifier: MPL-2.0
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+// Differential check of the page analysis and comparison against the scalar reference in
+// reference.cpp. Random pages (odd widths, tiny pages, heights of 1-3, mismatched sizes) are run
+// through both, and every mask, count and output pixel has to match bit for bit, with the kernels of
+// every instruction set the CPU has.
+//
+// usage: kernel-check [iterations] [seed]
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <filesystem>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "band.hpp"
+#include "bmp.hpp"
+#include "history.hpp"
+#include "kernels.hpp"
+#include "pixelbasher.hpp"
+#include "reference.hpp"
+
+namespace
+{
+struct Failure
+{
+    std::string what;
+};
+
+std::mt19937 rng;
+
+int random_int(int low, int high) // inclusive
+{
+    return std::uniform_int_distribution<int>(low, high)(rng);
+}
+
+void set_gray(reference::Image &image, int x, int y, int gray)
+{
+    std::uint8_t *pixel = &image.data[(static_cast<std::size_t>(y) * image.width + x) * pixel_stride];
+    pixel[0] = pixel[1] = pixel[2] = static_cast<std::uint8_t>(gray);
+    pixel[3] = 255;
+}
+
+// A page like the rasterised ones: a background with text-like blocks, lines and some noise, often
+// kept inside blank margins. Sometimes a pure red pixel is planted, since the regression map treats those specially.
+reference::Image random_page(int width, int height)
+{
+    reference::Image image;
+    image.width = width;
+    image.height = height;
+    image.data.resize(static_cast<std::size_t>(width) * height * pixel_stride);
+
+    const int background = random_int(0, 3) == 0 ? random_int(0, 255) : random_int(235, 255);
+    for (int y = 0; y < height; y++)
+        for (int x = 0; x < width; x++)
+            set_gray(image, x, y, background);
+
+    // the content area, the whole page or a box inside margins
+    int left = 0, bottom = 0, right = width - 1, top = height - 1;
+    if (random_int(0, 1) == 0)
+    {
+        left = random_int(0, width - 1);
+        right = random_int(left, width - 1);
+        bottom = random_int(0, height - 1);
+        top = random_int(bottom, height - 1);
+    }
+    const int content_width = right - left + 1;
+    const int content_height = top - bottom + 1;
+
+    int shapes = random_int(0, 1 + content_width * content_height / 200);
+    for (int i = 0; i < shapes; i++)
+    {
+        int gray = random_int(0, 3) == 0 ? random_int(0, 255) : random_int(0, 40);
+        int x0 = random_int(left, right);
+        int y0 = random_int(bottom, top);
+        int w = random_int(0, 3) == 0 ? 1 : random_int(1, std::max(1, content_width / 4));
+        int h = random_int(0, 3) == 0 ? random_int(8, 30) : random_int(1, std::max(1, content_height / 4)); // long thin runs make vertical edges
+        for (int y = y0; y <= std::min(top, y0 + h - 1); y++)
+            for (int x = x0; x <= std::min(right, x0 + w - 1); x++)
+                set_gray(image, x, y, gray);
+    }
+
+    int noise = random_int(0, content_width * content_height / 20);
+    for (int i = 0; i < noise; i++)
+        set_gray(image, random_int(left, right), random_int(bottom, top), random_int(0, 255));
+
+    if (random_int(0, 4) == 0)
+    {
+        // the top right pixel sets the margin, a red margin is not trimmed
+        const bool corner = random_int(0, 2) == 0;
+        std::uint8_t *pixel = corner ? &image.data[image.data.size() - pixel_stride]
+                                     : &image.data[(static_cast<std::size_t>(random_int(0, height - 1)) * width + random_int(0, width - 1)) * pixel_stride];
+        pixel[0] = 0;
+        pixel[1] = 0;
+        pixel[2] = 255;
+    }
+    return image;
+}
+
+// The same page rendered slightly differently: shifted content, changed blocks, maybe another size
+reference::Image variant_of(const reference::Image &page, bool allow_resize)
+{
+    int width = page.width;
+    int height = page.height;
+    if (allow_resize && random_int(0, 2) == 0)
+    {
+        width = std::max(1, width + random_int(-3, 3));
+        height = std::max(1, height + random_int(-3, 3));
+    }
+
+    reference::Image image;
+    image.width = width;
+    image.height = height;
+    image.data.assign(static_cast<std::size_t>(width) * height * pixel_stride, 255);
+
+    int shift_x = random_int(0, 3) == 0 ? random_int(-1, 1) : 0;
+    for (int y = 0; y < height; y++)
+    {
+        for (int x = 0; x < width; x++)
+        {
+            int source_x = std::clamp(x + shift_x, 0, page.width - 1);
+            int source_y = std::min(y, page.height - 1);
+            const std::uint8_t *source = &page.data[(static_cast<std::size_t>(source_y) * page.width + source_x) * pixel_stride];
+            std::copy(source, source + pixel_stride, &image.data[(static_cast<std::size_t>(y) * width + x) * pixel_stride]);
+        }
+    }
+
+    int changes = random_int(0, 1 + width * height / 100);
+    for (int i = 0; i < changes; i++)
+    {
+        int gray = random_int(0, 255);
+        int x0 = random_int(0, width - 1);
+        int y0 = random_int(0, height - 1);
+        for (int y = y0; y < std::min(height, y0 + random_int(1, 12)); y++)
+            for (int x = x0; x < std::min(width, x0 + random_int(1, 12)); x++)
+                set_gray(image, x, y, std::clamp(gray + random_int(-60, 60), 0, 255));
+    }
+    return image;
+}
+
+BMP to_bmp(const reference::Image &image, bool analyse = true)
+{
+    PixelBuffer data(image.data.begin(), image.data.end());
+    BMP bmp(image.width, image.height, std::move(data));
+    if (analyse)
+        bmp.analyse();
+    return bmp;
+}
+
+void expect(bool condition, const std::string &what)
+{
+    if (!condition)
+        throw Failure{what};
+}
+
+void expect_mask(const Mask &actual, const std::vector<bool> &expected, int width, const std::string &what)
+{
+    expect(actual.size() == expected.size(), what + ": size " + std::to_string(actual.size()) + " != " + std::to_string(expected.size()));
+    for (std::size_t i = 0; i < expected.size(); i++)
+    {
+        if (static_cast<bool>(actual[i]) != expected[i])
+            throw Failure{what + ": differs at x=" + std::to_string(i % width) + " y=" + std::to_string(i / width)};
+    }
+}
+
+void expect_pixels(const BMP &actual, const reference::Image &expected, const std::string &what)
+{
+    expect(actual.get_width() == expected.width && actual.get_height() == expected.height, what + ": size differs");
+    const PixelBuffer &data = actual.get_data();
+    expect(data.size() == expected.data.size(), what + ": data size differs");
+    for (std::size_t i = 0; i < expected.data.size(); i++)
+    {
+        if (data[i] != expected.data[i])
+        {
+            std::size_t pixel = i / pixel_stride;
+            throw Failure{what + ": differs at x=" + std::to_string(pixel % expected.width) + " y=" + std::to_string(pixel / expected.width) +
+                          " byte " + std::to_string(i % pixel_stride) + ": " + std::to_string(data[i]) + " != " + std::to_string(expected.data[i])};
+        }
+    }
+}
+
+void expect_diff(const BMP &actual, const reference::Diff &expected, const std::string &what)
+{
+    expect_pixels(actual, expected.image, what);
+    expect(actual.get_red_count() == expected.red_count,
+           what + ": red count " + std::to_string(actual.get_red_count()) + " != " + std::to_string(expected.red_count));
+    expect(actual.get_yellow_count() == expected.yellow_count,
+           what + ": yellow count " + std::to_string(actual.get_yellow_count()) + " != " + std::to_string(expected.yellow_count));
+}
+
+void check_analysis(const BMP &bmp, const reference::AnalysedImage &expected, const std::string &name)
+{
+    expect(bmp.get_background_value() == expected.background_value, name + ": background value");
+    expect(bmp.get_non_background_count() == expected.non_background_count, name + ": non-background count");
+    expect_mask(bmp.get_blurred_edge_mask(), expected.blurred_edge_mask, expected.image.width, name + ": blurred edge mask");
+    expect_mask(bmp.get_vertical_edge_mask(), expected.vertical_edges, expected.image.width, name + ": vertical edge mask");
+}
+
+// the gray histogram kernel on every row, from a few pixels in on both sides, against counting one by one
+void check_gray_histogram(const reference::Image &image, const std::string &name)
+{
+    for (int y = 0; y < image.height; y++)
+    {
+        const std::uint8_t *row = &image.data[static_cast<std::size_t>(y) * image.width * pixel_stride];
+        const int first = std::min(y % 3, image.width - 1);
+        const int last = std::max(image.width - 1 - y % 5, first - 1);
+        std::uint32_t actual[256] = {}, expected[256] = {};
+        kernels().gray_histogram(row, first, last, actual);
+        for (int x = first; x <= last; x++)
+            expected[row[x * pixel_stride]]++;
+        expect(std::equal(actual, actual + 256, expected), name + ": gray histogram of row " + std::to_string(y));
+    }
+}
+
+bool is_red(const std::uint8_t *pixel)
+{
+    return pixel[0] == 0 && pixel[1] == 0 && pixel[2] == 255;
+}
+
+// The word-parallel history summary against the same counts taken pixel by pixel
+void check_history(const std::vector<const reference::Image *> &diffs)
+{
+    RedHistory history;
+    std::vector<const reference::Image *> kept; // what the history should hold, oldest first
+    std::string last_label;
+    std::size_t keep = random_int(1, 6);
+    for (int run = random_int(1, 9); run > 0; run--)
+    {
+        const reference::Image *diff = diffs[random_int(0, static_cast<int>(diffs.size()) - 1)];
+        std::string label = !kept.empty() && random_int(0, 3) == 0 ? last_label : "run " + std::to_string(run); // the same label replaces
+        history.add_run(label, to_bmp(*diff), keep);
+
+        if (!kept.empty() && label == last_label)
+            kept.pop_back();
+        if (kept.size() >= keep)
+            kept.erase(kept.begin());
+        kept.push_back(diff);
+        last_label = label;
+    }
+
+    HistorySummary expected;
+    expected.runs = static_cast<int>(kept.size());
+    expected.first_seen.assign(kept.size(), 0);
+    for (std::size_t i = 0; i < kept[0]->data.size(); i += pixel_stride)
+    {
+        int transitions = 0;
+        bool always = true;
+        bool seen = false;
+        for (std::size_t run = 0; run < kept.size(); run++)
+        {
+            bool red = is_red(&kept[run]->data[i]);
+            expected.first_seen[run] += red && !seen;
+            seen = seen || red;
+            always = always && red;
+            transitions += run > 0 && red != is_red(&kept[run - 1]->data[i]);
+        }
+        bool newest = is_red(&kept.back()->data[i]);
+        expected.red += newest;
+        expected.persisting += always;
+        expected.flapping += transitions > 1;
+        expected.fixed += kept.size() > 1 && !newest && is_red(&kept[kept.size() - 2]->data[i]);
+    }
+    expected.new_red = expected.first_seen.back();
+
+    HistorySummary actual = history.summarise();
+    expect(actual.runs == expected.runs && actual.red == expected.red && actual.new_red == expected.new_red &&
+               actual.persisting == expected.persisting && actual.fixed == expected.fixed && actual.flapping == expected.flapping &&
+               actual.first_seen == expected.first_seen,
+           "history summary");
+}
+
+// The buffers of both sides of the pool threshold: aligned, recycled when freed at a pooled size
+void check_image_buffers()
+{
+    for (std::size_t bytes : {std::size_t(1), std::size_t(100), pooled_buffer_size - 1, pooled_buffer_size, huge_page_size + 3})
+    {
+        PixelBuffer buffer(bytes, 0xff);
+        const std::uint8_t *first = buffer.data();
+        expect(reinterpret_cast<std::uintptr_t>(first) % buffer_alignment == 0, "buffer alignment");
+        expect(bytes < huge_page_size || reinterpret_cast<std::uintptr_t>(first) % huge_page_size == 0, "huge page alignment");
+
+        buffer = PixelBuffer();
+        PixelBuffer again(bytes, 0);
+        expect(bytes < pooled_buffer_size || again.data() == first, "buffer not recycled");
+        expect(std::all_of(again.begin(), again.end(), [](std::uint8_t value) { return value == 0; }), "recycled buffer not cleared");
+    }
+}
+
+// Large-page mode: buffers mapped from deleted files in the spill directory, which have to hold what is
+// written to them like any other, and a whole case run with every buffer spilled
+void check_spilled_buffers(const std::string &directory)
+{
+    set_image_spill(directory, pooled_buffer_size);
+    PixelBuffer buffer(huge_page_size + 3, 0x5a);
+    expect(reinterpret_cast<std::uintptr_t>(buffer.data()) % buffer_alignment == 0, "spilled buffer alignment");
+    buffer[huge_page_size + 2] = 1;
+    expect(std::count(buffer.begin(), buffer.end(), 0x5a) == static_cast<std::ptrdiff_t>(huge_page_size + 2) && buffer.back() == 1,
+           "spilled buffer contents");
+    expect(std::filesystem::is_empty(directory), "spill files left in the directory");
+    buffer = PixelBuffer();
+    set_image_spill("", 0);
+}
+
+// An 8-bit palettised page read back: every gray becomes the nearest of the palette grays, the diff
+// colours come back as they were, and the analysis of what was read matches the reference
+void check_indexed_round_trip(const std::string &directory)
+{
+    const std::vector<PixelValues> colours = PixelBasher::diff_colours();
+    reference::Image image, expected;
+    image.width = 7; // rows padded to 8 bytes
+    image.height = 40;
+    image.data.assign(static_cast<std::size_t>(image.width) * image.height * pixel_stride, 0);
+    expected = image;
+    for (int i = 0; i < image.width * image.height; i++)
+    {
+        std::uint8_t *pixel = &image.data[static_cast<std::size_t>(i) * pixel_stride];
+        std::uint8_t *expected_pixel = &expected.data[static_cast<std::size_t>(i) * pixel_stride];
+        if (i < 256)
+        {
+            const int level = (i * (indexed_gray_levels - 1) + 127) / 255;
+            set_gray(image, i % image.width, i / image.width, i);
+            set_gray(expected, i % image.width, i / image.width, (level * 255 + (indexed_gray_levels - 1) / 2) / (indexed_gray_levels - 1));
+            continue;
+        }
+        const PixelValues &colour = colours[random_int(0, static_cast<int>(colours.size()) - 1)];
+        std::copy(colour.begin(), colour.end(), pixel);
+        std::copy(colour.begin(), colour.end(), expected_pixel);
+    }
+
+    const std::string filename = directory + "/indexed.bmp";
+    to_bmp(image).write_indexed(filename.c_str(), colours);
+    BMP read(filename.c_str());
+    std::filesystem::remove(filename);
+    expect_pixels(read, expected, "indexed round trip");
+    check_analysis(read, reference::analyse(expected), "indexed round trip");
+}
+
+// The pages of a case and what the reference makes of them, computed once for all the instruction sets
+struct CaseReference
+{
+    reference::Image base_image, current_image, previous_image;
+    reference::AnalysedImage base, current, previous;
+    reference::Diff current_diff[2], previous_diff[2], regressions[2]; // [minor differences]
+};
+
+CaseReference reference_case(int width, int height, bool allow_resize)
+{
+    CaseReference ref;
+    ref.base_image = random_page(width, height);
+    ref.current_image = variant_of(ref.base_image, allow_resize);
+    ref.previous_image = random_int(0, 4) == 0 ? ref.current_image : variant_of(ref.base_image, allow_resize);
+
+    ref.base = reference::analyse(ref.base_image);
+    ref.current = reference::analyse(ref.current_image);
+    ref.previous = reference::analyse(ref.previous_image);
+    for (bool minor : {false, true})
+    {
+        ref.current_diff[minor] = reference::compare_bmps(ref.base, ref.current, minor);
+        ref.previous_diff[minor] = reference::compare_bmps(ref.base, ref.previous, minor);
+        ref.regressions[minor] = reference::compare_regressions(ref.base, ref.current_diff[minor].image, ref.previous_diff[minor].image);
+    }
+    return ref;
+}
+
+void check_case(const CaseReference &ref)
+{
+    const reference::AnalysedImage &base_ref = ref.base;
+    const reference::AnalysedImage &current_ref = ref.current;
+    const reference::AnalysedImage &previous_ref = ref.previous;
+    const int width = ref.base_image.width;
+    const int height = ref.base_image.height;
+
+    BMP base = to_bmp(ref.base_image);
+    BMP current = to_bmp(ref.current_image);
+    BMP previous = to_bmp(ref.previous_image);
+
+    check_analysis(base, base_ref, "base");
+    check_analysis(current, current_ref, "current");
+    check_analysis(previous, previous_ref, "previous");
+    check_gray_histogram(ref.base_image, "base");
+    check_gray_histogram(ref.current_image, "current");
+
+    CompareWorkspace workspace;
+    for (bool minor : {false, true})
+    {
+        const std::string mode = minor ? " (minor differences)" : "";
+
+        const reference::Diff &current_diff_ref = ref.current_diff[minor];
+        const reference::Diff &previous_diff_ref = ref.previous_diff[minor];
+        const reference::Diff &regressions_ref = ref.regressions[minor];
+
+        BMP current_diff;
+        PixelBasher::compare_bmps(base, current, minor, current_diff, workspace);
+        expect_diff(current_diff, current_diff_ref, "compare_bmps" + mode);
+
+        // the preview of the diff, at factors that do and do not divide the page
+        for (int factor : {2, 3, 7})
+            expect_pixels(current_diff.downscale(factor), reference::downscale(current_diff_ref.image, factor), "downscale by " + std::to_string(factor) + mode);
+
+        // clustering the diff pixels into regions changes no pixel, and every diff pixel is in one region
+        CompareWorkspace region_workspace;
+        region_workspace.max_regions = static_cast<std::size_t>(width) * height;
+        BMP region_diff;
+        PixelBasher::compare_bmps(base, current, minor, region_diff, region_workspace);
+        expect_diff(region_diff, current_diff_ref, "compare_bmps with regions" + mode);
+        int region_area = 0;
+        for (const DiffRegion &region : region_diff.get_regions())
+            region_area += region.area;
+        expect(region_area == region_diff.get_red_count() + region_diff.get_yellow_count(), "regions cover the diff pixels" + mode);
+
+        // the allocating overload and a recycled diff have to give the same result
+        expect_diff(PixelBasher::compare_bmps(base, previous, minor), previous_diff_ref, "compare_bmps previous" + mode);
+        PixelBasher::compare_bmps(base, previous, minor, current_diff, workspace);
+        expect_diff(current_diff, previous_diff_ref, "compare_bmps recycled" + mode);
+
+        BMP current_diff_bmp = to_bmp(current_diff_ref.image);
+        BMP previous_diff_bmp = to_bmp(previous_diff_ref.image);
+        expect_pixels(PixelBasher::compare_regressions(base, current_diff_bmp, previous_diff_bmp), regressions_ref.image, "compare_regressions" + mode);
+
+        BMP three_way_current, three_way_previous, three_way_map;
+        RegressionCounts counts = PixelBasher::compare_three_way(base, current, previous, minor, three_way_current, three_way_previous, three_way_map, workspace);
+        expect_diff(three_way_current, current_diff_ref, "compare_three_way current" + mode);
+        expect_diff(three_way_previous, previous_diff_ref, "compare_three_way previous" + mode);
+        expect_pixels(three_way_map, regressions_ref.image, "compare_three_way map" + mode);
+
+        RegressionCounts expected_counts;
+        for (std::size_t i = 0; i < current_diff_ref.image.data.size(); i += pixel_stride)
+        {
+            bool current_red = is_red(&current_diff_ref.image.data[i]);
+            bool previous_red = is_red(&previous_diff_ref.image.data[i]);
+            expected_counts.persisting += current_red && previous_red;
+            expected_counts.regressed += current_red && !previous_red;
+            expected_counts.fixed += !current_red && previous_red;
+        }
+        expect(counts.persisting == expected_counts.persisting && counts.regressed == expected_counts.regressed && counts.fixed == expected_counts.fixed,
+               "compare_three_way counts" + mode);
+
+        // counting only gives the counts of the drawn diffs, and stops once over a budget
+        DiffCounts counted = PixelBasher::count_differences(base, current, minor, workspace);
+        expect(!counted.over_budget && counted.red == current_diff_ref.red_count && counted.yellow == current_diff_ref.yellow_count,
+               "count_differences" + mode);
+        ThreeWayCounts counted_three_way = PixelBasher::count_three_way(base, current, previous, minor, workspace);
+        expect(!counted_three_way.current.over_budget && counted_three_way.current.red == current_diff_ref.red_count &&
+                   counted_three_way.current.yellow == current_diff_ref.yellow_count && counted_three_way.previous.red == previous_diff_ref.red_count &&
+                   counted_three_way.previous.yellow == previous_diff_ref.yellow_count,
+               "count_three_way" + mode);
+        expect(counted_three_way.regressions.persisting == expected_counts.persisting && counted_three_way.regressions.regressed == expected_counts.regressed &&
+                   counted_three_way.regressions.fixed == expected_counts.fixed,
+               "count_three_way regression counts" + mode);
+        const int max_red = random_int(0, current_diff_ref.red_count);
+        DiffCounts budgeted = PixelBasher::count_differences(base, current, minor, workspace, max_red);
+        expect(budgeted.over_budget == (current_diff_ref.red_count > max_red) && budgeted.red <= current_diff_ref.red_count &&
+                   (budgeted.over_budget ? budgeted.red > max_red : budgeted.red == current_diff_ref.red_count) &&
+                   (budgeted.partial ? budgeted.over_budget : budgeted.red == current_diff_ref.red_count && budgeted.yellow == current_diff_ref.yellow_count),
+               "count_differences with a budget of " + std::to_string(max_red) + mode);
+        ThreeWayCounts budgeted_three_way = PixelBasher::count_three_way(base, current, previous, minor, workspace, max_red);
+        expect(budgeted_three_way.current.over_budget == budgeted.over_budget && budgeted_three_way.current.red <= current_diff_ref.red_count &&
+                   (budgeted.over_budget ? budgeted_three_way.current.red > max_red : budgeted_three_way.current.red == current_diff_ref.red_count) &&
+                   budgeted_three_way.previous.partial == budgeted_three_way.current.partial &&
+                   (budgeted_three_way.current.partial ? budgeted.over_budget
+                                                       : budgeted_three_way.current.red == current_diff_ref.red_count &&
+                                                             budgeted_three_way.previous.red == previous_diff_ref.red_count),
+               "count_three_way with a budget of " + std::to_string(max_red) + mode);
+
+        // the band engine analyses and compares a strip at a time into rings of mask rows, which wrap with strips of a
+        // few rows (0 sizes them to the cache): the diffs, the regions and the counts have to be those of the whole page
+        {
+            const int strip = random_int(0, 3) == 0 ? 0 : random_int(1, 6);
+            const std::string band_mode = " in strips of " + std::to_string(strip) + " rows" + mode;
+            BMP band_base = to_bmp(ref.base_image, false);
+            BMP band_current = to_bmp(ref.current_image, false);
+            BMP band_previous = to_bmp(ref.previous_image, false);
+            BandEngine bands;
+            bands.set_strip_rows(strip);
+
+            CompareWorkspace two_way_workspace, three_way_workspace;
+            two_way_workspace.max_regions = region_workspace.max_regions;
+            PageComparison two_way, three_way;
+            BMP band_diff, band_current_diff, band_previous_diff, band_map;
+            bands.begin({&band_base, &band_current, &band_previous});
+            two_way.begin(band_base, band_current, minor, band_diff, two_way_workspace);
+            three_way.begin(band_base, band_current, band_previous, minor, band_current_diff, band_previous_diff, band_map, three_way_workspace);
+            bands.run({&two_way, &three_way});
+            expect_diff(band_diff, current_diff_ref, "band compare" + band_mode);
+            expect(band_diff.get_region_count() == region_diff.get_region_count(), "band regions" + band_mode);
+            expect_diff(band_current_diff, current_diff_ref, "band three-way current" + band_mode);
+            expect_diff(band_previous_diff, previous_diff_ref, "band three-way previous" + band_mode);
+            expect_pixels(band_map, regressions_ref.image, "band three-way map" + band_mode);
+            const RegressionCounts &band_counts = three_way.get_regressions();
+            expect(band_counts.persisting == counts.persisting && band_counts.regressed == counts.regressed && band_counts.fixed == counts.fixed,
+                   "band three-way counts" + band_mode);
+
+            // counting stops at the budget while the other comparison goes on
+            PageComparison counted_two_way, counted_three_way;
+            bands.begin({&band_base, &band_current, &band_previous});
+            counted_two_way.begin_counting(band_base, band_current, nullptr, minor, two_way_workspace, max_red);
+            counted_three_way.begin_counting(band_base, band_current, &band_previous, minor, three_way_workspace, PixelBasher::no_red_budget);
+            bands.run({&counted_two_way, &counted_three_way});
+            const DiffCounts &band_budgeted = counted_two_way.get_counts().current;
+            expect(band_budgeted.red == budgeted.red && band_budgeted.yellow == budgeted.yellow && band_budgeted.over_budget == budgeted.over_budget &&
+                       band_budgeted.partial == budgeted.partial,
+                   "band count with a budget of " + std::to_string(max_red) + band_mode);
+            expect(counted_three_way.get_counts().current.red == current_diff_ref.red_count &&
+                       counted_three_way.get_counts().previous.yellow == previous_diff_ref.yellow_count &&
+                       counted_three_way.get_counts().regressions.fixed == expected_counts.fixed,
+                   "band three-way count" + band_mode);
+        }
+
+        // properties that hold whatever the kernels do
+        BMP self_diff;
+        PixelBasher::compare_bmps(base, base, minor, self_diff, workspace);
+        expect(self_diff.get_red_count() == 0 && self_diff.get_yellow_count() == 0, "a page compared with itself has differences" + mode);
+
+        BMP same_current, same_previous, same_map;
+        RegressionCounts same = PixelBasher::compare_three_way(base, current, current, minor, same_current, same_previous, same_map, workspace);
+        expect(same.regressed == 0 && same.fixed == 0, "identical runs report regressions or fixes" + mode);
+
+        if (current_diff_ref.image.width == previous_diff_ref.image.width && current_diff_ref.image.height == previous_diff_ref.image.height)
+            check_history({&current_diff_ref.image, &previous_diff_ref.image, &regressions_ref.image});
+    }
+}
+} // namespace
+
+int main(int argc, char *argv[])
+{
+    int iterations = argc > 1 ? std::atoi(argv[1]) : 150;
+    unsigned seed = argc > 2 ? static_cast<unsigned>(std::strtoul(argv[2], nullptr, 10)) : 20251018u;
+
+    // fixed shapes first: tiny pages, heights of 1-3, odd widths
+    std::vector<std::pair<int, int>> sizes = {
+        {1, 1}, {2, 1}, {1, 2}, {2, 2}, {3, 3}, {4, 1}, {1, 4}, {5, 2}, {7, 3}, {9, 1},
+        {31, 1}, {33, 2}, {63, 3}, {3, 40}, {17, 13}, {64, 64}, {65, 33}, {101, 37}};
+    for (int i = 0; i < iterations; i++)
+        sizes.push_back({0, 0}); // random
+
+    std::vector<Isa> isas;
+    for (Isa isa : {Isa::SCALAR, Isa::SSE42, Isa::AVX2, Isa::AVX512})
+    {
+        if (isa <= get_best_isa())
+            isas.push_back(isa);
+    }
+
+    int failures = 0;
+    try
+    {
+        check_image_buffers();
+    }
+    catch (const Failure &failure)
+    {
+        failures++;
+        std::cerr << "FAIL image buffers: " << failure.what << std::endl;
+    }
+
+    const std::filesystem::path spill_directory = std::filesystem::temp_directory_path() / ("kernel-check-spill-" + std::to_string(seed));
+    std::filesystem::create_directories(spill_directory);
+    try
+    {
+        check_spilled_buffers(spill_directory.string());
+        rng.seed(seed);
+        CaseReference ref = reference_case(65, 33, true);
+        set_image_spill(spill_directory.string(), 1);
+        check_case(ref);
+        set_image_spill("", 0);
+    }
+    catch (const Failure &failure)
+    {
+        set_image_spill("", 0);
+        failures++;
+        std::cerr << "FAIL spilled buffers: " << failure.what << std::endl;
+    }
+    try
+    {
+        check_indexed_round_trip(spill_directory.string());
+    }
+    catch (const Failure &failure)
+    {
+        failures++;
+        std::cerr << "FAIL indexed round trip: " << failure.what << std::endl;
+    }
+    std::filesystem::remove_all(spill_directory);
+
+    for (std::size_t i = 0; i < sizes.size(); i++)
+    {
+        unsigned case_seed = seed + static_cast<unsigned>(i);
+        rng.seed(case_seed);
+
+        auto [width, height] = sizes[i];
+        if (width == 0)
+        {
+            width = random_int(1, 160);
+            height = random_int(0, 3) == 0 ? random_int(1, 3) : random_int(1, 160);
+        }
+
+        // every instruction set this CPU has, against the same reference
+        CaseReference ref = reference_case(width, height, true);
+        for (Isa isa : isas)
+        {
+            force_isa(isa);
+            const std::string where = std::string(" (seed ") + std::to_string(case_seed) + ", " + std::to_string(width) + "x" + std::to_string(height) +
+                                      ", " + get_isa_name(isa) + "): ";
+            try
+            {
+                check_case(ref);
+            }
+            catch (const Failure &failure)
+            {
+                failures++;
+                std::cerr << "FAIL case " << i << where << failure.what << std::endl;
+                break;
+            }
+            catch (const std::exception &e)
+            {
+                failures++;
+                std::cerr << "FAIL case " << i << where << "exception: " << e.what() << std::endl;
+                break;
+            }
+        }
+    }
+
+    std::cout << sizes.size() - failures << "/" << sizes.size() << " kernel cases match the reference with";
+    for (Isa isa : isas)
+        std::cout << " " << get_isa_name(isa);
+    std::cout << " (seed " << seed << ")" << std::endl;
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,69 @@
+#!/bin/sh
+
+# Runs a batch with --manifest twice and checks that the second run replays the statistics rows of the
+# first without writing any image again. Then a document with a changed input, one with a missing
+# input and one with a missing output image are run once more: each of them has to be recomputed (or
+# fail) and the other documents are still replayed.
+#
+# usage: tests/manifest_check.sh ./pixelbasher
+
+set -e
+
+PIXELBASHER=$(realpath "$1")
+INPUT=$(realpath converted/input)
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+mkdir -p "$WORK/out" "$WORK/run"
+for document in a b c d; do
+    mkdir -p "$WORK/input-$document"
+    cp "$INPUT"/*.bmp "$WORK/input-$document"
+    printf '%s\t%s\t%s\t%s' "manifest-$document.doc" "$WORK/input-$document/authoritative-page-0.bmp" \
+        "$WORK/input-$document/import-page-0.bmp" "$WORK/input-$document/export-page-0.bmp"
+    printf '\t%s' "$WORK/out" "$WORK/out" "$WORK/out" "$WORK/out" "$WORK/out" "$WORK/out" false false false false false
+    printf '\n'
+done >"$WORK/jobs.tsv"
+
+cd "$WORK/run"
+run()
+{
+    rm -f diff-pdf-doc-*-statistics.csv
+    touch "$WORK/marker"
+    sleep 1 # so that an image written again is newer than the marker
+    "$PIXELBASHER" --batch="$WORK/jobs.tsv" --stats-format=csv --manifest=manifest.tsv --threads=1
+}
+
+# the images of a document written by the last run
+rewritten()
+{
+    find "$WORK/out" -name "manifest-$1.doc_*" -newer "$WORK/marker" | wc -l
+}
+
+run
+cp diff-pdf-doc-import-statistics.csv first.csv
+test "$(find "$WORK/out" -type f | wc -l)" -eq 8
+
+# nothing changed: the same rows, no image written
+run
+cmp first.csv diff-pdf-doc-import-statistics.csv
+for document in a b c d; do
+    test "$(rewritten $document)" -eq 0
+done
+
+# a changed input, a missing input and a missing output image
+cp "$INPUT/authoritative-page-0.bmp" "$WORK/input-a/export-page-0.bmp"
+rm "$WORK/input-b/import-page-0.bmp"
+rm "$WORK/out/manifest-c.doc_import-1.bmp"
+if run 2>errors.txt; then
+    echo "manifest: a run with a missing input succeeded"
+    exit 1
+fi
+grep -q "manifest-b.doc" errors.txt
+test "$(rewritten a)" -eq 2
+test "$(rewritten b)" -eq 0
+test "$(rewritten c)" -eq 2
+test "$(rewritten d)" -eq 0
+test -f "$WORK/out/manifest-c.doc_import-1.bmp"
+# the failed document has no rows, the others have the rows of the first run, replayed or not
+grep -v "manifest-b.doc" first.csv | cmp - diff-pdf-doc-import-statistics.csv
+echo "manifest: OK"
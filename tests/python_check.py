@@ -0,0 +1,48 @@
+#!/usr/bin/python3
+
+# Checks the pixelbasher Python module (make python) against the output make check expects from the binary:
+# the import diff of the converted/input pages has to match converted/expected byte for byte, also when
+# the pages are filled in through the buffer protocol instead of read from their files.
+
+import os
+import sys
+import tempfile
+
+sys.path.insert(0, os.path.join(os.path.dirname(os.path.abspath(__file__)), '..'))
+import pixelbasher
+
+INPUT = 'converted/input/'
+EXPECTED = 'converted/expected/fdo69695-1.doc_import-1.bmp'
+
+def check(condition, message):
+    if not condition:
+        print('FAIL: ' + message)
+        sys.exit(1)
+
+base = pixelbasher.Page.read(INPUT + 'authoritative-page-0.bmp')
+current = pixelbasher.Page.read(INPUT + 'import-page-0.bmp')
+
+with tempfile.TemporaryDirectory() as directory:
+    diff_file = os.path.join(directory, 'diff.bmp')
+    diff = pixelbasher.compare(base, current)
+    diff.write(diff_file)
+    with open(diff_file, 'rb') as written, open(EXPECTED, 'rb') as expected:
+        check(written.read() == expected.read(), 'the diff differs from ' + EXPECTED)
+
+# a page filled in place, as a renderer writing into the module's memory would
+filled = pixelbasher.Page(current.width, current.height)
+memoryview(filled).cast('B')[:] = memoryview(current).cast('B')
+check(memoryview(filled).shape == (current.height, current.width, 4), 'unexpected buffer shape')
+try:
+    pixelbasher.compare(base, filled)
+    check(False, 'compared a page that was not analysed')
+except ValueError:
+    pass
+filled.analyse()
+check(filled.non_background == current.non_background, 'analysis of the filled page differs')
+check(pixelbasher.compare(base, filled).red_count == diff.red_count, 'diff of the filled page differs')
+
+stats = pixelbasher.statistics('fdo69695-1.doc', 1, base, current, diff)
+check(stats['red_count'] == diff.red_count and stats['csv'].startswith('fdo69695-1.doc,1,'), 'unexpected statistics')
+
+print('python module: OK')
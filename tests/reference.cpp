@@ -0,0 +1,412 @@
+//
+//
+// Copyright the mso-test contributors
+//
+// SPDX-License-Identifier: MPL-2.0
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdlib>
+
+#include "reference.hpp"
+
+namespace reference
+{
+namespace
+{
+constexpr int pixel_stride = 4;
+using PixelValues = std::array<std::uint8_t, pixel_stride>;
+
+PixelValues get_bgra(const std::uint8_t *src_row)
+{
+    return {src_row[0], src_row[1], src_row[2], src_row[3]};
+}
+
+bool differs_from(PixelValues original, PixelValues target, int background_value, bool near_edge, int threshold = 40)
+{
+    int gray_original = original[0];
+    int gray_target = target[0];
+    int gray_diff = std::abs(gray_original - gray_target);
+    int from_background = std::abs(gray_original - background_value);
+
+    if (from_background < 15)
+    {
+        threshold += 20; // likely that it's just noise
+    }
+
+    if (near_edge)
+    {
+        threshold += 50;
+    }
+
+    return gray_diff > threshold;
+}
+
+bool is_red(PixelValues pixel)
+{
+    return pixel[0] == 0 && pixel[1] == 0 && pixel[2] == 255;
+}
+
+enum Colour
+{
+    RED,
+    YELLOW,
+    DARK_YELLOW,
+    BLUE,
+    GREEN
+};
+
+PixelValues colour_pixel(Colour colour)
+{
+    switch (colour)
+    {
+    case Colour::YELLOW:
+        return {0, 197, 255, 255};
+    case Colour::DARK_YELLOW:
+        return {0, 128, 139, 255};
+    case Colour::RED:
+        return {0, 0, 255, 255};
+    case Colour::BLUE:
+        return {255, 0, 0, 255};
+    case Colour::GREEN:
+        return {0, 255, 0, 255};
+    }
+    return {};
+}
+
+std::array<int, 2> get_sobel_gradients(int y, int x, const std::vector<std::uint8_t> &data, int width)
+{
+    auto index = [&](int row, int col)
+    {
+        return (row * width + col) * pixel_stride;
+    };
+
+    int top_left = data[index(y - 1, x - 1)];
+    int top_mid = data[index(y - 1, x)];
+    int top_right = data[index(y - 1, x + 1)];
+    int middle_left = data[index(y, x - 1)];
+    int middle_right = data[index(y, x + 1)];
+    int bottom_left = data[index(y + 1, x - 1)];
+    int bottom_mid = data[index(y + 1, x)];
+    int bottom_right = data[index(y + 1, x + 1)];
+
+    int g_x = (-1 * top_left) + (-2 * middle_left) + (-1 * bottom_left) +
+              (top_right) + (2 * middle_right) + (bottom_right);
+    int g_y = (top_left) + (2 * top_mid) + (top_right) +
+              (-1 * bottom_left) + (-2 * bottom_mid) + (-1 * bottom_right);
+
+    return {g_x, g_y};
+}
+
+void blur_pixels(int x, int y, int width, int height, std::vector<bool> &mask, int radius)
+{
+    for (int dy = -radius; dy <= radius; dy++)
+    {
+        for (int dx = -radius; dx <= radius; dx++)
+        {
+            int new_x = x + dx;
+            int new_y = y + dy;
+
+            if (new_x >= 0 && new_x < width && new_y >= 0 && new_y < height)
+            {
+                mask[new_y * width + new_x] = true;
+            }
+        }
+    }
+}
+
+PixelValues compare_pixels(PixelValues original, PixelValues target, Diff &diff, int background_value, bool near_edge, bool vertical_edge, bool minor_differences)
+{
+    // the arguments are passed in this order on purpose, it is what the original code did
+    const bool differs = differs_from(original, target, near_edge, background_value);
+
+    if (!differs)
+    {
+        if (minor_differences && near_edge && differs_from(original, target, background_value, false))
+        {
+            diff.red_count++;
+            return colour_pixel(Colour::YELLOW);
+        }
+        return original;
+    }
+
+    if (vertical_edge)
+    {
+        diff.yellow_count++;
+        return colour_pixel(Colour::DARK_YELLOW);
+    }
+
+    if (near_edge)
+    {
+        return original;
+    }
+
+    diff.red_count++;
+    return colour_pixel(Colour::RED);
+}
+
+PixelValues compare_pixel_regression(PixelValues original, PixelValues current, PixelValues previous)
+{
+    bool current_is_red = is_red(current);
+    bool previous_is_red = is_red(previous);
+
+    if (current_is_red && previous_is_red)
+    {
+        return colour_pixel(Colour::BLUE);
+    }
+    if (current_is_red && !previous_is_red)
+    {
+        return colour_pixel(Colour::RED);
+    }
+    if (!current_is_red && previous_is_red)
+    {
+        return colour_pixel(Colour::GREEN);
+    }
+    return original;
+}
+} // namespace
+
+int get_average_colour(const Image &image)
+{
+    int total_gray = 0;
+    std::size_t pixel_count = image.width * image.height;
+    for (std::size_t i = 0; i < pixel_count; i++)
+    {
+        total_gray += image.data[i * pixel_stride];
+    }
+    return total_gray / pixel_count;
+}
+
+int get_non_background_pixel_count(const Image &image, int background_value)
+{
+    int non_background_count = 0;
+    std::size_t pixel_count = image.width * image.height;
+    for (std::size_t i = 0; i < pixel_count; i++)
+    {
+        std::uint8_t gray_value = image.data[i * pixel_stride];
+        if (std::abs(gray_value - background_value) > 8)
+        {
+            non_background_count++;
+        }
+    }
+    return non_background_count;
+}
+
+std::vector<bool> sobel_edges(const Image &image, int threshold)
+{
+    int width = image.width;
+    int height = image.height;
+    std::vector<bool> result(width * height, false);
+
+    for (int y = 1; y < height - 1; y++)
+    {
+        for (int x = 1; x < width - 1; x++)
+        {
+            auto [g_x, g_y] = get_sobel_gradients(y, x, image.data, width);
+            int magnitude = std::min(255, static_cast<int>(std::sqrt(g_x * g_x + g_y * g_y)));
+            result[y * width + x] = (magnitude >= threshold);
+        }
+    }
+    return result;
+}
+
+std::vector<bool> get_vertical_edges(const Image &image, int threshold)
+{
+    int width = image.width;
+    int height = image.height;
+    std::vector<bool> result(width * height, false);
+
+    for (int y = 1; y < height - 1; y++)
+    {
+        for (int x = 1; x < width - 1; x++)
+        {
+            auto [g_x, g_y] = get_sobel_gradients(y, x, image.data, width);
+            result[y * width + x] = (std::abs(g_x) >= threshold);
+        }
+    }
+    return result;
+}
+
+std::vector<bool> blur_edge_mask(const Image &image, const std::vector<bool> &edge_map, int radius)
+{
+    int width = image.width;
+    int height = image.height;
+    std::vector<bool> blurred_mask(width * height, false);
+
+    for (int y = 1; y < height - 1; y++)
+    {
+        for (int x = 1; x < width - 1; x++)
+        {
+            if (!edge_map[y * width + x])
+                continue;
+
+            blur_pixels(x, y, width, height, blurred_mask, radius);
+        }
+    }
+    return blurred_mask;
+}
+
+std::vector<bool> filter_long_vertical_edge_runs(const Image &image, const std::vector<bool> &vertical_edges, int min_run_length)
+{
+    std::vector<bool> result(vertical_edges.size(), false);
+    int width = image.width;
+    int height = image.height;
+
+    for (int x = 0; x < width; x++)
+    {
+        int run_start = -1;
+        int run_length = 0;
+
+        for (int y = 0; y < height; y++)
+        {
+            int index = y * width + x;
+            if (vertical_edges[index])
+            {
+                if (run_start == -1)
+                {
+                    run_start = y;
+                }
+                run_length++;
+            }
+            else
+            {
+                if (run_length >= min_run_length)
+                {
+                    for (int i = run_start; i < run_start + run_length; i++)
+                    {
+                        result[i * width + x] = true;
+                    }
+                }
+                run_start = -1;
+                run_length = 0;
+            }
+        }
+    }
+    return result;
+}
+
+AnalysedImage analyse(const Image &image)
+{
+    AnalysedImage analysed;
+    analysed.image = image;
+    analysed.background_value = get_average_colour(image);
+    analysed.non_background_count = get_non_background_pixel_count(image, analysed.background_value);
+    analysed.blurred_edge_mask = blur_edge_mask(image, sobel_edges(image, 245), 2);
+    analysed.vertical_edges = filter_long_vertical_edge_runs(image, get_vertical_edges(image, 245), 10);
+    return analysed;
+}
+
+Diff compare_bmps(const AnalysedImage &original, const AnalysedImage &target, bool enable_minor_differences)
+{
+    int min_width = std::min(original.image.width, target.image.width);
+    int min_height = std::min(original.image.height, target.image.height);
+
+    Diff diff;
+    diff.image = original.image;
+
+    std::vector<bool> intersection_mask(min_width * min_height, false);
+    for (int i = 0; i < min_width * min_height; i++)
+    {
+        intersection_mask[i] = original.blurred_edge_mask[i] && target.blurred_edge_mask[i];
+    }
+
+    const std::vector<std::uint8_t> &original_data = original.image.data;
+    const std::vector<std::uint8_t> &target_data = target.image.data;
+    std::vector<std::uint8_t> &diff_data = diff.image.data;
+
+    for (int y = 0; y < min_height; y++)
+    {
+        for (int x = 0; x < min_width; x++)
+        {
+            int original_index = (y * original.image.width + x) * pixel_stride;
+            int target_index = (y * target.image.width + x) * pixel_stride;
+            int mask_index = y * min_width + x;
+
+            bool near_edge = intersection_mask[mask_index];
+            bool vertical_edge = original.vertical_edges[mask_index] || target.vertical_edges[mask_index];
+
+            PixelValues bgra = compare_pixels(get_bgra(&original_data[original_index]), get_bgra(&target_data[target_index]), diff,
+                                              original.background_value, near_edge, vertical_edge, enable_minor_differences);
+            for (int i = 0; i < pixel_stride; i++)
+            {
+                diff_data[original_index + i] = bgra[i];
+            }
+        }
+    }
+    return diff;
+}
+
+Diff compare_regressions(const AnalysedImage &original, const Image &current, const Image &previous)
+{
+    int min_width = std::min(original.image.width, current.width);
+    int min_height = std::min(original.image.height, current.height);
+
+    Diff diff;
+    diff.image = original.image;
+    std::vector<std::uint8_t> &diff_data = diff.image.data;
+
+    for (int y = 0; y < min_height; y++)
+    {
+        for (int x = 0; x < min_width; x++)
+        {
+            int original_index = (y * original.image.width + x) * pixel_stride;
+            int current_index = (y * current.width + x) * pixel_stride;
+            int previous_index = (y * previous.width + x) * pixel_stride;
+
+            PixelValues bgra = compare_pixel_regression(get_bgra(&diff_data[original_index]), get_bgra(&current.data[current_index]),
+                                                        get_bgra(&previous.data[previous_index]));
+            for (int i = 0; i < pixel_stride; i++)
+            {
+                diff_data[original_index + i] = bgra[i];
+            }
+        }
+    }
+    return diff;
+}
+
+Image downscale(const Image &image, int factor)
+{
+    Image scaled;
+    scaled.width = (image.width + factor - 1) / factor;
+    scaled.height = (image.height + factor - 1) / factor;
+    scaled.data.resize(scaled.width * scaled.height * pixel_stride);
+
+    for (int block_y = 0; block_y < scaled.height; block_y++)
+    {
+        for (int block_x = 0; block_x < scaled.width; block_x++)
+        {
+            int sums[pixel_stride] = {};
+            int count = 0;
+            const std::uint8_t *mark = nullptr;
+            for (int y = block_y * factor; y < std::min((block_y + 1) * factor, image.height); y++)
+            {
+                for (int x = block_x * factor; x < std::min((block_x + 1) * factor, image.width); x++)
+                {
+                    const std::uint8_t *pixel = &image.data[(y * image.width + x) * pixel_stride];
+                    for (int i = 0; i < pixel_stride; i++)
+                    {
+                        sums[i] += pixel[i];
+                    }
+                    count++;
+                    if ((pixel[0] != pixel[1] || pixel[1] != pixel[2]) && (!mark || is_red(get_bgra(pixel))))
+                    {
+                        mark = pixel;
+                    }
+                }
+            }
+
+            std::uint8_t *out = &scaled.data[(block_y * scaled.width + block_x) * pixel_stride];
+            for (int i = 0; i < pixel_stride; i++)
+            {
+                out[i] = mark ? mark[i] : static_cast<std::uint8_t>(sums[i] / count);
+            }
+        }
+    }
+    return scaled;
+}
+} // namespace reference
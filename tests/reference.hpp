@@ -0,0 +1,62 @@
+//
+//
+// Copyright the mso-test contributors
+//
+// SPDX-License-Identifier: MPL-2.0
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#ifndef REFERENCE_HPP
+#define REFERENCE_HPP
+
+#include <cstdint>
+#include <vector>
+
+// The original scalar implementation of the page analysis and comparison, kept as it was so the
+// optimised kernels in src/ can be checked against it bit for bit. Do not optimise this file.
+namespace reference
+{
+struct Image
+{
+    int width = 0;
+    int height = 0;
+    std::vector<std::uint8_t> data; // BGRA, bottom-up rows like BMP::get_data()
+};
+
+// An image with what the BMP constructor computes for it
+struct AnalysedImage
+{
+    Image image;
+    int background_value = 0;
+    int non_background_count = 0;
+    std::vector<bool> blurred_edge_mask;
+    std::vector<bool> vertical_edges;
+};
+
+struct Diff
+{
+    Image image;
+    int red_count = 0;
+    int yellow_count = 0;
+};
+
+int get_average_colour(const Image &image);
+int get_non_background_pixel_count(const Image &image, int background_value);
+
+std::vector<bool> sobel_edges(const Image &image, int threshold);
+std::vector<bool> get_vertical_edges(const Image &image, int threshold);
+std::vector<bool> blur_edge_mask(const Image &image, const std::vector<bool> &edge_map, int radius);
+std::vector<bool> filter_long_vertical_edge_runs(const Image &image, const std::vector<bool> &vertical_edges, int min_run_length);
+
+AnalysedImage analyse(const Image &image);
+
+Diff compare_bmps(const AnalysedImage &original, const AnalysedImage &target, bool enable_minor_differences);
+Diff compare_regressions(const AnalysedImage &original, const Image &current, const Image &previous);
+
+// the preview of BMP::downscale: the average of every factor x factor block, or its red pixel, or its first coloured one
+Image downscale(const Image &image, int factor);
+} // namespace reference
+
+#endif
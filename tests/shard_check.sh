@@ -0,0 +1,72 @@
+#!/bin/sh
+
+# Runs a batch as a whole on one thread and on four, and as three shards in parallel processes, merges
+# the shards and checks that the statistics files and manifests are the same in all three. The
+# shards share an output store (--store): the import and export diffs of all the documents are the
+# same image, which has to be stored once and linked 16 times. A document that fails when its shard runs
+# again makes the merge fail.
+#
+# usage: tests/shard_check.sh ./pixelbasher
+
+set -e
+
+PIXELBASHER=$(realpath "$1")
+INPUT=$(realpath converted/input)
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+mkdir -p "$WORK/out" "$WORK/whole" "$WORK/threads" "$WORK/merged" "$WORK/input"
+cp "$INPUT/authoritative-page-0.bmp" "$WORK/input" # the one of shard-a.doc, removed at the end
+for document in a b c d e f g h; do
+    authoritative="$INPUT/authoritative-page-0.bmp"
+    test $document != a || authoritative="$WORK/input/authoritative-page-0.bmp"
+    printf '%s\t%s\t%s\t%s' "shard-$document.doc" "$authoritative" "$INPUT/import-page-0.bmp" "$INPUT/export-page-0.bmp"
+    printf '\t%s' "$WORK/out" "$WORK/out" "$WORK/out" "$WORK/out" "$WORK/out" "$WORK/out" false false false false false
+    printf '\n'
+done >"$WORK/jobs.tsv"
+
+OPTIONS="--batch=$WORK/jobs.tsv --stats-format=csv,jsonl --manifest=manifest.tsv"
+(cd "$WORK/whole" && "$PIXELBASHER" $OPTIONS --threads=1)
+(cd "$WORK/threads" && "$PIXELBASHER" $OPTIONS --threads=4)
+
+PIDS=
+for shard in 1 2 3; do
+    mkdir -p "$WORK/shard-$shard"
+    (cd "$WORK/shard-$shard" && "$PIXELBASHER" $OPTIONS --shard=$shard/3 --store="$WORK/store") &
+    PIDS="$PIDS $!"
+done
+for pid in $PIDS; do
+    wait $pid
+done
+
+cd "$WORK/merged"
+"$PIXELBASHER" merge --batch="$WORK/jobs.tsv" --manifest=manifest.tsv ../shard-1/manifest.tsv ../shard-2/manifest.tsv ../shard-3/manifest.tsv
+
+for file in diff-pdf-doc-import-statistics.csv diff-pdf-doc-export-statistics.jsonl manifest.tsv; do
+    cmp "../whole/$file" "$file"
+    cmp "../threads/$file" "$file"
+done
+
+# every document ran in exactly one shard
+cat ../shard-*/diff-pdf-doc-import-statistics.csv 2>/dev/null | sort >shards.csv
+sort ../whole/diff-pdf-doc-import-statistics.csv | cmp - shards.csv
+
+test "$(find "$WORK/store" -type f | wc -l)" -eq 1
+test "$(find "$WORK/out" -type f -links 17 | wc -l)" -eq 16
+
+# shard-a.doc fails when its shard runs again: the results of the first run are gone from the shard
+# manifest and the merge has to fail instead of merging them
+rm "$WORK/input/authoritative-page-0.bmp"
+SHARD=$(grep -l "shard-a.doc" ../shard-*/manifest.tsv | sed 's|.*/shard-\([0-9]\)/.*|\1|')
+if (cd "../shard-$SHARD" && "$PIXELBASHER" $OPTIONS --shard=$SHARD/3 --store="$WORK/store" 2>/dev/null); then
+    echo "shards: a run with a missing input succeeded"
+    exit 1
+fi
+test "$(grep -c "shard-a.doc" "../shard-$SHARD/manifest.tsv")" -eq 0
+mkdir ../merged-again
+cd ../merged-again
+if "$PIXELBASHER" merge --batch="$WORK/jobs.tsv" ../shard-1/manifest.tsv ../shard-2/manifest.tsv ../shard-3/manifest.tsv 2>/dev/null; then
+    echo "shards: merged the results of a document that failed"
+    exit 1
+fi
+echo "shards: OK"
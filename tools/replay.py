@@ -0,0 +1,312 @@
+#!/usr/bin/python3
+
+# Replays a local corpus of page triples through pixelbasher and reports its throughput as JSON, so two
+# builds (or two sets of options) can be compared on the same pages. Runs offline, needs only Python 3.
+#
+#   tools/replay.py generate DIR [--seed=N] [--sheet-pages=N]     writes the synthetic corpus
+#   tools/replay.py run DIR [--binary=./pixelbasher] [--threads=1,2,4] [--repeat=N] [--output=file.json] [-- engine options]
+#   tools/replay.py compare old.json new.json
+#
+# A corpus is a directory per document, named like the document, holding original-<page>.bmp,
+# import-<page>.bmp and export-<page>.bmp and, for a document with the pages of a previous run,
+# import-previous-<page>.bmp and export-previous-<page>.bmp. Converted pages can be copied in as they are.
+#
+# Every thread count runs the whole corpus as one batch in a fresh directory. The latency of a page is
+# from its decoding to its statistics (--timings of the binary), so it includes the time it waited in the
+# pipeline; MB/s is of the BMP files read, peak RSS is of the pixelbasher process. The efficiency at N
+# threads is the pages/s at N over N times the pages/s at 1, of the fastest of the repeats.
+
+import argparse
+import hashlib
+import json
+import math
+import os
+import random
+import shutil
+import struct
+import subprocess
+import sys
+import tempfile
+import time
+
+GROUPS = ['original', 'import', 'export', 'import-previous', 'export-previous']
+
+# synthetic corpus
+
+class Page:
+    def __init__(self, width, height):
+        self.width = width
+        self.height = height
+        self.pixels = bytearray(b'\xff' * (width * height * 4))
+
+    def fill(self, x, y, width, height, gray):
+        x0, y0 = max(x, 0), max(y, 0)
+        x1, y1 = min(x + width, self.width), min(y + height, self.height)
+        if x0 >= x1 or y0 >= y1:
+            return
+        run = bytes([gray, gray, gray, 255]) * (x1 - x0)
+        for row in range(y0, y1):
+            start = (row * self.width + x0) * 4
+            self.pixels[start:start + len(run)] = run
+
+    def write(self, path):
+        # 32-bit BI_RGB, bottom-up, as the converters write them
+        size = len(self.pixels)
+        with open(path, 'wb') as output:
+            output.write(struct.pack('<2sIHHI', b'BM', 54 + size, 0, 0, 54))
+            output.write(struct.pack('<IiiHHIIiiII', 40, self.width, self.height, 1, 32, 0, size, 2835, 2835, 0, 0))
+            output.write(self.pixels)
+
+def text_shapes(rng, width, height):
+    shapes = []
+    y = 48
+    while y + 10 < height - 48:
+        x = 56 + (24 if rng.random() < 0.1 else 0)
+        end = width - 56 - rng.randrange(0, width // 3 if rng.random() < 0.2 else 8)
+        while True:
+            word = rng.randrange(8, 48)
+            if x + word > end:
+                break
+            shapes.append((x, y, word, 8, rng.choice([0, 0, 0, 64])))
+            x += word + 6
+        y += 15 + (14 if rng.random() < 0.12 else 0)
+    return shapes
+
+def sheet_shapes(rng, width, height):
+    shapes = []
+    columns = list(range(30, width - 30, 64))
+    rows = list(range(30, height - 30, 18))
+    for x in columns:
+        shapes.append((x, rows[0], 1, rows[-1] - rows[0] + 1, 160))
+    for y in rows:
+        shapes.append((columns[0], y, columns[-1] - columns[0] + 1, 1, 160))
+    for y in rows[:-1]:
+        for x in columns[:-1]:
+            if rng.random() < 0.7:
+                shapes.append((x + 64 - 6 - rng.randrange(12, 52), y + 5, rng.randrange(12, 52) // 4 * 4, 8, 0))
+    return shapes
+
+def slide_shapes(rng, width, height):
+    shapes = [(40, 30, width - 80, 40, 40)]
+    for _ in range(rng.randrange(2, 5)):
+        w, h = rng.randrange(80, width // 2), rng.randrange(60, height // 3)
+        shapes.append((rng.randrange(40, width - w - 40), rng.randrange(90, height - h - 30), w, h, rng.choice([90, 140, 200])))
+    shapes += text_shapes(rng, width, height)[::3]
+    return shapes
+
+def perturb(rng, shapes, moved, added):
+    # a round trip moves some shapes by a pixel or two (edges, yellow) and adds or drops others (red)
+    changed = list(shapes)
+    for i in rng.sample(range(len(changed)), min(moved, len(changed))):
+        x, y, w, h, gray = changed[i]
+        changed[i] = (x + rng.choice([-2, -1, 1, 2]), y + rng.choice([-1, 0, 1]), w, h, gray)
+    for _ in range(added):
+        if changed and rng.random() < 0.5:
+            changed.pop(rng.randrange(len(changed)))
+        else:
+            changed.append((rng.randrange(0, 500), rng.randrange(0, 700), rng.randrange(6, 40), rng.randrange(6, 20), 0))
+    return changed
+
+def render(shapes, width, height, path):
+    page = Page(width, height)
+    for shape in shapes:
+        page.fill(*shape)
+    page.write(path)
+
+def write_document(directory, name, rng, page_count, draw, sizes, previous=False, distinct=None):
+    # pages past the first distinct ones are hard links to them, so a long document costs no more disk
+    os.makedirs(os.path.join(directory, name))
+    distinct = distinct or page_count
+    for page in range(1, page_count + 1):
+        paths = {group: os.path.join(directory, name, '%s-%03d.bmp' % (group, page)) for group in GROUPS}
+        if page > distinct:
+            source = (page - 1) % distinct + 1
+            for group in GROUPS[:5 if previous else 3]:
+                link(os.path.join(directory, name, '%s-%03d.bmp' % (group, source)), paths[group])
+            continue
+        width, height = sizes['original']
+        shapes = draw(rng, width, height)
+        render(shapes, width, height, paths['original'])
+        current = perturb(rng, shapes, 6, 2)
+        render(current, *sizes['import'], paths['import'])
+        render(perturb(rng, shapes, 6, 2), *sizes['export'], paths['export'])
+        if previous:
+            render(perturb(rng, current, 2, 1), *sizes['import'], paths['import-previous'])
+            render(perturb(rng, shapes, 3, 1), *sizes['export'], paths['export-previous'])
+
+def link(source, destination):
+    try:
+        os.link(source, destination)
+    except OSError:
+        shutil.copyfile(source, destination)
+
+def generate(args):
+    if os.path.exists(args.directory) and os.listdir(args.directory):
+        sys.exit('Error: ' + args.directory + ' is not empty')
+    os.makedirs(args.directory, exist_ok=True)
+    rng = random.Random(args.seed)
+    a4 = {'original': (595, 842), 'import': (595, 842), 'export': (595, 842)}
+    landscape = {'original': (842, 595), 'import': (842, 595), 'export': (842, 595)}
+    slide = {'original': (720, 540), 'import': (720, 540), 'export': (720, 540)}
+    # exported to US Letter and imported a little narrower than the A4 original
+    mismatched = {'original': (595, 842), 'import': (590, 842), 'export': (612, 792)}
+
+    for letter in range(1, 9):
+        write_document(args.directory, 'letter-%d.doc' % letter, rng, 1, text_shapes, a4)
+    write_document(args.directory, 'spreadsheet.xls', rng, args.sheet_pages, sheet_shapes, landscape, distinct=8)
+    write_document(args.directory, 'report.docx', rng, 12, text_shapes, a4, previous=True)
+    write_document(args.directory, 'mismatched.doc', rng, 4, text_shapes, mismatched)
+    write_document(args.directory, 'slides.pptx', rng, 10, slide_shapes, slide, previous=True)
+
+# replay
+
+def load_corpus(directory):
+    documents = []
+    for name in sorted(os.listdir(directory)):
+        path = os.path.join(directory, name)
+        if not os.path.isdir(path):
+            continue
+        groups = {group: [] for group in GROUPS}
+        for filename in sorted(os.listdir(path)):
+            stem = filename[:-4].rsplit('-', 1)[0] if filename.endswith('.bmp') else None
+            if stem in groups:
+                groups[stem].append(os.path.abspath(os.path.join(path, filename)))
+        pages = len(groups['original'])
+        previous = len(groups['import-previous']) == pages and len(groups['export-previous']) == pages
+        if not pages or len(groups['import']) != pages or len(groups['export']) != pages:
+            sys.exit('Error: ' + path + ' needs as many import and export pages as original ones')
+        images = [image for group in GROUPS[:5 if previous else 3] for image in groups[group]]
+        documents.append({'name': name, 'pages': pages, 'images': images, 'previous': previous,
+                          'bytes': sum(os.path.getsize(image) for image in images)})
+    if not documents:
+        sys.exit('Error: no documents in ' + directory)
+    return documents
+
+def write_batch(documents, path, out):
+    with open(path, 'w') as batch:
+        for document in documents:
+            flags = ['true' if document['previous'] else 'false'] * 2 + ['false'] * 3
+            batch.write('\t'.join([document['name']] + document['images'] + [out] * 6 + flags) + '\n')
+
+def percentile(values, fraction):
+    # nearest rank
+    ordered = sorted(values)
+    return ordered[max(0, math.ceil(fraction * len(ordered)) - 1)]
+
+def run_once(binary, batch, threads, engine_options):
+    with tempfile.TemporaryDirectory(prefix='replay-') as work:
+        out = os.path.join(work, 'out')
+        os.mkdir(out)
+        write_batch(batch, os.path.join(work, 'jobs.tsv'), out)
+        command = [binary, '--batch=jobs.tsv', '--threads=%d' % threads, '--timings=timings.tsv'] + engine_options
+        start = time.perf_counter()
+        process = subprocess.Popen(command, cwd=work)
+        _, status, usage = os.wait4(process.pid, 0)
+        seconds = time.perf_counter() - start
+        code = os.waitstatus_to_exitcode(status)
+        # 2 is a page over --max-red, which is not an error of the replay
+        if code not in (0, 2):
+            sys.exit('Error: %s exited with %d' % (' '.join(command), code))
+        with open(os.path.join(work, 'timings.tsv')) as timings:
+            latencies = [float(line.split('\t')[2]) for line in timings if line.strip()]
+    return seconds, latencies, usage.ru_maxrss * 1024
+
+def run(args):
+    documents = load_corpus(args.directory)
+    pages = sum(document['pages'] for document in documents)
+    input_bytes = sum(document['bytes'] for document in documents)
+    binary = os.path.abspath(args.binary)
+    threads = sorted({1} | {int(count) for count in args.threads.split(',')})
+
+    with open(binary, 'rb') as executable:
+        build = hashlib.sha256(executable.read()).hexdigest()[:16]
+    report = {'binary': args.binary, 'build': build, 'engine_options': args.engine_options,
+              'corpus': {'directory': args.directory, 'documents': len(documents), 'pages': pages, 'bytes': input_bytes},
+              'runs': []}
+
+    for count in threads:
+        best = None
+        for _ in range(args.repeat):
+            result = run_once(binary, documents, count, args.engine_options)
+            if len(result[1]) != pages:
+                sys.exit('Error: %d of %d pages were timed' % (len(result[1]), pages))
+            if best is None or result[0] < best[0]:
+                best = result
+        seconds, latencies, rss = best
+        report['runs'].append({'threads': count, 'seconds': round(seconds, 4),
+                               'pages_per_second': round(pages / seconds, 3),
+                               'mb_per_second': round(input_bytes / seconds / 1e6, 3),
+                               'latency_ms': {name: round(percentile(latencies, fraction) * 1000, 3)
+                                              for name, fraction in (('p50', 0.5), ('p95', 0.95), ('p99', 0.99))},
+                               'peak_rss_mb': round(rss / 1e6, 1)})
+
+    single = report['runs'][0]['pages_per_second']
+    for entry in report['runs']:
+        entry['speedup'] = round(entry['pages_per_second'] / single, 3)
+        entry['efficiency'] = round(entry['speedup'] / entry['threads'], 3)
+
+    text = json.dumps(report, indent=2)
+    if args.output:
+        with open(args.output, 'w') as output:
+            output.write(text + '\n')
+    print(text)
+
+def compare(args):
+    with open(args.old) as old_file, open(args.new) as new_file:
+        old, new = json.load(old_file), json.load(new_file)
+    if old['corpus']['pages'] != new['corpus']['pages'] or old['corpus']['bytes'] != new['corpus']['bytes']:
+        print('warning: the two reports are of different corpora')
+    new_runs = {entry['threads']: entry for entry in new['runs']}
+    print('threads  pages/s old -> new       p95 ms old -> new        peak RSS MB old -> new')
+    for before in old['runs']:
+        after = new_runs.get(before['threads'])
+        if not after:
+            continue
+        print('%7d  %8.2f -> %8.2f %+6.1f%%  %8.2f -> %8.2f %+6.1f%%  %8.1f -> %8.1f' % (
+            before['threads'],
+            before['pages_per_second'], after['pages_per_second'], 100 * (after['pages_per_second'] / before['pages_per_second'] - 1),
+            before['latency_ms']['p95'], after['latency_ms']['p95'], 100 * (after['latency_ms']['p95'] / before['latency_ms']['p95'] - 1),
+            before['peak_rss_mb'], after['peak_rss_mb']))
+
+def default_threads():
+    # 1, the powers of two below the hardware threads and the hardware threads
+    cpus = os.cpu_count() or 1
+    return ','.join(str(count) for count in sorted({2 ** power for power in range(cpus.bit_length()) if 2 ** power < cpus} | {1, cpus}))
+
+def main():
+    parser = argparse.ArgumentParser(description='Replays a corpus of page triples through pixelbasher')
+    commands = parser.add_subparsers(dest='command', required=True)
+
+    command = commands.add_parser('generate', help='write the synthetic corpus')
+    command.add_argument('directory')
+    command.add_argument('--seed', type=int, default=1)
+    command.add_argument('--sheet-pages', type=int, default=200)
+    command.set_defaults(function=generate)
+
+    command = commands.add_parser('run', help='replay a corpus and report its throughput')
+    command.add_argument('directory')
+    command.add_argument('--binary', default='./pixelbasher')
+    command.add_argument('--threads', default=default_threads())
+    command.add_argument('--repeat', type=int, default=1, help='runs per thread count, the fastest is reported')
+    command.add_argument('--output', help='also write the report to this file')
+    command.set_defaults(function=run)
+
+    command = commands.add_parser('compare', help='compare the reports of two builds')
+    command.add_argument('old')
+    command.add_argument('new')
+    command.set_defaults(function=compare)
+
+    # what follows -- goes to pixelbasher as it is, argparse would take options like --threads=2 for its own
+    arguments = sys.argv[1:]
+    engine_options = []
+    if '--' in arguments:
+        split = arguments.index('--')
+        arguments, engine_options = arguments[:split], arguments[split + 1:]
+    args = parser.parse_args(arguments)
+    if engine_options and args.command != 'run':
+        parser.error('only run passes options on to pixelbasher')
+    args.engine_options = engine_options
+    args.function(args)
+
+if __name__ == '__main__':
+    main()